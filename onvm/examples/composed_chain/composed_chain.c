@@ -0,0 +1,188 @@
+/*********************************************************************
+ *                     openNetVM
+ *              https://sdnfv.github.io
+ *
+ *   BSD LICENSE
+ *
+ *   Copyright(c)
+ *            2015-2016 George Washington University
+ *            2015-2016 University of California Riverside
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * The name of the author may not be used to endorse or promote
+ *       products derived from this software without specific prior
+ *       written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * composed_chain.c - the basic_monitor and bridge handlers run as one NF.
+ ********************************************************************/
+
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <sys/queue.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <string.h>
+
+#include <rte_common.h>
+#include <rte_mbuf.h>
+#include <rte_ip.h>
+
+#include "onvm_nflib.h"
+#include "onvm_pkt_helper.h"
+
+#define NF_TAG "composed_chain"
+
+/* number of package between each print */
+static uint32_t print_delay = 1000000;
+
+/*
+ * Print a usage message
+ */
+static void
+usage(const char *progname) {
+        printf("Usage: %s [EAL args] -- [NF_LIB args] -- -p <print_delay>\n\n", progname);
+}
+
+/*
+ * Parse the application arguments.
+ */
+static int
+parse_app_args(int argc, char *argv[], const char *progname) {
+        int c;
+
+        while ((c = getopt (argc, argv, "p:")) != -1) {
+                switch (c) {
+                case 'p':
+                        print_delay = strtoul(optarg, NULL, 10);
+                        RTE_LOG(INFO, APP, "print_delay = %d\n", print_delay);
+                        break;
+                case '?':
+                        usage(progname);
+                        if (optopt == 'p')
+                                RTE_LOG(INFO, APP, "Option -%c requires an argument.\n", optopt);
+                        else if (isprint(optopt))
+                                RTE_LOG(INFO, APP, "Unknown option `-%c'.\n", optopt);
+                        else
+                                RTE_LOG(INFO, APP, "Unknown option character `\\x%x'.\n", optopt);
+                        return -1;
+                default:
+                        usage(progname);
+                        return -1;
+                }
+        }
+        return optind;
+}
+
+/*
+ * This function displays stats. It uses ANSI terminal codes to clear
+ * screen when called. It is called from a single non-master
+ * thread in the server process, when the process is run with more
+ * than one lcore enabled.
+ */
+static void
+do_stats_display(struct rte_mbuf* pkt) {
+        const char clr[] = { 27, '[', '2', 'J', '\0' };
+        const char topLeft[] = { 27, '[', '1', ';', '1', 'H', '\0' };
+        static uint64_t pkt_process = 0;
+        struct ipv4_hdr* ip;
+
+        pkt_process += print_delay;
+
+        /* Clear screen and move to top left */
+        printf("%s%s", clr, topLeft);
+
+        printf("PACKETS\n");
+        printf("-----\n");
+        printf("Port : %d\n", pkt->port);
+        printf("Size : %d\n", pkt->pkt_len);
+        printf("Hash : %u\n", pkt->hash.rss);
+        printf("N°   : %"PRIu64"\n", pkt_process);
+        printf("\n\n");
+
+        ip = onvm_pkt_ipv4_hdr(pkt);
+        if (ip != NULL) {
+                onvm_pkt_print(pkt);
+        } else {
+                printf("No IP4 header found\n");
+        }
+}
+
+/* basic_monitor's handler: count, swap the MACs and send the packet back
+ * out its port. The next stage overrides where it goes. */
+static int
+monitor_handler(struct rte_mbuf* pkt, struct onvm_pkt_meta* meta) {
+        static uint32_t counter = 0;
+        if (++counter == print_delay) {
+                do_stats_display(pkt);
+                counter = 0;
+        }
+
+        meta->action = ONVM_NF_ACTION_OUT;
+        meta->destination = pkt->port;
+
+        if (onvm_pkt_mac_addr_swap(pkt, 0) != 0) {
+                printf("ERROR: MAC failed to swap!\n");
+        }
+        return 0;
+}
+
+/* bridge's handler, the last stage: out the other port */
+static int
+bridge_handler(struct rte_mbuf* pkt, struct onvm_pkt_meta* meta) {
+        if (pkt->port == 0) {
+                meta->destination = 1;
+        }
+        else {
+                meta->destination = 0;
+        }
+        meta->action = ONVM_NF_ACTION_OUT;
+        return 0;
+}
+
+
+int main(int argc, char *argv[]) {
+        int arg_offset;
+        struct onvm_nf_info *nf_info;
+        const char *progname = argv[0];
+        pkt_handler stages[] = { &monitor_handler, &bridge_handler };
+
+        if ((arg_offset = onvm_nflib_init(argc, argv, NF_TAG, &nf_info)) < 0)
+                return -1;
+        argc -= arg_offset;
+        argv += arg_offset;
+
+        if (parse_app_args(argc, argv, progname) < 0) {
+                onvm_nflib_stop(nf_info);
+                rte_exit(EXIT_FAILURE, "Invalid command-line arguments\n");
+        }
+
+        onvm_nflib_run_composed(nf_info, stages, RTE_DIM(stages));
+        printf("If we reach here, program is ending\n");
+        return 0;
+}
@@ -102,8 +102,6 @@ cleanup(void) {
         printf("Freeing memory for SDN rings.\n");
         rte_ring_free(ring_to_sdn);
         rte_ring_free(ring_from_sdn);
-        printf("Freeing memory for hash table.\n");
-        rte_hash_free(sdn_ft->hash);
 }
 
 static int
@@ -134,15 +132,13 @@ parse_app_args(int argc, char *argv[]) {
 }
 
 static void
-do_stats_display(struct rte_mbuf* pkt, int32_t tbl_index) {
+do_stats_display(struct rte_mbuf* pkt, int32_t tbl_index, struct onvm_flow_entry *flow_entry) {
         const char clr[] = { 27, '[', '2', 'J', '\0' };
         const char topLeft[] = { 27, '[', '1', ';', '1', 'H', '\0' };
         static uint64_t total_pkts = 0;
         /* Fix unused variable warnings: */
         (void)pkt;
 
-
-        struct onvm_flow_entry *flow_entry = (struct onvm_flow_entry *)onvm_ft_get_data(sdn_ft, tbl_index);
         total_pkts += print_delay;
 
         /* Clear screen and move to top left */
@@ -236,7 +232,7 @@ packet_handler(struct rte_mbuf* pkt, struct onvm_pkt_meta* meta) {
 
         if (++counter == print_delay && print_delay != 0) {
 		if (tbl_index >= 0) {
-                	do_stats_display(pkt, tbl_index);
+                	do_stats_display(pkt, tbl_index, flow_entry);
                 	counter = 0;
 		}
         }
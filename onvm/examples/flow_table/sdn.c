@@ -221,29 +221,75 @@ void datapath_handle_read(struct datapath *dp)
                                 struct onvm_service_chain *sc;
                                 struct onvm_flow_entry *flow_entry = NULL;
                                 uint32_t buffer_id = ntohl(fm->buffer_id);
+                                uint16_t command = ntohs(fm->command);
+                                struct onvm_ft_ipv4_5tuple mask;
+                                struct sdn_pkt_list* sdn_list;
+                                fk = flow_key_extract(&fm->match);
+                                if (flow_mask_extract(&fm->match, &mask)) {
+                                        /* One rule for all the flows it matches, they are
+                                         * cached as they show up. Rules may be installed
+                                         * ahead of any packet, without a buffer. */
+                                        onvm_flow_dir_lock();
+                                        if (command == OFPFC_DELETE || command == OFPFC_DELETE_STRICT) {
+                                                onvm_flow_dir_del_rule(fk, &mask);
+                                                onvm_flow_dir_unlock();
+                                                rte_free(fk);
+                                                break;
+                                        }
+                                        size_t actions_len = ntohs(fm->header.length) - sizeof(*fm);
+                                        sc = flow_action_extract(&fm->actions[0], actions_len);
+                                        ret = onvm_flow_dir_add_rule(fk, &mask, ntohs(fm->priority),
+                                                                     ntohs(fm->idle_timeout), ntohs(fm->hard_timeout), sc);
+                                        onvm_flow_dir_unlock();
+                                        rte_free(fk);
+                                        if (ret < 0) {
+                                                debug_msg(dp, "no space for wildcard rule, dropping flow_mod");
+                                                rte_free(sc);
+                                                break;
+                                        }
+                                        if (buffer_id != UINT32_MAX) {
+                                                sdn_list = (struct sdn_pkt_list *)onvm_ft_get_data(pkt_buf_ft, buffer_id);
+                                                sdn_pkt_list_flush(sdn_list);
+                                        }
+                                        break;
+                                }
 				if (buffer_id == UINT32_MAX) {
+					rte_free(fk);
 					break;
 				}
-                                struct sdn_pkt_list* sdn_list;
-                                fk = flow_key_extract(&fm->match);
                                 size_t actions_len = ntohs(fm->header.length) - sizeof(*fm);
                                 sc = flow_action_extract(&fm->actions[0], actions_len);
+                                /* Keep the manager from expiring the entry while we rewrite it */
+                                onvm_flow_dir_lock();
                                 ret = onvm_flow_dir_get_key(fk, &flow_entry);
                                 if (ret == -ENOENT) {
                                         ret = onvm_flow_dir_add_key(fk, &flow_entry);
+                                        if (ret < 0) {
+                                                /* Table full until the manager expires some flows */
+                                                onvm_flow_dir_unlock();
+                                                debug_msg(dp, "flow table full, dropping flow_mod");
+                                                rte_free(fk);
+                                                rte_free(sc);
+                                                break;
+                                        }
+                                        memset(flow_entry, 0, sizeof(struct onvm_flow_entry));
+                                        flow_entry->key = fk;
                                 }
 				else if (ret >= 0) {
-					rte_free(flow_entry->key);
-					rte_free(flow_entry->sc);
+					/* Packets may be using the entry, keep its key and only swap the chain */
+					rte_free(fk);
 				}
 				else {
 					rte_exit(EXIT_FAILURE, "onvm_flow_dir_get parameters are invalid");
 				}
-                                memset(flow_entry, 0, sizeof(struct onvm_flow_entry));
-                                flow_entry->key = fk;
-                                flow_entry->sc = sc;
-                                flow_entry->idle_timeout = OFP_FLOW_PERMANENT;
-                                flow_entry->hard_timeout = OFP_FLOW_PERMANENT;
+                                flow_entry->idle_timeout = ntohs(fm->idle_timeout);
+                                flow_entry->hard_timeout = ntohs(fm->hard_timeout);
+                                /* A re-install starts the timeouts over */
+                                flow_entry->expire_armed = 0;
+                                /* The flow may have been cached from a rule, it is its own now */
+                                flow_entry->rule_gen = 0;
+                                onvm_flow_dir_set_chain(flow_entry, sc);
+                                onvm_flow_dir_unlock();
                                 sdn_list = (struct sdn_pkt_list *)onvm_ft_get_data(pkt_buf_ft, buffer_id);
                                 sdn_pkt_list_flush(sdn_list);
                                 break;
@@ -475,6 +521,28 @@ struct onvm_ft_ipv4_5tuple* flow_key_extract(struct ofp_match *match)
         return fk;
 }
 
+/* The bits of the 5-tuple the match compares. Fields the flow key doesn't
+ * have (ports, MACs, VLAN, ToS) are not matched on. Returns nonzero if
+ * anything is wildcarded. */
+int flow_mask_extract(struct ofp_match *match, struct onvm_ft_ipv4_5tuple *mask)
+{
+        uint32_t wildcards = ntohl(match->wildcards);
+        uint32_t src_bits, dst_bits;
+
+        src_bits = (wildcards & OFPFW_NW_SRC_MASK) >> OFPFW_NW_SRC_SHIFT;
+        dst_bits = (wildcards & OFPFW_NW_DST_MASK) >> OFPFW_NW_DST_SHIFT;
+
+        memset(mask, 0, sizeof(struct onvm_ft_ipv4_5tuple));
+        mask->src_addr = src_bits >= 32 ? 0 : htonl(UINT32_MAX << src_bits);
+        mask->dst_addr = dst_bits >= 32 ? 0 : htonl(UINT32_MAX << dst_bits);
+        mask->proto = (wildcards & OFPFW_NW_PROTO) ? 0 : UINT8_MAX;
+        mask->src_port = (wildcards & OFPFW_TP_SRC) ? 0 : UINT16_MAX;
+        mask->dst_port = (wildcards & OFPFW_TP_DST) ? 0 : UINT16_MAX;
+
+        return src_bits != 0 || dst_bits != 0 ||
+                (wildcards & (OFPFW_NW_PROTO | OFPFW_TP_SRC | OFPFW_TP_DST)) != 0;
+}
+
 struct onvm_service_chain*
 flow_action_extract(struct ofp_action_header *oah, size_t actions_len)
 {
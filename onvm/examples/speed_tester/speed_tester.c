@@ -243,12 +243,12 @@ run_advanced_rings(struct onvm_nf_info *nf_info) {
                 }
 
                 if (unlikely(tx_batch_size > 0 && rte_ring_enqueue_bulk(tx_ring, pktsTX, tx_batch_size) == -ENOBUFS)) {
-                        tx_stats->tx_drop[nf_info->instance_id] += tx_batch_size;
+                        tx_stats->tx_drop += tx_batch_size;
                         for (j = 0; j < tx_batch_size; j++) {
                                 rte_pktmbuf_free(pktsTX[j]);
                         }
                 } else {
-                        tx_stats->tx[nf_info->instance_id] += tx_batch_size;
+                        tx_stats->tx += tx_batch_size;
                 }
 
         }
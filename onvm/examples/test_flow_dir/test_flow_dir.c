@@ -153,6 +153,7 @@ static int
 packet_handler(struct rte_mbuf* pkt, struct onvm_pkt_meta* meta) {
         static uint32_t counter = 0;
 	struct onvm_flow_entry *flow_entry = NULL;
+	struct onvm_service_chain *sc;
 	int ret;
 
 	if (++counter == print_delay) {
@@ -173,12 +174,18 @@ packet_handler(struct rte_mbuf* pkt, struct onvm_pkt_meta* meta) {
 	if (ret >= 0) {
         	meta->action = ONVM_NF_ACTION_NEXT;
 	}
-	else {
+	/* We are a reader here, don't wait for writers. The flow's next
+	 * packet tries again. */
+	else if (onvm_flow_dir_trylock()) {
 		ret = onvm_flow_dir_add_pkt(pkt, &flow_entry);
-		memset(flow_entry, 0, sizeof(struct onvm_flow_entry));
-		flow_entry->sc = onvm_sc_create();
-		onvm_sc_append_entry(flow_entry->sc, ONVM_NF_ACTION_TONF, destination);
-		//onvm_sc_print(flow_entry->sc);
+		if (ret >= 0) {
+			memset(flow_entry, 0, sizeof(struct onvm_flow_entry));
+			sc = onvm_sc_create();
+			onvm_sc_append_entry(sc, ONVM_NF_ACTION_TONF, destination);
+			//onvm_sc_print(sc);
+			onvm_flow_dir_set_chain(flow_entry, sc);
+		}
+		onvm_flow_dir_unlock();
 	}
        	return 0;
 }
@@ -1,7 +1,7 @@
 #!/bin/bash
 
 function usage {
-        echo "$0 CPU-LIST PORTMASK [-r NUM-SERVICES] [-d DEFAULT-SERVICE] [-s STATS-OUTPUT]"
+        echo "$0 CPU-LIST PORTMASK [-r NUM-SERVICES] [-d DEFAULT-SERVICE] [-s STATS-OUTPUT] [-m REMOTE-MODE] [-i TUNNEL-IP] [-t NUM-RX-THREADS] [-q RX-QUEUES] [-b BATCH-SIZE] [-u FLUSH-LATENCY] [-L] [-e EXPORTER-PORT] [-f FLOW-ENTRIES] [-S]"
         # this works well on our 2x6-core nodes
         echo "$0 0,1,2,6 3 --> cores 0, 1, 2 and 6 with ports 0 and 1"
         echo -e "\tCores will be used as follows in numerical order:"
@@ -12,6 +12,20 @@ function usage {
         echo -e "\tRuns ONVM the same way as above, but prints statistics to stdout"
         echo -e "$0 0,1,2,6 3 -r 10 -d 2"
         echo -e "\tRuns ONVM the same way as above, but limits max service IDs to 10 and uses service ID 2 as the default"
+        echo -e "$0 0,1,2,3,6 3 -t 2"
+        echo -e "\tRuns ONVM with 2 RX threads, each polling its own RSS queue of both ports"
+        echo -e "$0 0,1,2,3,6 3 -q \"(0,0,1),(1,0,1),(0,1,2),(1,1,2)\""
+        echo -e "\tRuns ONVM the same way, but picks the RX cores explicitly as (port,queue,core)"
+        echo -e "$0 0,1,2,6 3 -b 16 -u 20"
+        echo -e "\tRuns ONVM sending batches of 16 packets, holding a packet at most 20us for its batch to fill"
+        echo -e "$0 0,1,2,6 3 -s stdout -L"
+        echo -e "\tRuns ONVM printing per NF and end-to-end latency percentiles with the statistics"
+        echo -e "$0 0,1,2,6 3 -e 9100"
+        echo -e "\tRuns ONVM serving Prometheus metrics on http://127.0.0.1:9100/metrics"
+        echo -e "$0 0,1,2,6 3 -f 1048576"
+        echo -e "\tRuns ONVM with room for a million flows in the flow table before it has to grow"
+        echo -e "$0 0,1,2,3,6 3 -t 2 -S"
+        echo -e "\tRuns ONVM with 2 RX threads, each looking up flows in its own half of the flow table"
         exit 1
 }
 
@@ -28,12 +42,22 @@ then
     usage
 fi
 
-while getopts "r:d:s:" opt; do
+while getopts "r:d:s:m:i:t:q:b:u:Le:f:S" opt; do
   case $opt in
     v) virt_addr="--base-virtaddr=$OPTARG";;
     r) num_srvc="-r $OPTARG";;
     d) def_srvc="-d $optarg";;
     s) stats="-s $OPTARG";;
+    m) remote_mode="-m $OPTARG";;
+    i) tunnel_ip="-i $OPTARG";;
+    t) rx_threads="-n $OPTARG";;
+    q) rx_queues="-q $OPTARG";;
+    b) batch_size="-b $OPTARG";;
+    u) flush_latency="-u $OPTARG";;
+    L) track_latency="-L";;
+    e) exporter_port="-e $OPTARG";;
+    f) flow_entries="-f $OPTARG";;
+    S) shard_flows="-S";;
     \?) echo "Unknown option -$OPTARG" && usage
     ;;
   esac
@@ -58,7 +82,7 @@ if [[ -n "$ONVM_DISTRIBUTED" ]]; then
 fi
 
 sudo rm -rf /mnt/huge/rtemap_*
-sudo $SCRIPTPATH/onvm_mgr/onvm_mgr/$RTE_TARGET/onvm_mgr -l $cpu -n 4 --proc-type=primary ${virt_addr} -- -p ${ports} ${num_srvc} ${def_srvc} ${stats} ${distributed_flag}
+sudo $SCRIPTPATH/onvm_mgr/onvm_mgr/$RTE_TARGET/onvm_mgr -l $cpu -n 4 --proc-type=primary ${virt_addr} -- -p ${ports} ${num_srvc} ${def_srvc} ${stats} ${distributed_flag} ${remote_mode} ${tunnel_ip} ${rx_threads} ${rx_queues} ${batch_size} ${flush_latency} ${track_latency} ${exporter_port} ${flow_entries} ${shard_flows}
 
 if [ "${stats}" = "-s web" ]
 then
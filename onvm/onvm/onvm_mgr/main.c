@@ -55,6 +55,9 @@
 #include "onvm_stats.h"
 #include "onvm_pkt.h"
 #include "onvm_nf.h"
+#include "onvm_sched.h"
+#include "onvm_exporter.h"
+#include "onvm_flow_expire.h"
 #include "onvm_zookeeper.h"
 #include "onvm_zk_common.h"
 
@@ -72,6 +75,8 @@ static uint8_t worker_keep_running = 1;
 
 static void handle_signal(int sig);
 
+static unsigned get_next_worker_lcore(unsigned lcore);
+
 /*******************************Worker threads********************************/
 
 /*
@@ -90,16 +95,26 @@ master_thread_main(void) {
                 RTE_LOG(INFO, APP, "\tTo activate, please run $ONVM_HOME/onvm_web/start_web_console.sh\n");
         }
 
+        /* Started from here so it shares the master lcore */
+        if (exporter_port != 0 && onvm_exporter_start(exporter_port) != 0)
+                RTE_LOG(INFO, APP, "Cannot start the metrics exporter\n");
+
+        if (onvm_flow_expire_start() != 0)
+                RTE_LOG(INFO, APP, "Cannot start flow expiry, flow table entries will not time out or grow\n");
+
         /* Longer initial pause so above printf is seen */
         sleep(sleeptime * 3);
 
         /* Loop forever: sleep always returns 0 or <= param */
         while ( main_keep_running && sleep(sleeptime) <= sleeptime) {
                 onvm_nf_check_status();
+                onvm_sched_balance(sleeptime);
                 onvm_stats_display_all(sleeptime);
         }
 
         /* Close out file references and things */
+        onvm_flow_expire_stop();
+        onvm_exporter_stop();
         onvm_stats_cleanup();
 
         RTE_LOG(INFO, APP, "Core %d: Initiating shutdown sequence\n", rte_lcore_id());
@@ -142,19 +157,24 @@ rx_thread_main(void *arg) {
         uint16_t i, rx_count;
         struct rte_mbuf *pkts[PACKET_READ_SIZE];
         struct thread_info *rx = (struct thread_info*)arg;
+        struct rx_queue_conf *q;
 
-        RTE_LOG(INFO,
-                APP,
-                "Core %d: Running RX thread for RX queue %d\n",
-                rte_lcore_id(),
-                rx->queue_id);
+        for (i = 0; i < rx->num_rx_queues; i++) {
+                RTE_LOG(INFO,
+                        APP,
+                        "Core %d: Running RX thread for port %u RX queue %u\n",
+                        rte_lcore_id(),
+                        (unsigned)rx->rx_queues[i].port,
+                        (unsigned)rx->rx_queues[i].queue);
+        }
 
         for (; worker_keep_running;) {
-                /* Read ports */
-                for (i = 0; i < ports->num_ports; i++) {
-                        rx_count = rte_eth_rx_burst(ports->id[i], rx->queue_id, \
+                /* Read our queues, RSS keeps each flow on one of them */
+                for (i = 0; i < rx->num_rx_queues; i++) {
+                        q = &rx->rx_queues[i];
+                        rx_count = rte_eth_rx_burst(q->port, q->queue, \
                                         pkts, PACKET_READ_SIZE);
-                        ports->rx_stats.rx[ports->id[i]] += rx_count;
+                        rx->stats->port_rx[q->port] += rx_count;
 
                         /* Now process the NIC packets read */
                         if (likely(rx_count > 0)) {
@@ -167,11 +187,14 @@ rx_thread_main(void *arg) {
                         }
                 }
 
-                /* Send a burst to every port */
-                onvm_pkt_flush_all_ports(rx);
+                /* Send the bursts that are due */
+                onvm_pkt_flush_expired(rx);
 
+                /* Done with any shared data read for this batch */
+                onvm_qsbr_quiescent(mgr_qsbr, rx->qsbr_id);
         }
 
+        onvm_qsbr_unregister(mgr_qsbr, rx->qsbr_id);
         RTE_LOG(INFO, APP, "Core %d: RX thread done\n", rte_lcore_id());
 
         return 0;
@@ -184,30 +207,38 @@ tx_thread_main(void *arg) {
         unsigned i, tx_count;
         struct rte_mbuf *pkts[PACKET_READ_SIZE];
         struct thread_info* tx = (struct thread_info*)arg;
+        const struct tx_nf_list *nfs;
 
-        if (tx->first_cl == tx->last_cl - 1) {
-                RTE_LOG(INFO,
-                        APP,
-                        "Core %d: Running TX thread for NF %d\n",
-                        rte_lcore_id(),
-                        tx->first_cl);
-        } else if (tx->first_cl < tx->last_cl) {
-                RTE_LOG(INFO,
-                        APP,
-                        "Core %d: Running TX thread for NFs %d to %d\n",
-                        rte_lcore_id(),
-                        tx->first_cl,
-                        tx->last_cl-1);
-        }
+        RTE_LOG(INFO, APP, "Core %d: Running TX thread on NIC TX queue %u\n", rte_lcore_id(), tx->tx_queue_id);
 
         for (; worker_keep_running;) {
+                /* The master may hand us a new list between passes */
+                nfs = tx->nfs;
+                if (nfs->count == 0) {
+                        /* Parked: nothing to serve, so sleep instead of spinning */
+                        onvm_pkt_flush_all_ports(tx);
+                        onvm_pkt_flush_all_nfs(tx);
+                        if (tx->num_dirty_nfs == 0) {
+                                onvm_qsbr_offline(mgr_qsbr, tx->qsbr_id);
+                                usleep(TX_SCHED_PARK_US);
+                                onvm_qsbr_online(mgr_qsbr, tx->qsbr_id);
+                        } else {
+                                /* Still holding packets for a backed up NF */
+                                onvm_qsbr_quiescent(mgr_qsbr, tx->qsbr_id);
+                        }
+                        continue;
+                }
 
                 /* Read packets from the client's tx queue and process them as needed */
-                for (i = tx->first_cl; i < tx->last_cl; i++) {
-                        cl = &clients[i];
+                for (i = 0; i < nfs->count; i++) {
+                        cl = &clients[nfs->id[i]];
                         if (!onvm_nf_is_valid(cl))
                                 continue;
 
+                        /* Backpressure: leave the packets in the NF's ring */
+                        if (unlikely(onvm_pkt_nf_blocked(tx, nfs->id[i])))
+                                continue;
+
 			/* Dequeue all packets in ring up to max possible. */
 			tx_count = rte_ring_dequeue_burst(cl->tx_q, (void **) pkts, PACKET_READ_SIZE);
 
@@ -217,13 +248,14 @@ tx_thread_main(void *arg) {
                         }
                 }
 
-                /* Send a burst to every port */
-                onvm_pkt_flush_all_ports(tx);
+                /* Send the bursts that are due */
+                onvm_pkt_flush_expired(tx);
 
-                /* Send a burst to every NF */
-                onvm_pkt_flush_all_nfs(tx);
+                /* Done with any shared data read for this batch */
+                onvm_qsbr_quiescent(mgr_qsbr, tx->qsbr_id);
         }
 
+        onvm_qsbr_unregister(mgr_qsbr, tx->qsbr_id);
         RTE_LOG(INFO, APP, "Core %d: TX thread done\n", rte_lcore_id());
 
         return 0;
@@ -236,6 +268,25 @@ handle_signal(int sig) {
         }
 }
 
+/*
+ * Returns the next worker lcore after lcore that -q has not already
+ * claimed for an RX thread.
+ */
+static unsigned
+get_next_worker_lcore(unsigned lcore) {
+        uint16_t i;
+
+        for (;;) {
+                lcore = rte_get_next_lcore(lcore, 1, 1);
+                for (i = 0; i < num_rx_queue_conf; i++) {
+                        if (rx_queue_conf[i].lcore == lcore)
+                                break;
+                }
+                if (i == num_rx_queue_conf)
+                        return lcore;
+        }
+}
+
 
 /*******************************Main function*********************************/
 
@@ -243,7 +294,7 @@ handle_signal(int sig) {
 int
 main(int argc, char *argv[]) {
         unsigned cur_lcore, rx_lcores, tx_lcores;
-        unsigned clients_per_tx;
+        struct thread_info *tx_threads[RTE_MAX_LCORE];
         unsigned i;
         int ret;
         const char *port_mac;
@@ -258,31 +309,35 @@ main(int argc, char *argv[]) {
 
         /* clear statistics */
         onvm_stats_clear_all_clients();
+        if (onvm_stats_shm_init() != 0)
+                RTE_LOG(INFO, APP, "Cannot create the shared stats segment, keeping stats private\n");
 
-        /* Reserve n cores for: 1 Stats, 1 final Tx out, and ONVM_NUM_RX_THREADS for Rx */
+        /* Reserve n cores for: 1 Stats, num_rx_threads for Rx, and the rest for Tx */
         cur_lcore = rte_lcore_id();
-        rx_lcores = ONVM_NUM_RX_THREADS;
+        rx_lcores = num_rx_threads;
+        if (rte_lcore_count() < rx_lcores + 2) {
+                RTE_LOG(ERR, APP, "Need at least %u cores for %u RX threads, 1 TX thread and stats\n",
+                        rx_lcores + 2, rx_lcores);
+                return -1;
+        }
         tx_lcores = rte_lcore_count() - rx_lcores - 1;
 
-        /* Offset cur_lcore to start assigning TX cores */
-        cur_lcore += (rx_lcores-1);
+        for (i = 0; i < num_rx_queue_conf; i++) {
+                if (rx_queue_conf[i].lcore == RX_LCORE_AUTO)
+                        continue;
+                if (!rte_lcore_is_enabled(rx_queue_conf[i].lcore) ||
+                    rx_queue_conf[i].lcore == rte_get_master_lcore()) {
+                        RTE_LOG(ERR, APP, "Core %u can't be used for RX, it is not an enabled worker core\n",
+                                rx_queue_conf[i].lcore);
+                        return -1;
+                }
+        }
 
         RTE_LOG(INFO, APP, "%d cores available in total\n", rte_lcore_count());
         RTE_LOG(INFO, APP, "%d cores available for handling manager RX queues\n", rx_lcores);
         RTE_LOG(INFO, APP, "%d cores available for handling TX queues\n", tx_lcores);
         RTE_LOG(INFO, APP, "%d cores available for handling stats\n", 1);
 
-        /* Evenly assign NFs to TX threads */
-
-        /*
-         * If num clients is zero, then we are running in dynamic NF mode.
-         * We do not have a way to tell the total number of NFs running so
-         * we have to calculate clients_per_tx using MAX_CLIENTS then.
-         * We want to distribute the number of running NFs across available
-         * TX threads
-         */
-        clients_per_tx = ceil((float)MAX_CLIENTS/tx_lcores);
-
         // We start the system with 0 NFs active
         num_clients = 0;
 
@@ -292,35 +347,102 @@ main(int argc, char *argv[]) {
 
         for (i = 0; i < tx_lcores; i++) {
                 struct thread_info *tx = calloc(1, sizeof(struct thread_info));
-                tx->queue_id = i;
+                tx->tx_queue_id = ports->nf_tx_queues + i;
                 tx->port_tx_buf = calloc(RTE_MAX_ETHPORTS, sizeof(struct packet_buf));
                 tx->nf_rx_buf = calloc(MAX_CLIENTS, sizeof(struct packet_buf));
-                tx->first_cl = RTE_MIN(i * clients_per_tx + 1, (unsigned)MAX_CLIENTS);
-                tx->last_cl = RTE_MIN((i+1) * clients_per_tx + 1, (unsigned)MAX_CLIENTS);
-                cur_lcore = rte_get_next_lcore(cur_lcore, 1, 1);
-                if (rte_eal_remote_launch(tx_thread_main, (void*)tx,  cur_lcore) == -EBUSY) {
+                tx->stats = rte_zmalloc("thread stats", sizeof(struct thread_stats), RTE_CACHE_LINE_SIZE);
+                if (tx->stats == NULL) {
+                        RTE_LOG(ERR, APP, "Cannot allocate stats for TX thread %d\n", i);
+                        return -1;
+                }
+                if (track_latency) {
+                        tx->e2e_hist = rte_calloc("e2e latency", MAX_CLIENTS, sizeof(struct onvm_hist), 0);
+                        if (tx->e2e_hist == NULL) {
+                                RTE_LOG(ERR, APP, "Cannot allocate latency histograms for TX thread %d\n", i);
+                                return -1;
+                        }
+                }
+                onvm_stats_add_thread(tx);
+                tx->qsbr_id = onvm_qsbr_register(mgr_qsbr);
+                if (tx->qsbr_id == ONVM_QSBR_NO_READER) {
+                        RTE_LOG(ERR, APP, "No QSBR reader slot left for TX thread %d\n", i);
+                        return -1;
+                }
+                if (is_distributed == DISTRIBUTED) {
+                        tx->remote_flows = onvm_zk_flow_table_create();
+                        if (tx->remote_flows == NULL)
+                                RTE_LOG(INFO, APP, "No remote flow table for TX thread %d, remote flows will not be pinned\n", i);
+                }
+                tx_threads[i] = tx;
+        }
+
+        /* NFs are spread over the TX threads by the master as they come and go */
+        if (onvm_sched_init(tx_threads, tx_lcores) != 0) {
+                RTE_LOG(ERR, APP, "Cannot allocate TX thread NF lists\n");
+                return -1;
+        }
+
+        for (i = 0; i < tx_lcores; i++) {
+                cur_lcore = get_next_worker_lcore(cur_lcore);
+                if (rte_eal_remote_launch(tx_thread_main, (void*)tx_threads[i],  cur_lcore) == -EBUSY) {
                         RTE_LOG(ERR,
                                 APP,
-                                "Core %d is already busy, can't use for client %d TX\n",
+                                "Core %d is already busy, can't use for TX thread %d\n",
                                 cur_lcore,
-                                tx->first_cl);
+                                i);
                         return -1;
                 }
         }
 
-        /* Launch RX thread main function for each RX queue on cores */
+        /* Launch RX thread main function for each group of RX queues on cores */
         for (i = 0; i < rx_lcores; i++) {
                 struct thread_info *rx = calloc(1, sizeof(struct thread_info));
-                rx->queue_id = i;
+                unsigned rx_lcore = RX_LCORE_AUTO;
+                uint16_t j;
+
+                rx->tx_queue_id = ports->nf_tx_queues + tx_lcores + i;
+                rx->rx_queues = calloc(num_rx_queue_conf, sizeof(struct rx_queue_conf));
+                for (j = 0; j < num_rx_queue_conf; j++) {
+                        if (rx_queue_conf[j].thread != i)
+                                continue;
+                        rx->rx_queues[rx->num_rx_queues++] = rx_queue_conf[j];
+                        rx_lcore = rx_queue_conf[j].lcore;
+                }
                 rx->port_tx_buf = calloc(RTE_MAX_ETHPORTS, sizeof(struct packet_buf));
                 rx->nf_rx_buf = calloc(MAX_CLIENTS, sizeof(struct packet_buf));
-                cur_lcore = rte_get_next_lcore(cur_lcore, 1, 1);
-                if (rte_eal_remote_launch(rx_thread_main, (void *)rx, cur_lcore) == -EBUSY) {
+                rx->stats = rte_zmalloc("thread stats", sizeof(struct thread_stats), RTE_CACHE_LINE_SIZE);
+                if (rx->stats == NULL) {
+                        RTE_LOG(ERR, APP, "Cannot allocate stats for RX thread %d\n", i);
+                        return -1;
+                }
+                if (track_latency) {
+                        rx->e2e_hist = rte_calloc("e2e latency", MAX_CLIENTS, sizeof(struct onvm_hist), 0);
+                        if (rx->e2e_hist == NULL) {
+                                RTE_LOG(ERR, APP, "Cannot allocate latency histograms for RX thread %d\n", i);
+                                return -1;
+                        }
+                }
+                onvm_stats_add_thread(rx);
+                rx->qsbr_id = onvm_qsbr_register(mgr_qsbr);
+                if (rx->qsbr_id == ONVM_QSBR_NO_READER) {
+                        RTE_LOG(ERR, APP, "No QSBR reader slot left for RX thread %d\n", i);
+                        return -1;
+                }
+                if (is_distributed == DISTRIBUTED) {
+                        rx->remote_flows = onvm_zk_flow_table_create();
+                        if (rx->remote_flows == NULL)
+                                RTE_LOG(INFO, APP, "No remote flow table for RX thread %d, remote flows will not be pinned\n", i);
+                }
+                if (rx_lcore == RX_LCORE_AUTO) {
+                        cur_lcore = get_next_worker_lcore(cur_lcore);
+                        rx_lcore = cur_lcore;
+                }
+                if (rte_eal_remote_launch(rx_thread_main, (void *)rx, rx_lcore) == -EBUSY) {
                         RTE_LOG(ERR,
                                 APP,
-                                "Core %d is already busy, can't use for RX queue id %d\n",
-                                cur_lcore,
-                                rx->queue_id);
+                                "Core %u is already busy, can't use for RX thread %u\n",
+                                rx_lcore,
+                                i);
                         return -1;
                 }
         }
@@ -331,7 +453,7 @@ main(int argc, char *argv[]) {
                 RTE_LOG(INFO, APP, "Connected to ZooKeeper, id %" PRId64 "\n", onvm_zk_client_id());
 
                 port_mac = onvm_stats_print_MAC(ports->id[0]);
-                ret = onvm_zk_init(port_mac);
+                ret = onvm_zk_init(port_mac, tunnel_ip);
                 if (ret != ZOK) {
                         RTE_LOG(ERR, APP, "Error doing zookeeper init, bailing. %s\n", zk_status_to_string(ret));
                         return -1;
@@ -49,8 +49,15 @@
 ******************************************************************************/
 
 
+#include <arpa/inet.h>
+
+#include "onvm_mgr/onvm_mgr.h"
 #include "onvm_mgr/onvm_args.h"
 #include "onvm_mgr/onvm_stats.h"
+#include "onvm_mgr/onvm_vxlan.h"
+
+
+#define USEC_PER_SEC 1000000
 
 
 /******************************Global variables*******************************/
@@ -71,6 +78,40 @@ ONVM_STATS_OUTPUT stats_destination = ONVM_STATS_NONE;
 /* global var: are we running in distributed mode? - extern in init.h */
 uint8_t is_distributed;
 
+/* global var for how new flows pick a remote manager - extern in init.h */
+uint8_t remote_selection = REMOTE_SELECT_RSS;
+
+/* global var for the IP other managers tunnel to, network order - extern in init.h */
+uint32_t tunnel_ip;
+
+/* global var for the number of RX threads - extern in init.h */
+uint16_t num_rx_threads = ONVM_NUM_RX_THREADS;
+
+/* RX threads asked for with -n and implied by -q, check_rx_queue_conf picks one */
+static uint16_t rx_threads_arg = ONVM_NUM_RX_THREADS;
+static uint16_t rx_queue_conf_threads;
+
+/* global vars for which RX thread polls each port queue - extern in init.h */
+struct rx_queue_conf rx_queue_conf[ONVM_MAX_RX_QUEUE_CONF];
+uint16_t num_rx_queue_conf;
+
+/* global vars for when buffered packets are sent - extern in init.h */
+uint16_t batch_size = PACKET_READ_SIZE;
+uint32_t flush_latency_us;
+uint64_t flush_latency_cycles;
+
+/* global var for whether packet latency is measured - extern in init.h */
+uint8_t track_latency;
+
+/* global var for the metrics exporter's TCP port, 0 if disabled - extern in init.h */
+uint16_t exporter_port;
+
+/* global var for the initial number of flow table entries - extern in init.h */
+uint32_t flow_entries = SDN_FT_ENTRIES;
+
+/* global var for whether the flow table is split by RX queue - extern in init.h */
+uint8_t shard_flows;
+
 /* global var for program name */
 static const char *progname;
 
@@ -96,6 +137,33 @@ parse_num_services(const char *services);
 static int
 parse_stats_output(const char *stats_output);
 
+static int
+parse_remote_selection(const char *mode);
+
+static int
+parse_tunnel_ip(const char *ip);
+
+static int
+parse_num_rx_threads(const char *threads);
+
+static int
+parse_rx_queue_conf(const char *conf);
+
+static int
+check_rx_queue_conf(void);
+
+static int
+parse_batch_size(const char *size);
+
+static int
+parse_flush_latency(const char *latency);
+
+static int
+parse_exporter_port(const char *port);
+
+static int
+parse_flow_entries(const char *entries);
+
 
 /*********************************Interfaces**********************************/
 
@@ -109,13 +177,27 @@ parse_app_args(uint8_t max_ports, int argc, char *argv[]) {
                 {"port-mask",           required_argument,      NULL,   'p'},
                 {"num-services",        required_argument,      NULL,   'r'},
                 {"default-service",     required_argument,      NULL,   'd'},
-                {"stats-out",           no_argument,            NULL,   's'}
+                {"stats-out",           no_argument,            NULL,   's'},
+                {"remote-mode",         required_argument,      NULL,   'm'},
+                {"tunnel-ip",           required_argument,      NULL,   'i'},
+                {"rx-threads",          required_argument,      NULL,   'n'},
+                {"rx-queues",           required_argument,      NULL,   'q'},
+                {"batch-size",          required_argument,      NULL,   'b'},
+                {"flush-latency",       required_argument,      NULL,   'u'},
+                {"exporter-port",       required_argument,      NULL,   'e'},
+                {"flow-entries",        required_argument,      NULL,   'f'},
+                {"shard-flows",         no_argument,            NULL,   'S'},
+                {NULL,                  0,                      NULL,   0}
         };
 
+        const uint8_t default_tunnel_ip[4] = VXLAN_SRC_IP;
+
         progname = argv[0];
         is_distributed = NOT_DISTRIBUTED;
+        memcpy(&tunnel_ip, default_tunnel_ip, sizeof(tunnel_ip));
+        num_rx_queue_conf = 0;
 
-        while ((opt = getopt_long(argc, argvopt, "p:r:d:s:x", lgopts, &option_index)) != EOF) {
+        while ((opt = getopt_long(argc, argvopt, "p:r:d:s:xm:i:n:q:b:u:Le:f:S", lgopts, &option_index)) != EOF) {
                 switch (opt) {
                         case 'p':
                                 if (parse_portmask(max_ports, optarg) != 0) {
@@ -145,6 +227,60 @@ parse_app_args(uint8_t max_ports, int argc, char *argv[]) {
                         case 'x':
                                 is_distributed = DISTRIBUTED;
                                 break;
+                        case 'm':
+                                if (parse_remote_selection(optarg) != 0) {
+                                        usage();
+                                        return -1;
+                                }
+                                break;
+                        case 'i':
+                                if (parse_tunnel_ip(optarg) != 0) {
+                                        usage();
+                                        return -1;
+                                }
+                                break;
+                        case 'n':
+                                if (parse_num_rx_threads(optarg) != 0) {
+                                        usage();
+                                        return -1;
+                                }
+                                break;
+                        case 'q':
+                                if (parse_rx_queue_conf(optarg) != 0) {
+                                        usage();
+                                        return -1;
+                                }
+                                break;
+                        case 'b':
+                                if (parse_batch_size(optarg) != 0) {
+                                        usage();
+                                        return -1;
+                                }
+                                break;
+                        case 'u':
+                                if (parse_flush_latency(optarg) != 0) {
+                                        usage();
+                                        return -1;
+                                }
+                                break;
+                        case 'L':
+                                track_latency = 1;
+                                break;
+                        case 'e':
+                                if (parse_exporter_port(optarg) != 0) {
+                                        usage();
+                                        return -1;
+                                }
+                                break;
+                        case 'f':
+                                if (parse_flow_entries(optarg) != 0) {
+                                        usage();
+                                        return -1;
+                                }
+                                break;
+                        case 'S':
+                                shard_flows = 1;
+                                break;
                         default:
                                 printf("ERROR: Unknown option '%c'\n", opt);
                                 usage();
@@ -152,6 +288,13 @@ parse_app_args(uint8_t max_ports, int argc, char *argv[]) {
                 }
         }
 
+        if (check_rx_queue_conf() != 0) {
+                usage();
+                return -1;
+        }
+
+        flush_latency_cycles = rte_get_tsc_hz() / USEC_PER_SEC * flush_latency_us;
+
         return 0;
 }
 
@@ -162,12 +305,22 @@ parse_app_args(uint8_t max_ports, int argc, char *argv[]) {
 static void
 usage(void) {
         printf(
-            "%s [EAL options] -- -p PORTMASK [-r NUM_SERVICES] [-d DEFAULT_SERVICE] [-s STATS_OUTPUT]\n"
+            "%s [EAL options] -- -p PORTMASK [-r NUM_SERVICES] [-d DEFAULT_SERVICE] [-s STATS_OUTPUT] [-x] [-m REMOTE_MODE] [-i TUNNEL_IP] [-n NUM_RX_THREADS] [-q RX_QUEUES] [-b BATCH_SIZE] [-u FLUSH_LATENCY] [-L] [-e EXPORTER_PORT] [-f FLOW_ENTRIES] [-S]\n"
             "\t-p PORTMASK: hexadecimal bitmask of ports to use\n"
-            "\t-r NUM_SERVICES: number of unique serivces allowed. defaults to 16 (optional)\n"
+            "\t-r NUM_SERVICES: number of unique serivces allowed, at most 16. defaults to 16 (optional)\n"
             "\t-d DEFAULT_SERVICE: the service to initially receive packets. defaults to 1 (optional)\n"
             "\t-s STATS_OUTPUT: where to output manager stats (stdout/stderr/web). defaults to NONE (optional)\n"
-            "\t-x Flag to run in distributed mode\n",
+            "\t-x Flag to run in distributed mode\n"
+            "\t-m REMOTE_MODE: how new flows pick a remote manager (rss/p2c). defaults to rss (optional)\n"
+            "\t-i TUNNEL_IP: IPv4 address other managers send tunnelled packets to. defaults to 10.1.2.3 (optional)\n"
+            "\t-n NUM_RX_THREADS: number of RX threads, RX thread N polls RX queue N of every port. defaults to 1 (optional)\n"
+            "\t-q RX_QUEUES: explicit (port,queue,lcore)[,(port,queue,lcore)...] RX queue to lcore mapping, overrides -n (optional)\n"
+            "\t-b BATCH_SIZE: send a buffer to its NF or port as soon as it holds this many packets. defaults to 32, the maximum (optional)\n"
+            "\t-u FLUSH_LATENCY: longest time in microseconds a packet waits for its batch to fill. defaults to 0, sending every loop pass (optional)\n"
+            "\t-L Flag to measure per NF and end-to-end packet latency (optional)\n"
+            "\t-e EXPORTER_PORT: serve Prometheus metrics on 127.0.0.1:EXPORTER_PORT. defaults to off (optional)\n"
+            "\t-f FLOW_ENTRIES: initial size of the flow table, it doubles when it fills up. defaults to 65536 (optional)\n"
+            "\t-S Flag to split the flow table in one shard per RX queue, looked up by the core polling it (optional)\n",
             progname);
 }
 
@@ -227,7 +380,7 @@ parse_num_services(const char *services) {
         unsigned long temp;
 
         temp = strtoul(services, &end, 10);
-        if (end == NULL || *end != '\0' || temp == 0)
+        if (end == NULL || *end != '\0' || temp == 0 || temp > MAX_SERVICES)
                 return -1;
 
         num_services = (uint16_t)temp;
@@ -249,3 +402,221 @@ parse_stats_output(const char *stats_output) {
                 return -1;
         }
 }
+
+static int
+parse_remote_selection(const char *mode) {
+        if (!strcmp(mode, REMOTE_SELECT_STR_RSS)) {
+                remote_selection = REMOTE_SELECT_RSS;
+                return 0;
+        } else if (!strcmp(mode, REMOTE_SELECT_STR_P2C)) {
+                remote_selection = REMOTE_SELECT_P2C;
+                return 0;
+        } else {
+                return -1;
+        }
+}
+
+static int
+parse_tunnel_ip(const char *ip) {
+        struct in_addr addr;
+
+        if (inet_pton(AF_INET, ip, &addr) != 1)
+                return -1;
+
+        tunnel_ip = addr.s_addr;
+        return 0;
+}
+
+static int
+parse_num_rx_threads(const char *threads) {
+        char *end = NULL;
+        unsigned long temp;
+
+        temp = strtoul(threads, &end, 10);
+        if (end == NULL || *end != '\0' || temp == 0 || temp > ONVM_MAX_RX_THREADS)
+                return -1;
+
+        rx_threads_arg = (uint16_t)temp;
+        return 0;
+}
+
+/*
+ * Parses "(port,queue,lcore),(port,queue,lcore),..." into rx_queue_conf.
+ * Each distinct lcore becomes one RX thread, numbered in order of first
+ * appearance.
+ */
+static int
+parse_rx_queue_conf(const char *conf) {
+        enum { FLD_PORT = 0, FLD_QUEUE, FLD_LCORE, NUM_FLD };
+        unsigned long fld[NUM_FLD];
+        unsigned lcores[ONVM_MAX_RX_THREADS];
+        const char *p = conf;
+        char *end;
+        uint16_t threads = 0, t;
+        int i;
+
+        num_rx_queue_conf = 0;
+        while ((p = strchr(p, '(')) != NULL) {
+                p++;
+                for (i = 0; i < NUM_FLD; i++) {
+                        errno = 0;
+                        fld[i] = strtoul(p, &end, 10);
+                        if (errno != 0 || end == p)
+                                return -1;
+                        if (*end != (i == NUM_FLD - 1 ? ')' : ','))
+                                return -1;
+                        p = end + 1;
+                }
+                if (fld[FLD_PORT] >= RTE_MAX_ETHPORTS || fld[FLD_QUEUE] > UINT16_MAX ||
+                    fld[FLD_LCORE] >= RTE_MAX_LCORE)
+                        return -1;
+                if (num_rx_queue_conf >= ONVM_MAX_RX_QUEUE_CONF) {
+                        printf("ERROR: at most %d RX queues can be mapped\n", ONVM_MAX_RX_QUEUE_CONF);
+                        return -1;
+                }
+
+                for (t = 0; t < threads; t++) {
+                        if (lcores[t] == fld[FLD_LCORE])
+                                break;
+                }
+                if (t == threads) {
+                        if (threads == ONVM_MAX_RX_THREADS) {
+                                printf("ERROR: at most %d RX lcores can be used\n", ONVM_MAX_RX_THREADS);
+                                return -1;
+                        }
+                        lcores[threads++] = (unsigned)fld[FLD_LCORE];
+                }
+
+                rx_queue_conf[num_rx_queue_conf].port = (uint8_t)fld[FLD_PORT];
+                rx_queue_conf[num_rx_queue_conf].queue = (uint16_t)fld[FLD_QUEUE];
+                rx_queue_conf[num_rx_queue_conf].thread = t;
+                rx_queue_conf[num_rx_queue_conf].lcore = (unsigned)fld[FLD_LCORE];
+                num_rx_queue_conf++;
+        }
+
+        if (threads == 0)
+                return -1;
+
+        rx_queue_conf_threads = threads;
+        return 0;
+}
+
+/*
+ * Fills in the default mapping when -q was not given, otherwise checks
+ * that -q only names ports in use and gives each of them queues 0..N-1
+ * exactly once. -q overrides -n, whichever came first.
+ */
+static int
+check_rx_queue_conf(void) {
+        uint16_t i, j, t, queues;
+        uint8_t in_use;
+
+        num_rx_threads = num_rx_queue_conf == 0 ? rx_threads_arg : rx_queue_conf_threads;
+        if (num_rx_queue_conf == 0) {
+                if ((unsigned)num_rx_threads * ports->num_ports > ONVM_MAX_RX_QUEUE_CONF) {
+                        printf("ERROR: at most %d RX queues can be mapped\n", ONVM_MAX_RX_QUEUE_CONF);
+                        return -1;
+                }
+                for (t = 0; t < num_rx_threads; t++) {
+                        for (i = 0; i < ports->num_ports; i++) {
+                                rx_queue_conf[num_rx_queue_conf].port = ports->id[i];
+                                rx_queue_conf[num_rx_queue_conf].queue = t;
+                                rx_queue_conf[num_rx_queue_conf].thread = t;
+                                rx_queue_conf[num_rx_queue_conf].lcore = RX_LCORE_AUTO;
+                                num_rx_queue_conf++;
+                        }
+                }
+                return 0;
+        }
+
+        for (i = 0; i < num_rx_queue_conf; i++) {
+                in_use = 0;
+                for (j = 0; j < ports->num_ports; j++) {
+                        if (ports->id[j] == rx_queue_conf[i].port)
+                                in_use = 1;
+                }
+                if (!in_use) {
+                        printf("ERROR: RX queue mapped on port %u, which is not in the portmask\n",
+                                (unsigned)rx_queue_conf[i].port);
+                        return -1;
+                }
+
+                queues = onvm_init_port_rx_queues(rx_queue_conf[i].port);
+                if (rx_queue_conf[i].queue >= queues) {
+                        printf("ERROR: port %u maps %u RX queues, so queue %u is out of range\n",
+                                (unsigned)rx_queue_conf[i].port, (unsigned)queues,
+                                (unsigned)rx_queue_conf[i].queue);
+                        return -1;
+                }
+                for (j = 0; j < i; j++) {
+                        if (rx_queue_conf[j].port == rx_queue_conf[i].port &&
+                            rx_queue_conf[j].queue == rx_queue_conf[i].queue) {
+                                printf("ERROR: RX queue %u of port %u is mapped twice\n",
+                                        (unsigned)rx_queue_conf[i].queue, (unsigned)rx_queue_conf[i].port);
+                                return -1;
+                        }
+                }
+        }
+
+        /* Every port in use has to be polled by someone */
+        for (j = 0; j < ports->num_ports; j++) {
+                if (onvm_init_port_rx_queues(ports->id[j]) == 0) {
+                        printf("ERROR: no RX queue mapped for port %u\n", (unsigned)ports->id[j]);
+                        return -1;
+                }
+        }
+
+        return 0;
+}
+
+static int
+parse_batch_size(const char *size) {
+        char *end = NULL;
+        unsigned long temp;
+
+        temp = strtoul(size, &end, 10);
+        if (end == NULL || *end != '\0' || temp == 0 || temp > PACKET_READ_SIZE)
+                return -1;
+
+        batch_size = (uint16_t)temp;
+        return 0;
+}
+
+static int
+parse_flush_latency(const char *latency) {
+        char *end = NULL;
+        unsigned long temp;
+
+        temp = strtoul(latency, &end, 10);
+        if (end == NULL || *end != '\0' || temp > USEC_PER_SEC)
+                return -1;
+
+        flush_latency_us = (uint32_t)temp;
+        return 0;
+}
+
+static int
+parse_exporter_port(const char *port) {
+        char *end = NULL;
+        unsigned long temp;
+
+        temp = strtoul(port, &end, 10);
+        if (end == NULL || *end != '\0' || temp == 0 || temp > UINT16_MAX)
+                return -1;
+
+        exporter_port = (uint16_t)temp;
+        return 0;
+}
+
+static int
+parse_flow_entries(const char *entries) {
+        char *end = NULL;
+        unsigned long temp;
+
+        temp = strtoul(entries, &end, 10);
+        if (end == NULL || *end != '\0' || temp < SDN_FT_MIN_ENTRIES || temp > SDN_FT_MAX_ENTRIES)
+                return -1;
+
+        flow_entries = (uint32_t)temp;
+        return 0;
+}
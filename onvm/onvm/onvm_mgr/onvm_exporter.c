@@ -0,0 +1,393 @@
+/*********************************************************************
+ *                     openNetVM
+ *              https://sdnfv.github.io
+ *
+ *   BSD LICENSE
+ *
+ *   Copyright(c)
+ *            2015-2016 George Washington University
+ *            2015-2016 University of California Riverside
+ *            2010-2014 Intel Corporation. All rights reserved.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ********************************************************************/
+
+
+/******************************************************************************
+
+                               onvm_exporter.c
+
+    Serves the port and NF counters in the Prometheus text format over
+    HTTP. The thread reads the counters the packet threads and NFs keep,
+    so scrapes never wait on, or allocate in, the master loop.
+
+
+******************************************************************************/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE             // SCHED_IDLE
+#endif
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "onvm_mgr.h"
+#include "onvm_nf.h"
+#include "onvm_stats.h"
+#include "onvm_exporter.h"
+
+
+/******************************Data structures********************************/
+
+
+/* One per NF metric, see nf_metrics */
+enum {
+        NF_RX,
+        NF_RX_DROP,
+        NF_TX,
+        NF_TX_DROP,
+        NF_TX_DIRECT,
+        NF_TX_BUFFER,
+        NF_TX_RETURNED,
+        NF_ACT_OUT,
+        NF_ACT_TONF,
+        NF_ACT_DROP,
+        NF_ACT_NEXT,
+        NF_RX_RING,
+        NF_TX_RING,
+        NF_RX_RING_CAPACITY,
+        NF_TX_RING_CAPACITY,
+        NF_METRICS
+};
+
+struct exporter_metric {
+        const char *name;
+        const char *type;
+        const char *help;
+};
+
+static const struct exporter_metric nf_metrics[NF_METRICS] = {
+        [NF_RX] = {"onvm_nf_rx_packets_total", "counter", "Packets the manager handed to the NF."},
+        [NF_RX_DROP] = {"onvm_nf_rx_dropped_packets_total", "counter", "Packets dropped because the NF's RX ring was full."},
+        [NF_TX] = {"onvm_nf_tx_packets_total", "counter", "Packets the NF handed back to the manager."},
+        [NF_TX_DROP] = {"onvm_nf_tx_dropped_packets_total", "counter", "Packets dropped because the NF's TX ring was full."},
+        [NF_TX_DIRECT] = {"onvm_nf_tx_direct_packets_total", "counter", "Packets the NF handed straight to the next NF."},
+        [NF_TX_BUFFER] = {"onvm_nf_buffered_packets_total", "counter", "Packets the NF kept to send later."},
+        [NF_TX_RETURNED] = {"onvm_nf_returned_packets_total", "counter", "Buffered packets the NF later sent."},
+        [NF_ACT_OUT] = {"onvm_nf_action_out_packets_total", "counter", "Packets the manager sent out a port after the NF."},
+        [NF_ACT_TONF] = {"onvm_nf_action_tonf_packets_total", "counter", "Packets the manager sent to another NF after the NF."},
+        [NF_ACT_DROP] = {"onvm_nf_action_drop_packets_total", "counter", "Packets the manager dropped after the NF."},
+        [NF_ACT_NEXT] = {"onvm_nf_action_next_packets_total", "counter", "Packets the manager looked up in the flow table after the NF."},
+        [NF_RX_RING] = {"onvm_nf_rx_ring_packets", "gauge", "Packets waiting in the NF's RX ring."},
+        [NF_TX_RING] = {"onvm_nf_tx_ring_packets", "gauge", "Packets waiting in the NF's TX ring."},
+        [NF_RX_RING_CAPACITY] = {"onvm_nf_rx_ring_capacity", "gauge", "Packets the NF's RX ring can hold."},
+        [NF_TX_RING_CAPACITY] = {"onvm_nf_tx_ring_capacity", "gauge", "Packets the NF's TX ring can hold."},
+};
+
+static const struct exporter_metric port_metrics[3] = {
+        {"onvm_port_rx_packets_total", "counter", "Packets received on the port."},
+        {"onvm_port_tx_packets_total", "counter", "Packets sent on the port."},
+        {"onvm_port_tx_dropped_packets_total", "counter", "Packets the port could not send."},
+};
+
+static const struct exporter_metric flow_table_metrics[4] = {
+        {"onvm_flow_table_flows", "gauge", "Flows in the flow director table."},
+        {"onvm_flow_table_size", "gauge", "Flows the flow director table has room for."},
+        {"onvm_flow_table_resizes_total", "counter", "Times the flow director table grew."},
+        {"onvm_flow_table_add_failures_total", "counter", "Flows that could not be added for lack of room."},
+};
+
+
+/********************************Global variables*****************************/
+
+
+static pthread_t exporter_thread;
+static volatile uint8_t exporter_keep_running = 0;
+static int exporter_fd = -1;
+
+/* Only used by the exporter thread, so serving a scrape never allocates */
+static char exporter_buf[ONVM_EXPORTER_BUF_SIZE];
+static size_t exporter_len;
+static uint64_t exporter_nf_values[MAX_CLIENTS][NF_METRICS];
+static uint64_t exporter_port_values[RTE_MAX_ETHPORTS][3];
+static uint64_t exporter_flow_table_values[4];
+
+
+/*************************Internal Functions Prototypes***********************/
+
+
+/*
+ * Main loop of the exporter thread.
+ *
+ */
+static void *
+onvm_exporter_main(void *arg);
+
+
+/*
+ * Answer one connection with the current metrics, then close it.
+ *
+ * Input : the connected socket
+ *
+ */
+static void
+onvm_exporter_serve(int fd);
+
+
+/*
+ * Write the current metrics in exporter_buf.
+ *
+ */
+static void
+onvm_exporter_build(void);
+
+
+/*
+ * printf to the end of exporter_buf. Output that doesn't fit is dropped.
+ *
+ */
+static void
+onvm_exporter_append(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+
+/*********************************Interfaces**********************************/
+
+
+int
+onvm_exporter_start(uint16_t port) {
+        struct sockaddr_in addr;
+        int one = 1;
+
+        exporter_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (exporter_fd < 0)
+                return -1;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        inet_pton(AF_INET, ONVM_EXPORTER_ADDR, &addr.sin_addr);
+
+        setsockopt(exporter_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(exporter_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(exporter_fd, 8) != 0) {
+                RTE_LOG(ERR, APP, "Cannot listen on %s:%u: %s\n", ONVM_EXPORTER_ADDR, port, strerror(errno));
+                close(exporter_fd);
+                exporter_fd = -1;
+                return -1;
+        }
+
+        exporter_keep_running = 1;
+        /* Inherits the master lcore's affinity, so it never takes a packet core */
+        if (pthread_create(&exporter_thread, NULL, onvm_exporter_main, NULL) != 0) {
+                exporter_keep_running = 0;
+                close(exporter_fd);
+                exporter_fd = -1;
+                return -1;
+        }
+
+        RTE_LOG(INFO, APP, "Serving metrics on http://%s:%u/metrics\n", ONVM_EXPORTER_ADDR, port);
+        return 0;
+}
+
+
+void
+onvm_exporter_stop(void) {
+        if (!exporter_keep_running)
+                return;
+
+        exporter_keep_running = 0;
+        pthread_join(exporter_thread, NULL);
+        close(exporter_fd);
+        exporter_fd = -1;
+}
+
+
+/*****************************Internal functions******************************/
+
+
+static void *
+onvm_exporter_main(__attribute__((unused)) void *arg) {
+        struct sched_param param;
+        struct pollfd pfd;
+        int fd;
+
+        /* Only run when the master lcore has nothing else to do */
+        memset(&param, 0, sizeof(param));
+        if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) != 0)
+                RTE_LOG(INFO, APP, "Cannot lower the exporter thread's priority\n");
+
+        pfd.fd = exporter_fd;
+        pfd.events = POLLIN;
+        while (exporter_keep_running) {
+                if (poll(&pfd, 1, ONVM_EXPORTER_POLL_MS) <= 0)
+                        continue;
+
+                fd = accept(exporter_fd, NULL, NULL);
+                if (fd < 0)
+                        continue;
+                onvm_exporter_serve(fd);
+                close(fd);
+        }
+
+        return NULL;
+}
+
+
+static void
+onvm_exporter_serve(int fd) {
+        struct timeval timeout = {ONVM_EXPORTER_IO_TIMEOUT_SEC, 0};
+        char request[512];
+        char header[128];
+        size_t sent;
+        ssize_t ret;
+        int len;
+
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        /* Whatever the path, a GET gets the metrics */
+        ret = recv(fd, request, sizeof(request) - 1, 0);
+        if (ret < 4 || strncmp(request, "GET ", 4) != 0) {
+                len = snprintf(header, sizeof(header), "HTTP/1.0 405 Method Not Allowed\r\nContent-Length: 0\r\n\r\n");
+                send(fd, header, len, MSG_NOSIGNAL);
+                return;
+        }
+
+        onvm_exporter_build();
+        len = snprintf(header, sizeof(header),
+                       "HTTP/1.0 200 OK\r\n"
+                       "Content-Type: text/plain; version=0.0.4\r\n"
+                       "Content-Length: %zu\r\n\r\n", exporter_len);
+        if (send(fd, header, len, MSG_NOSIGNAL) != len)
+                return;
+
+        for (sent = 0; sent < exporter_len; sent += ret) {
+                ret = send(fd, exporter_buf + sent, exporter_len - sent, MSG_NOSIGNAL);
+                if (ret <= 0)
+                        return;
+        }
+}
+
+
+static void
+onvm_exporter_build(void) {
+        struct thread_nf_stats sum;
+        struct onvm_nf_info *info;
+        uint8_t valid[MAX_CLIENTS];
+        uint16_t service[MAX_CLIENTS];
+        unsigned i, m;
+
+        /* Take every value first, as each metric's samples must be grouped */
+        for (i = 0; i < ports->num_ports; i++)
+                onvm_stats_sum_port(ports->id[i], &exporter_port_values[i][0], &exporter_port_values[i][1], &exporter_port_values[i][2]);
+
+        for (i = 0; i < MAX_CLIENTS; i++) {
+                info = clients[i].info;
+                valid[i] = onvm_nf_is_valid(&clients[i]);
+                if (!valid[i])
+                        continue;
+
+                service[i] = info->service_id;
+                onvm_stats_sum_client(i, &sum);
+                exporter_nf_values[i][NF_RX] = sum.rx;
+                exporter_nf_values[i][NF_RX_DROP] = sum.rx_drop;
+                exporter_nf_values[i][NF_TX] = clients_stats[i].tx;
+                exporter_nf_values[i][NF_TX_DROP] = clients_stats[i].tx_drop;
+                exporter_nf_values[i][NF_TX_DIRECT] = clients_stats[i].tx_direct;
+                exporter_nf_values[i][NF_TX_BUFFER] = clients_stats[i].tx_buffer;
+                exporter_nf_values[i][NF_TX_RETURNED] = clients_stats[i].tx_returned;
+                exporter_nf_values[i][NF_ACT_OUT] = sum.act_out;
+                exporter_nf_values[i][NF_ACT_TONF] = sum.act_tonf;
+                exporter_nf_values[i][NF_ACT_DROP] = sum.act_drop;
+                exporter_nf_values[i][NF_ACT_NEXT] = sum.act_next;
+                exporter_nf_values[i][NF_RX_RING] = rte_ring_count(clients[i].rx_q);
+                exporter_nf_values[i][NF_TX_RING] = rte_ring_count(clients[i].tx_q);
+                exporter_nf_values[i][NF_RX_RING_CAPACITY] = exporter_nf_values[i][NF_RX_RING] + rte_ring_free_count(clients[i].rx_q);
+                exporter_nf_values[i][NF_TX_RING_CAPACITY] = exporter_nf_values[i][NF_TX_RING] + rte_ring_free_count(clients[i].tx_q);
+        }
+
+        exporter_len = 0;
+        for (m = 0; m < RTE_DIM(port_metrics); m++) {
+                onvm_exporter_append("# HELP %s %s\n# TYPE %s %s\n", port_metrics[m].name,
+                                     port_metrics[m].help, port_metrics[m].name, port_metrics[m].type);
+                for (i = 0; i < ports->num_ports; i++)
+                        onvm_exporter_append("%s{port=\"%u\"} %"PRIu64"\n", port_metrics[m].name,
+                                             ports->id[i], exporter_port_values[i][m]);
+        }
+
+        onvm_exporter_append("# HELP onvm_nfs Running NFs.\n# TYPE onvm_nfs gauge\nonvm_nfs %u\n", num_clients);
+        exporter_flow_table_values[0] = sdn_ft_info->flows;
+        exporter_flow_table_values[1] = onvm_flow_dir_size();
+        exporter_flow_table_values[2] = sdn_ft_info->resizes;
+        exporter_flow_table_values[3] = sdn_ft_info->add_fails;
+        for (m = 0; m < RTE_DIM(flow_table_metrics); m++) {
+                onvm_exporter_append("# HELP %s %s\n# TYPE %s %s\n%s %"PRIu64"\n", flow_table_metrics[m].name,
+                                     flow_table_metrics[m].help, flow_table_metrics[m].name, flow_table_metrics[m].type,
+                                     flow_table_metrics[m].name, exporter_flow_table_values[m]);
+        }
+        for (m = 0; m < NF_METRICS; m++) {
+                onvm_exporter_append("# HELP %s %s\n# TYPE %s %s\n", nf_metrics[m].name,
+                                     nf_metrics[m].help, nf_metrics[m].name, nf_metrics[m].type);
+                for (i = 0; i < MAX_CLIENTS; i++) {
+                        if (valid[i])
+                                onvm_exporter_append("%s{instance=\"%u\",service=\"%u\"} %"PRIu64"\n",
+                                                     nf_metrics[m].name, i, service[i], exporter_nf_values[i][m]);
+                }
+        }
+}
+
+
+static void
+onvm_exporter_append(const char *fmt, ...) {
+        va_list ap;
+        int len;
+
+        if (exporter_len >= sizeof(exporter_buf))
+                return;
+
+        va_start(ap, fmt);
+        len = vsnprintf(exporter_buf + exporter_len, sizeof(exporter_buf) - exporter_len, fmt, ap);
+        va_end(ap);
+
+        /* Never leave a partial line */
+        if (len < 0 || (size_t)len >= sizeof(exporter_buf) - exporter_len)
+                exporter_buf[exporter_len] = '\0';
+        else
+                exporter_len += len;
+}
@@ -0,0 +1,92 @@
+/*********************************************************************
+ *                     openNetVM
+ *              https://sdnfv.github.io
+ *
+ *   BSD LICENSE
+ *
+ *   Copyright(c)
+ *            2015-2016 George Washington University
+ *            2015-2016 University of California Riverside
+ *            2010-2014 Intel Corporation. All rights reserved.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ********************************************************************/
+
+
+/******************************************************************************
+
+                               onvm_exporter.h
+
+
+      Header file for the thread serving the manager's counters in the
+      Prometheus text format
+
+
+******************************************************************************/
+
+
+#ifndef _ONVM_EXPORTER_H_
+#define _ONVM_EXPORTER_H_
+
+#include <stdint.h>
+
+
+/***********************************Macros************************************/
+
+
+#define ONVM_EXPORTER_ADDR "127.0.0.1"  // Only local scrapers
+#define ONVM_EXPORTER_BUF_SIZE 65536    // Largest response, sized for MAX_CLIENTS NFs
+#define ONVM_EXPORTER_POLL_MS 200       // How often the thread checks it should stop
+#define ONVM_EXPORTER_IO_TIMEOUT_SEC 1  // Give up on scrapers that stall
+
+
+/**********************************Functions**********************************/
+
+
+/*
+ * Start the exporter thread. It runs with SCHED_IDLE on the master lcore,
+ * so it only gets CPU time the master does not use, and answers every
+ * HTTP request on the port with the current counters.
+ *
+ * Input  : the TCP port to listen on
+ * Output : 0 on success, -1 on failure
+ *
+ */
+int
+onvm_exporter_start(uint16_t port);
+
+
+/*
+ * Stop the exporter thread and close its socket.
+ *
+ */
+void
+onvm_exporter_stop(void);
+
+#endif  // _ONVM_EXPORTER_H_
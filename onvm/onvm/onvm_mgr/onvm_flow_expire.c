@@ -0,0 +1,690 @@
+/*********************************************************************
+ *                     openNetVM
+ *              https://sdnfv.github.io
+ *
+ *   BSD LICENSE
+ *
+ *   Copyright(c)
+ *            2015-2016 George Washington University
+ *            2015-2016 University of California Riverside
+ *            2010-2014 Intel Corporation. All rights reserved.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ********************************************************************/
+
+
+/******************************************************************************
+
+                             onvm_flow_expire.c
+
+    Removes flow director entries once their idle or hard timeout has
+    passed. Entries are kept on a hierarchical timer wheel indexed by
+    their position in the directory (shard * shard size + index in the
+    shard's table). The packet threads only stamp the last
+    tick they saw a flow; a timer that fires for a flow that was seen
+    since it was queued is simply queued again for its new deadline.
+
+    The same thread grows the directory: it builds tables twice as large,
+    copies the entries over and swaps the shared pointers, then frees the
+    old tables once the packet threads and NFs are done with it. Chains
+    and keys NFs retire when they delete or rewrite flows are freed here
+    too, after the same kind of grace period.
+
+
+******************************************************************************/
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <rte_cycles.h>
+#include <rte_log.h>
+#include <rte_malloc.h>
+
+#include "onvm_mgr.h"
+#include "onvm_flow_expire.h"
+
+
+/***********************************Macros************************************/
+
+
+#define FLOW_EXPIRE_SLOTS (1 << FLOW_EXPIRE_WHEEL_BITS)
+#define FLOW_EXPIRE_MASK (FLOW_EXPIRE_SLOTS - 1)
+/* Furthest a timer can be queued, longer deadlines are checked again then */
+#define FLOW_EXPIRE_HORIZON ((1U << (FLOW_EXPIRE_WHEEL_BITS * FLOW_EXPIRE_WHEEL_LEVELS)) - 1)
+#define FLOW_TIMER_NONE UINT32_MAX
+#define FLOW_DEADLINE_NEVER UINT32_MAX
+
+
+/******************************Data structures********************************/
+
+
+/* Timer of the entry at one position of the flow table */
+struct flow_timer {
+        struct onvm_ft_ipv4_5tuple key; // the flow it was armed for
+        uint32_t next;                  // positions of its neighbours in its slot
+        uint32_t prev;
+        uint32_t created;               // tick the flow was picked up
+        uint32_t expire;                // tick it is queued for
+        uint16_t slot;                  // level * FLOW_EXPIRE_SLOTS + slot
+        uint8_t queued;
+};
+
+
+/*********************************Variables***********************************/
+
+
+volatile uint32_t flow_expire_clock = 0;
+
+static pthread_t expire_thread;
+static volatile uint8_t expire_keep_running = 0;
+static uint64_t expire_start_tsc;
+static uint64_t expire_tick_cycles;
+
+// Only used by the expiry thread
+static struct flow_timer *timers = NULL;
+static uint32_t num_timers;
+static uint32_t shard_cnt;              // entries of each shard's table
+static uint32_t wheel[FLOW_EXPIRE_WHEEL_LEVELS * FLOW_EXPIRE_SLOTS];
+static uint32_t wheel_now;              // last tick processed
+static uint16_t sweep_shard;            // where the last sweep of the tables stopped
+static uint32_t sweep_next;
+static uint64_t flows_expired;
+static uint8_t grow_failed;             // don't try again every tick
+
+// Chains and keys of expired flows, freed after a grace period
+static void *retired[FLOW_EXPIRE_MAX_RETIRED];
+static uint16_t retired_count;
+
+
+/**********************Internal Functions Prototypes**************************/
+
+
+static void *onvm_flow_expire_main(void *arg);
+static inline struct onvm_ft *onvm_flow_expire_table(uint32_t pos);
+static inline int32_t onvm_flow_expire_index(uint32_t pos);
+static uint32_t onvm_flow_expire_now(void);
+static int onvm_flow_expire_should_grow(void);
+static void onvm_flow_expire_grow(void);
+static void onvm_flow_expire_sweep(void);
+static void onvm_flow_expire_advance(uint32_t tick);
+static void onvm_flow_expire_cascade(uint32_t slot);
+static void onvm_flow_expire_check(uint32_t pos);
+static void onvm_flow_expire_arm(uint32_t pos, const struct onvm_ft_ipv4_5tuple *key);
+static uint32_t onvm_flow_expire_deadline(uint32_t pos, struct onvm_flow_entry *flow_entry);
+static void onvm_flow_expire_schedule(uint32_t pos, uint32_t expire);
+static void onvm_flow_expire_unlink(uint32_t pos);
+static void onvm_flow_expire_remove(uint32_t pos, struct onvm_flow_entry *flow_entry);
+static void onvm_flow_expire_retire(void *ptr);
+static void onvm_flow_expire_collect(void);
+static void onvm_flow_expire_reclaim(void);
+
+
+/**********************************Interfaces*********************************/
+
+
+int
+onvm_flow_expire_start(void) {
+        uint32_t i;
+
+        if (expire_keep_running)
+                return 0;
+
+        shard_cnt = onvm_flow_dir_table(0)->cnt;
+        num_timers = shard_cnt * onvm_flow_dir_num_shards();
+        timers = rte_calloc("onvm_flow_expire", num_timers, sizeof(struct flow_timer), 0);
+        if (timers == NULL) {
+                RTE_LOG(ERR, APP, "Cannot allocate flow expiry timers\n");
+                return -1;
+        }
+        for (i = 0; i < num_timers; i++) {
+                timers[i].next = timers[i].prev = FLOW_TIMER_NONE;
+        }
+        for (i = 0; i < FLOW_EXPIRE_WHEEL_LEVELS * FLOW_EXPIRE_SLOTS; i++) {
+                wheel[i] = FLOW_TIMER_NONE;
+        }
+        sweep_shard = 0;
+        sweep_next = 0;
+        retired_count = 0;
+        flows_expired = 0;
+        grow_failed = 0;
+
+        expire_tick_cycles = rte_get_tsc_hz() / FLOW_EXPIRE_TICKS_PER_SEC;
+        expire_start_tsc = rte_rdtsc();
+        wheel_now = onvm_flow_expire_now();
+        flow_expire_clock = wheel_now;
+
+        expire_keep_running = 1;
+        if (pthread_create(&expire_thread, NULL, onvm_flow_expire_main, NULL) != 0) {
+                RTE_LOG(ERR, APP, "Cannot start flow expiry thread\n");
+                expire_keep_running = 0;
+                rte_free(timers);
+                timers = NULL;
+                return -1;
+        }
+
+        return 0;
+}
+
+
+void
+onvm_flow_expire_stop(void) {
+        if (!expire_keep_running)
+                return;
+
+        expire_keep_running = 0;
+        pthread_join(expire_thread, NULL);
+        onvm_flow_expire_collect();
+        onvm_flow_expire_reclaim();
+        rte_free(timers);
+        timers = NULL;
+
+        RTE_LOG(INFO, APP, "Flow expiry: %"PRIu64" flows expired\n", flows_expired);
+}
+
+
+/******************************Helper functions*******************************/
+
+
+static void *
+onvm_flow_expire_main(void *arg) {
+        uint32_t now;
+
+        (void)(arg);
+        while (expire_keep_running) {
+                /* Flows classified by a rule take the slow path until then */
+                onvm_flow_dir_lock();
+                onvm_flow_dir_fill_cache(FLOW_EXPIRE_CACHE_BURST);
+                onvm_flow_dir_unlock();
+
+                now = onvm_flow_expire_now();
+                if (now == flow_expire_clock) {
+                        usleep(FLOW_EXPIRE_CACHE_POLL_US);
+                        continue;
+                }
+                flow_expire_clock = now;
+
+                if (onvm_flow_expire_should_grow())
+                        onvm_flow_expire_grow();
+
+                onvm_flow_dir_lock();
+                onvm_flow_expire_sweep();
+                /* Catch up tick by tick if we overslept, so no slot is skipped */
+                while (wheel_now != now) {
+                        wheel_now++;
+                        onvm_flow_expire_advance(wheel_now);
+                }
+                onvm_flow_dir_unlock();
+
+                onvm_flow_expire_collect();
+                onvm_flow_expire_reclaim();
+                usleep(FLOW_EXPIRE_CACHE_POLL_US);
+        }
+
+        return NULL;
+}
+
+
+/* The table and index of the entry a timer belongs to */
+static inline struct onvm_ft *
+onvm_flow_expire_table(uint32_t pos) {
+        return onvm_flow_dir_table(pos / shard_cnt);
+}
+
+
+static inline int32_t
+onvm_flow_expire_index(uint32_t pos) {
+        return pos % shard_cnt;
+}
+
+
+/* Ticks start at 1 so that 0 never looks like a recent packet */
+static uint32_t
+onvm_flow_expire_now(void) {
+        return (uint32_t)((rte_rdtsc() - expire_start_tsc) / expire_tick_cycles) + 1;
+}
+
+
+static int
+onvm_flow_expire_should_grow(void) {
+        uint32_t size = onvm_flow_dir_size();
+
+        if (grow_failed || shard_cnt >= SDN_FT_MAX_ENTRIES / onvm_flow_dir_num_shards())
+                return 0;
+
+        return sdn_ft_info->grow ||
+                (uint64_t)sdn_ft_info->flows * 100 >= (uint64_t)size * SDN_FT_GROW_PCT;
+}
+
+
+/*
+ * Replace the tables of all shards with ones twice as large. Only the copy
+ * and the switch hold the writer lock, so NFs installing flows wait for as
+ * little as possible and the packet threads never wait at all: they keep
+ * using the old tables until they load the new pointers.
+ */
+static void
+onvm_flow_expire_grow(void) {
+        struct onvm_ft *old_ft[SDN_FT_MAX_SHARDS], *new_ft[SDN_FT_MAX_SHARDS];
+        struct flow_timer *new_timers, *old_timers;
+        int32_t *positions;
+        uint32_t cnt, pos, from, to;
+        uint16_t shard, shards;
+        int copied, total = 0;
+
+        shards = onvm_flow_dir_num_shards();
+        cnt = RTE_MIN(shard_cnt * 2, (uint32_t)SDN_FT_MAX_ENTRIES / shards);
+        memset(new_ft, 0, sizeof(new_ft));
+        positions = NULL;
+
+        /* Allocate before taking the lock, zeroing a large table takes a while */
+        new_timers = rte_calloc_socket("onvm_flow_expire", cnt * shards, sizeof(struct flow_timer), 0,
+                                       onvm_flow_dir_table(0)->socket_id);
+        if (new_timers == NULL)
+                goto fail_alloc;
+        positions = rte_malloc("onvm_flow_expire", shard_cnt * sizeof(int32_t), 0);
+        if (positions == NULL)
+                goto fail_alloc;
+        for (shard = 0; shard < shards; shard++) {
+                old_ft[shard] = onvm_flow_dir_table(shard);
+                new_ft[shard] = onvm_ft_create_socket(cnt, old_ft[shard]->entry_size, old_ft[shard]->socket_id);
+                if (new_ft[shard] == NULL)
+                        goto fail_alloc;
+        }
+        for (pos = 0; pos < cnt * shards; pos++) {
+                new_timers[pos].next = new_timers[pos].prev = FLOW_TIMER_NONE;
+        }
+
+        onvm_flow_dir_lock();
+        for (shard = 0; shard < shards; shard++) {
+                copied = onvm_ft_copy(new_ft[shard], old_ft[shard], positions);
+                if (copied < 0) {
+                        onvm_flow_dir_unlock();
+                        RTE_LOG(ERR, APP, "Cannot copy the flow table to %u entries, it will not grow\n", cnt);
+                        goto fail;
+                }
+                total += copied;
+
+                /* Timers follow their entries to their new positions */
+                for (pos = 0; pos < shard_cnt; pos++) {
+                        if (positions[pos] < 0)
+                                continue;
+                        from = shard * shard_cnt + pos;
+                        to = shard * cnt + positions[pos];
+                        new_timers[to].key = timers[from].key;
+                        new_timers[to].created = timers[from].created;
+                        new_timers[to].expire = timers[from].expire;
+                        new_timers[to].queued = timers[from].queued;
+                }
+        }
+        old_timers = timers;
+        timers = new_timers;
+        shard_cnt = cnt;
+        num_timers = cnt * shards;
+        for (pos = 0; pos < FLOW_EXPIRE_WHEEL_LEVELS * FLOW_EXPIRE_SLOTS; pos++) {
+                wheel[pos] = FLOW_TIMER_NONE;
+        }
+        for (pos = 0; pos < num_timers; pos++) {
+                if (!timers[pos].queued)
+                        continue;
+                timers[pos].queued = 0;
+                onvm_flow_expire_schedule(pos, timers[pos].expire);
+        }
+        sweep_shard = 0;
+        sweep_next = 0;
+
+        /* The entries must be in place before anyone can load the pointers */
+        rte_smp_wmb();
+        for (shard = 0; shard < shards; shard++) {
+                sdn_ft_info->ft[shard] = new_ft[shard];
+        }
+        sdn_ft_info->shard_entries = cnt;
+        sdn_ft_info->flows = total;
+        sdn_ft_info->resizes++;
+        sdn_ft_info->grow = 0;
+        onvm_flow_dir_unlock();
+
+        RTE_LOG(INFO, APP, "Flow table grew to %u entries, %d flows\n", cnt * shards, total);
+        rte_free(positions);
+        rte_free(old_timers);
+
+        /* Packet threads may still be reading the old tables */
+        onvm_qsbr_synchronize(mgr_qsbr);
+        for (shard = 0; shard < shards; shard++) {
+                onvm_ft_free(old_ft[shard]);
+        }
+        return;
+
+fail_alloc:
+        RTE_LOG(ERR, APP, "Cannot allocate a flow table of %u entries, it will not grow\n", cnt * shards);
+fail:
+        grow_failed = 1;
+        for (shard = 0; shard < shards; shard++) {
+                if (new_ft[shard] != NULL)
+                        onvm_ft_free(new_ft[shard]);
+        }
+        rte_free(new_timers);
+        rte_free(positions);
+}
+
+
+/*
+ * Pick up flows installed since the last pass, and flows whose timeouts
+ * were set after they were picked up. Only a few entries are examined
+ * per tick so the NFs installing flows never wait long for the lock.
+ */
+static void
+onvm_flow_expire_sweep(void) {
+        struct onvm_flow_entry *flow_entry;
+        struct onvm_ft *ft;
+        const void *key;
+        void *data;
+        uint32_t deadline, pos;
+        int32_t index;
+        int i;
+
+        for (i = 0; i < FLOW_EXPIRE_SWEEP; i++) {
+                ft = onvm_flow_dir_table(sweep_shard);
+                index = onvm_ft_iterate(ft, &key, &data, &sweep_next);
+                if (index < 0) {
+                        /* Done with this shard, the next one is for the next tick */
+                        sweep_shard = (sweep_shard + 1) % onvm_flow_dir_num_shards();
+                        sweep_next = 0;
+                        break;
+                }
+                if ((uint32_t)index >= shard_cnt)
+                        continue;
+
+                pos = sweep_shard * shard_cnt + index;
+                flow_entry = (struct onvm_flow_entry *)onvm_ft_get_data(ft, index);
+                if (flow_entry->sc == NULL)
+                        continue;       // still being installed
+
+                if (!flow_entry->expire_armed ||
+                    memcmp(&timers[pos].key, key, sizeof(struct onvm_ft_ipv4_5tuple)) != 0) {
+                        onvm_flow_expire_arm(pos, key);
+                } else if (!timers[pos].queued) {
+                        deadline = onvm_flow_expire_deadline(pos, flow_entry);
+                        if (deadline != FLOW_DEADLINE_NEVER)
+                                onvm_flow_expire_schedule(pos, deadline);
+                }
+        }
+}
+
+
+/*
+ * Process one tick: move the timers of the higher levels that are now
+ * within reach of the level below, then check the timers due now.
+ */
+static void
+onvm_flow_expire_advance(uint32_t tick) {
+        uint32_t pos, next;
+        int level;
+
+        for (level = 1; level < FLOW_EXPIRE_WHEEL_LEVELS; level++) {
+                if ((tick & ((1U << (FLOW_EXPIRE_WHEEL_BITS * level)) - 1)) != 0)
+                        break;
+        }
+        /* Highest level first, its timers may land in the lower ones */
+        while (--level > 0) {
+                onvm_flow_expire_cascade(level * FLOW_EXPIRE_SLOTS +
+                        ((tick >> (FLOW_EXPIRE_WHEEL_BITS * level)) & FLOW_EXPIRE_MASK));
+        }
+
+        pos = wheel[tick & FLOW_EXPIRE_MASK];
+        wheel[tick & FLOW_EXPIRE_MASK] = FLOW_TIMER_NONE;
+        for (; pos != FLOW_TIMER_NONE; pos = next) {
+                next = timers[pos].next;
+                timers[pos].queued = 0;
+                onvm_flow_expire_check(pos);
+        }
+}
+
+
+static void
+onvm_flow_expire_cascade(uint32_t slot) {
+        uint32_t pos, next;
+
+        pos = wheel[slot];
+        wheel[slot] = FLOW_TIMER_NONE;
+        for (; pos != FLOW_TIMER_NONE; pos = next) {
+                next = timers[pos].next;
+                timers[pos].queued = 0;
+                onvm_flow_expire_schedule(pos, timers[pos].expire);
+        }
+}
+
+
+/*
+ * A timer fired: remove its flow if it is past its deadline, otherwise
+ * queue it again for the deadline its last packet gave it.
+ */
+static void
+onvm_flow_expire_check(uint32_t pos) {
+        struct onvm_flow_entry *flow_entry;
+        char *data;
+        uint32_t deadline;
+
+        /* The flow was deleted, the sweep picks up whatever replaces it */
+        if (onvm_ft_lookup_key(onvm_flow_expire_table(pos), &timers[pos].key, &data) != onvm_flow_expire_index(pos))
+                return;
+
+        flow_entry = (struct onvm_flow_entry *)data;
+        if (!flow_entry->expire_armed) {
+                /* Installed again since it was armed, start over */
+                onvm_flow_expire_arm(pos, &timers[pos].key);
+                return;
+        }
+
+        deadline = onvm_flow_expire_deadline(pos, flow_entry);
+        if (deadline == FLOW_DEADLINE_NEVER)
+                return;
+        if ((int32_t)(deadline - wheel_now) > 0)
+                onvm_flow_expire_schedule(pos, deadline);
+        else if (retired_count + 2 > FLOW_EXPIRE_MAX_RETIRED)
+                /* Its key and chain have nowhere to go until they are
+                 * reclaimed, after the lock is dropped */
+                onvm_flow_expire_schedule(pos, wheel_now + 1);
+        else
+                onvm_flow_expire_remove(pos, flow_entry);
+}
+
+
+static void
+onvm_flow_expire_arm(uint32_t pos, const struct onvm_ft_ipv4_5tuple *key) {
+        struct onvm_flow_entry *flow_entry;
+        uint32_t deadline;
+
+        flow_entry = (struct onvm_flow_entry *)onvm_ft_get_data(onvm_flow_expire_table(pos),
+                                                                onvm_flow_expire_index(pos));
+        onvm_flow_expire_unlink(pos);
+        if (key != &timers[pos].key)
+                timers[pos].key = *key;
+        timers[pos].created = wheel_now;
+        flow_entry->expire_armed = 1;
+
+        deadline = onvm_flow_expire_deadline(pos, flow_entry);
+        if (deadline != FLOW_DEADLINE_NEVER)
+                onvm_flow_expire_schedule(pos, deadline);
+}
+
+
+/* The earlier of the hard deadline and the idle deadline */
+static uint32_t
+onvm_flow_expire_deadline(uint32_t pos, struct onvm_flow_entry *flow_entry) {
+        uint32_t deadline = FLOW_DEADLINE_NEVER;
+        uint32_t seen, idle;
+
+        if (flow_entry->hard_timeout != 0)
+                deadline = timers[pos].created + flow_entry->hard_timeout * FLOW_EXPIRE_TICKS_PER_SEC;
+
+        if (flow_entry->idle_timeout != 0) {
+                seen = flow_entry->last_seen;
+                if ((int32_t)(seen - timers[pos].created) < 0)
+                        seen = timers[pos].created;
+                idle = seen + flow_entry->idle_timeout * FLOW_EXPIRE_TICKS_PER_SEC;
+                if (deadline == FLOW_DEADLINE_NEVER || (int32_t)(idle - deadline) < 0)
+                        deadline = idle;
+        }
+
+        return deadline;
+}
+
+
+/*
+ * Queue a timer on the lowest level whose slots still tell its tick apart
+ * from the ticks already processed.
+ */
+static void
+onvm_flow_expire_schedule(uint32_t pos, uint32_t expire) {
+        struct flow_timer *timer = &timers[pos];
+        uint32_t delta;
+        uint16_t level, slot;
+
+        if ((int32_t)(expire - wheel_now) <= 0)
+                expire = wheel_now + 1;
+        delta = expire - wheel_now;
+        if (delta > FLOW_EXPIRE_HORIZON) {
+                delta = FLOW_EXPIRE_HORIZON;
+                expire = wheel_now + delta;
+        }
+
+        for (level = 0; level < FLOW_EXPIRE_WHEEL_LEVELS - 1; level++) {
+                if (delta < (1U << (FLOW_EXPIRE_WHEEL_BITS * (level + 1))))
+                        break;
+        }
+        slot = level * FLOW_EXPIRE_SLOTS +
+                ((expire >> (FLOW_EXPIRE_WHEEL_BITS * level)) & FLOW_EXPIRE_MASK);
+
+        onvm_flow_expire_unlink(pos);
+        timer->expire = expire;
+        timer->slot = slot;
+        timer->prev = FLOW_TIMER_NONE;
+        timer->next = wheel[slot];
+        if (timer->next != FLOW_TIMER_NONE)
+                timers[timer->next].prev = pos;
+        wheel[slot] = pos;
+        timer->queued = 1;
+}
+
+
+static void
+onvm_flow_expire_unlink(uint32_t pos) {
+        struct flow_timer *timer = &timers[pos];
+
+        if (!timer->queued)
+                return;
+
+        if (timer->prev != FLOW_TIMER_NONE)
+                timers[timer->prev].next = timer->next;
+        else
+                wheel[timer->slot] = timer->next;
+        if (timer->next != FLOW_TIMER_NONE)
+                timers[timer->next].prev = timer->prev;
+        timer->next = timer->prev = FLOW_TIMER_NONE;
+        timer->queued = 0;
+}
+
+
+/*
+ * Remove an expired flow from the table. Packet threads may still hold its
+ * entry until their next quiescent state, so its chain and key are only
+ * retired here, like onvm_flow_dir_del_key the chain is kept if other
+ * flows still use it.
+ */
+static void
+onvm_flow_expire_remove(uint32_t pos, struct onvm_flow_entry *flow_entry) {
+        struct onvm_service_chain *sc;
+        int ref_cnt;
+
+        if (onvm_ft_remove_key(onvm_flow_expire_table(pos), &timers[pos].key) < 0)
+                return;
+
+        flow_entry->expire_armed = 0;
+        sdn_ft_info->flows--;
+        flows_expired++;
+
+        if (flow_entry->key != NULL)
+                onvm_flow_expire_retire(flow_entry->key);
+        sc = flow_entry->sc;
+        if (sc != NULL) {
+                ref_cnt = sc->ref_cnt--;
+                if (ref_cnt <= 0)
+                        onvm_flow_expire_retire(sc);
+        }
+}
+
+
+/*
+ * Called with the flow dir lock held, so it must not wait for a grace
+ * period: NF packet handlers are readers and may be trying to take the lock.
+ */
+static void
+onvm_flow_expire_retire(void *ptr) {
+        if (retired_count == FLOW_EXPIRE_MAX_RETIRED) {
+                onvm_flow_dir_retire(ptr);
+                return;
+        }
+        retired[retired_count++] = ptr;
+}
+
+
+/*
+ * Pick up the chains and keys NFs retired when they deleted or rewrote flows
+ */
+static void
+onvm_flow_expire_collect(void) {
+        unsigned taken;
+
+        do {
+                if (retired_count == FLOW_EXPIRE_MAX_RETIRED)
+                        onvm_flow_expire_reclaim();
+                taken = onvm_flow_dir_take_retired(retired + retired_count,
+                                                   FLOW_EXPIRE_MAX_RETIRED - retired_count);
+                retired_count += taken;
+        } while (taken > 0);
+}
+
+
+/*
+ * Wait until no packet thread or NF can hold a retired chain or key, then
+ * free them
+ */
+static void
+onvm_flow_expire_reclaim(void) {
+        uint16_t i;
+
+        if (retired_count == 0)
+                return;
+
+        onvm_qsbr_synchronize(mgr_qsbr);
+        for (i = 0; i < retired_count; i++) {
+                rte_free(retired[i]);
+        }
+        retired_count = 0;
+}
@@ -0,0 +1,127 @@
+/*********************************************************************
+ *                     openNetVM
+ *              https://sdnfv.github.io
+ *
+ *   BSD LICENSE
+ *
+ *   Copyright(c)
+ *            2015-2016 George Washington University
+ *            2015-2016 University of California Riverside
+ *            2010-2014 Intel Corporation. All rights reserved.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ********************************************************************/
+
+
+/******************************************************************************
+
+                             onvm_flow_expire.h
+
+
+      Header file for the thread maintaining the SDN flow table: it
+      enforces the idle and hard timeouts of its entries and grows it
+
+
+******************************************************************************/
+
+
+#ifndef _ONVM_FLOW_EXPIRE_H_
+#define _ONVM_FLOW_EXPIRE_H_
+
+#include <stdint.h>
+
+#include "onvm_flow_dir.h"
+
+
+/***********************************Macros************************************/
+
+
+#define FLOW_EXPIRE_TICK_US 100000      // Granularity of the expiry clock
+#define FLOW_EXPIRE_TICKS_PER_SEC (1000000 / FLOW_EXPIRE_TICK_US)
+#define FLOW_EXPIRE_WHEEL_BITS 8        // Slots per wheel level, as a power of 2
+#define FLOW_EXPIRE_WHEEL_LEVELS 3      // Enough to cover the longest 16 bit timeout
+#define FLOW_EXPIRE_SWEEP 64            // Entries checked for new flows per tick
+#define FLOW_EXPIRE_MAX_RETIRED 256     // Chains and keys freed per grace period
+#define FLOW_EXPIRE_CACHE_POLL_US 1000 // How often flows matching wildcard rules are cached
+#define FLOW_EXPIRE_CACHE_BURST 256     // Flows cached per poll
+
+
+/*************************External global variables***************************/
+
+
+/* Current tick of the expiry clock, advanced by the expiry thread. 0 means
+ * the clock is not running. */
+extern volatile uint32_t flow_expire_clock;
+
+
+/**********************************Functions**********************************/
+
+
+/*
+ * Start the expiry thread. It ticks every FLOW_EXPIRE_TICK_US, picks up
+ * new flow table entries a few at a time and removes the ones whose idle
+ * or hard timeout has passed. Their chain and key, and those NFs retired
+ * with onvm_flow_dir_retire, are freed once no packet thread or NF can
+ * still be using them. It also doubles the table, up to
+ * SDN_FT_MAX_ENTRIES, when it is SDN_FT_GROW_PCT full or a flow could not
+ * be added. Between ticks it caches exact entries for the flows lookups
+ * classified by a wildcard rule, see onvm_flow_dir_fill_cache.
+ *
+ * Output : 0 on success, -1 on failure
+ *
+ */
+int
+onvm_flow_expire_start(void);
+
+
+/*
+ * Stop the expiry thread and free what it and the NFs had retired.
+ *
+ */
+void
+onvm_flow_expire_stop(void);
+
+
+/*
+ * Record that a packet of a flow was seen. Called by the packet threads
+ * for every packet with a flow entry, so it only writes the entry, and
+ * dirties its cache line, once per tick.
+ *
+ * Input : the packet's flow entry
+ *
+ */
+static inline void
+onvm_flow_expire_touch(struct onvm_flow_entry *flow_entry) {
+        uint32_t now = flow_expire_clock;
+
+        if (flow_entry->last_seen != now)
+                flow_entry->last_seen = now;
+}
+
+#endif  // _ONVM_FLOW_EXPIRE_H_
@@ -64,9 +64,12 @@ struct rte_mempool *nf_msg_pool;
 struct rte_ring *incoming_msg_queue;
 uint16_t **services;
 uint16_t *nf_per_service_count;
+struct onvm_service_map *service_map;
 struct client_tx_stats *clients_stats;
 struct onvm_service_chain *default_chain;
 struct onvm_service_chain **default_sc_p;
+struct onvm_qsbr *mgr_qsbr;
+struct onvm_latency_info *latency_info;
 
 
 /*************************Internal Functions Prototypes***********************/
@@ -76,6 +79,8 @@ static int init_mbuf_pools(void);
 static int init_client_info_pool(void);
 static int init_nf_msg_pool(void);
 static int init_port(uint8_t port_num);
+static void init_port_reta(uint8_t port_num, uint16_t rx_rings, const struct rte_eth_dev_info *dev_info);
+static uint16_t init_flow_shards(void);
 static int init_shm_rings(void);
 static int init_info_queue(void);
 static void check_all_ports_link_status(uint8_t port_num, uint32_t port_mask);
@@ -90,6 +95,7 @@ init(int argc, char *argv[]) {
         const struct rte_memzone *mz;
 	const struct rte_memzone *mz_scp;
         uint8_t i, total_ports;
+        struct rte_eth_dev_info dev_info;
 
         /* init EAL, parsing EAL args */
         retval = rte_eal_init(argc, argv);
@@ -102,23 +108,40 @@ init(int argc, char *argv[]) {
         total_ports = rte_eth_dev_count();
 
         /* set up array for client tx data */
-        mz = rte_memzone_reserve(MZ_CLIENT_INFO, sizeof(*clients_stats),
+        mz = rte_memzone_reserve(MZ_CLIENT_INFO, MAX_CLIENTS * sizeof(*clients_stats),
                                 rte_socket_id(), NO_FLAGS);
         if (mz == NULL)
                 rte_exit(EXIT_FAILURE, "Cannot reserve memory zone for client information\n");
-        memset(mz->addr, 0, sizeof(*clients_stats));
+        memset(mz->addr, 0, MAX_CLIENTS * sizeof(*clients_stats));
         clients_stats = mz->addr;
 
-	/* set up ports info */
-        ports = rte_malloc(MZ_PORT_INFO, sizeof(*ports), 0);
-        if (ports == NULL)
-                rte_exit(EXIT_FAILURE, "Cannot allocate memory for ports details\n");
+        /* set up reclamation state for data read by the packet threads */
+        mgr_qsbr = onvm_qsbr_create(MZ_QSBR_INFO);
+        if (mgr_qsbr == NULL)
+                rte_exit(EXIT_FAILURE, "Cannot reserve memory zone for QSBR information\n");
+
+	/* set up ports info, shared with NFs that transmit themselves */
+        mz = rte_memzone_reserve(MZ_PORT_INFO, sizeof(*ports),
+                                rte_socket_id(), NO_FLAGS);
+        if (mz == NULL)
+                rte_exit(EXIT_FAILURE, "Cannot reserve memory zone for ports details\n");
+        memset(mz->addr, 0, sizeof(*ports));
+        ports = mz->addr;
 
         /* parse additional, application arguments */
         retval = parse_app_args(total_ports, argc, argv);
         if (retval != 0)
                 return -1;
 
+        /* set up latency histograms, NFs only fill theirs if -L was given */
+        mz = rte_memzone_reserve(MZ_LATENCY_INFO, sizeof(*latency_info),
+                                rte_socket_id(), NO_FLAGS);
+        if (mz == NULL)
+                rte_exit(EXIT_FAILURE, "Cannot reserve memory zone for latency information\n");
+        memset(mz->addr, 0, sizeof(*latency_info));
+        latency_info = mz->addr;
+        latency_info->enabled = track_latency;
+
         /* initialise mbuf pools */
         retval = init_mbuf_pools();
         if (retval != 0)
@@ -136,6 +159,20 @@ init(int argc, char *argv[]) {
                 rte_exit(EXIT_FAILURE, "Cannot create nf message pool: %s\n", rte_strerror(rte_errno));
         }
 
+        /* Leave a TX queue per NF if every port has room for it on top of
+         * one per manager thread */
+        ports->nf_tx_queues = MAX_CLIENTS;
+        for (i = 0; i < ports->num_ports; i++) {
+                rte_eth_dev_info_get(ports->id[i], &dev_info);
+                if (dev_info.max_tx_queues < MAX_CLIENTS + rte_lcore_count() - 1)
+                        ports->nf_tx_queues = 0;
+        }
+        if (ports->nf_tx_queues == 0)
+                printf("Not enough TX queues for NFs to transmit themselves\n");
+
+        /* the flow table first, the ports' RSS follows its shards */
+        onvm_flow_dir_init(flow_entries, init_flow_shards());
+
 	/* now initialise the ports we will use */
         for (i = 0; i < ports->num_ports; i++) {
                 retval = init_port(ports->id[i]);
@@ -171,12 +208,24 @@ init(int argc, char *argv[]) {
 	*default_sc_p = default_chain;
 	onvm_sc_print(default_chain);
 
-	onvm_flow_dir_init();
-
 	return 0;
 }
 
 
+uint16_t
+onvm_init_port_rx_queues(uint8_t port_id) {
+        uint16_t i, count = 0;
+
+        /* parse_app_args checked each port's queues run from 0 without gaps */
+        for (i = 0; i < num_rx_queue_conf; i++) {
+                if (rx_queue_conf[i].port == port_id)
+                        count++;
+        }
+
+        return count;
+}
+
+
 /*****************************Internal functions******************************/
 
 
@@ -188,15 +237,19 @@ static int
 init_mbuf_pools(void) {
         const unsigned num_mbufs = (MAX_CLIENTS * MBUFS_PER_CLIENT) \
                         + (ports->num_ports * MBUFS_PER_PORT);
+        struct rte_pktmbuf_pool_private pool_priv;
 
         /* don't pass single-producer/single-consumer flags to mbuf create as it
          * seems faster to use a cache instead */
         printf("Creating mbuf pool '%s' [%u mbufs] ...\n",
                         PKTMBUF_POOL_NAME, num_mbufs);
+        /* leave room for struct onvm_pkt_priv between each mbuf and its data */
+        pool_priv.mbuf_data_room_size = RX_MBUF_DATA_SIZE + RTE_PKTMBUF_HEADROOM;
+        pool_priv.mbuf_priv_size = sizeof(struct onvm_pkt_priv);
         pktmbuf_pool = rte_mempool_create(PKTMBUF_POOL_NAME, num_mbufs,
                         MBUF_SIZE, MBUF_CACHE_SIZE,
                         sizeof(struct rte_pktmbuf_pool_private), rte_pktmbuf_pool_init,
-                        NULL, rte_pktmbuf_init, NULL, rte_socket_id(), NO_FLAGS);
+                        &pool_priv, rte_pktmbuf_init, NULL, rte_socket_id(), NO_FLAGS);
 
         return (pktmbuf_pool == NULL); /* 0  on success */
 }
@@ -255,10 +308,13 @@ init_port(uint8_t port_num) {
                 },
         };
 
-        const uint16_t rx_rings = ONVM_NUM_RX_THREADS, tx_rings = MAX_CLIENTS;
+        /* One TX queue per NF (if any), then one per manager thread */
+        const uint16_t rx_rings = onvm_init_port_rx_queues(port_num);
+        const uint16_t tx_rings = ports->nf_tx_queues + rte_lcore_count() - 1;
         const uint16_t rx_ring_size = RTE_MP_RX_DESC_DEFAULT;
         const uint16_t tx_ring_size = RTE_MP_TX_DESC_DEFAULT;
 
+        struct rte_eth_dev_info dev_info;
         uint16_t q;
         int retval;
 
@@ -267,6 +323,13 @@ init_port(uint8_t port_num) {
         printf("Port %u Rx rings %u ... \n", (unsigned)port_num, (unsigned)rx_rings);
         fflush(stdout);
 
+        rte_eth_dev_info_get(port_num, &dev_info);
+        if (rx_rings > dev_info.max_rx_queues) {
+                printf("Port %u supports at most %u Rx rings\n",
+                        (unsigned)port_num, (unsigned)dev_info.max_rx_queues);
+                return -EINVAL;
+        }
+
         /* Standard DPDK port initialisation - config port, then set up
          * rx and tx rings */
         if ((retval = rte_eth_dev_configure(port_num, rx_rings, tx_rings,
@@ -292,11 +355,63 @@ init_port(uint8_t port_num) {
         retval  = rte_eth_dev_start(port_num);
         if (retval < 0) return retval;
 
+        if (onvm_flow_dir_num_shards() > 1)
+                init_port_reta(port_num, rx_rings, &dev_info);
+
         printf("done: \n");
 
         return 0;
 }
 
+/**
+ * Point each RSS bucket of a port at the RX queue whose flow table shard
+ * holds its flows, so each RX thread mostly looks up its own shard. Ports
+ * this can't be done for still work, their RX threads just share shards.
+ */
+static void
+init_port_reta(uint8_t port_num, uint16_t rx_rings, const struct rte_eth_dev_info *dev_info) {
+        struct rte_eth_rss_reta_entry64 reta_conf[ETH_RSS_RETA_SIZE_512 / RTE_RETA_GROUP_SIZE];
+        uint16_t i;
+
+        if (rx_rings != onvm_flow_dir_num_shards() || dev_info->reta_size < SDN_FT_SHARD_BUCKETS ||
+            dev_info->reta_size > ETH_RSS_RETA_SIZE_512 || dev_info->reta_size % SDN_FT_SHARD_BUCKETS != 0) {
+                printf("Port %u: RX queues not matched to flow table shards\n", (unsigned)port_num);
+                return;
+        }
+
+        memset(reta_conf, 0, sizeof(reta_conf));
+        for (i = 0; i < dev_info->reta_size; i++) {
+                reta_conf[i / RTE_RETA_GROUP_SIZE].mask |= 1ULL << (i % RTE_RETA_GROUP_SIZE);
+                reta_conf[i / RTE_RETA_GROUP_SIZE].reta[i % RTE_RETA_GROUP_SIZE] = onvm_flow_dir_rss_shard(i);
+        }
+        if (rte_eth_dev_rss_reta_update(port_num, reta_conf, dev_info->reta_size) != 0)
+                printf("Port %u: cannot set RSS redirection table, RX queues not matched to flow table shards\n",
+                       (unsigned)port_num);
+}
+
+/**
+ * One flow table shard per RX queue with -S, as many as the port with the
+ * most queues has
+ */
+static uint16_t
+init_flow_shards(void) {
+        uint16_t shards = 1;
+        uint8_t i;
+
+        if (!shard_flows)
+                return 1;
+
+        for (i = 0; i < ports->num_ports; i++) {
+                shards = RTE_MAX(shards, onvm_init_port_rx_queues(ports->id[i]));
+        }
+        if (shards > SDN_FT_MAX_SHARDS) {
+                printf("Flow table split in %u shards, not one per RX queue\n", SDN_FT_MAX_SHARDS);
+                shards = SDN_FT_MAX_SHARDS;
+        }
+
+        return shards;
+}
+
 /**
  * Set up the DPDK rings which will be used to pass packets, via
  * pointers, between the multi-process server and client processes.
@@ -311,6 +426,7 @@ init_shm_rings(void) {
         const char * msg_q_name;
         const unsigned ringsize = CLIENT_QUEUE_RINGSIZE;
         const unsigned msgringsize = CLIENT_MSG_QUEUE_SIZE;
+        const struct rte_memzone *mz;
 
         // use calloc since we allocate for all possible clients
         // ensure that all fields are init to 0 to avoid reading garbage
@@ -320,16 +436,22 @@ init_shm_rings(void) {
         if (clients == NULL)
                 rte_exit(EXIT_FAILURE, "Cannot allocate memory for client program details\n");
 
+        /* The service map is shared so NFs can hand packets to each other */
+        mz = rte_memzone_reserve(MZ_SERVICE_MAP, sizeof(*service_map),
+                                rte_socket_id(), NO_FLAGS);
+        if (mz == NULL)
+                rte_exit(EXIT_FAILURE, "Cannot reserve memory zone for service to NF mapping\n");
+        memset(mz->addr, 0, sizeof(*service_map));
+        service_map = mz->addr;
+
         services = rte_calloc("service to nf map",
                 num_services, sizeof(uint16_t*), 0);
+        if (services == NULL)
+                rte_exit(EXIT_FAILURE, "Cannot allocate memory for service to NF mapping\n");
         for (i = 0; i < num_services; i++) {
-                services[i] = rte_calloc("one service NFs",
-                        MAX_CLIENTS_PER_SERVICE, sizeof(uint16_t), 0);
+                services[i] = service_map->nf[i];
         }
-        nf_per_service_count = rte_calloc("count of NFs active per service",
-                num_services, sizeof(uint16_t), 0);
-        if (services == NULL || nf_per_service_count == NULL)
-                rte_exit(EXIT_FAILURE, "Cannot allocate memory for service to NF mapping\n");
+        nf_per_service_count = service_map->count;
 
         for (i = 0; i < MAX_CLIENTS; i++) {
                 /* Create an RX queue for each client */
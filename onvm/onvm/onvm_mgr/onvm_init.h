@@ -75,6 +75,8 @@
 #include "onvm_sc_common.h"
 #include "onvm_flow_table.h"
 #include "onvm_flow_dir.h"
+#include "onvm_qsbr.h"
+#include "onvm_latency.h"
 
 
 /***********************************Macros************************************/
@@ -85,7 +87,7 @@
 #define MBUF_CACHE_SIZE 512
 #define MBUF_OVERHEAD (sizeof(struct rte_mbuf) + RTE_PKTMBUF_HEADROOM)
 #define RX_MBUF_DATA_SIZE 2048
-#define MBUF_SIZE (RX_MBUF_DATA_SIZE + MBUF_OVERHEAD)
+#define MBUF_SIZE (RX_MBUF_DATA_SIZE + MBUF_OVERHEAD + sizeof(struct onvm_pkt_priv))
 
 #define NF_INFO_SIZE sizeof(struct onvm_nf_info)
 #define NF_INFO_CACHE 8
@@ -100,11 +102,19 @@
 
 #define NO_FLAGS 0
 
-#define ONVM_NUM_RX_THREADS 1
+#define ONVM_NUM_RX_THREADS 1    // default, see -n
+#define ONVM_MAX_RX_THREADS 16
+#define ONVM_MAX_RX_QUEUE_CONF 128
+#define RX_LCORE_AUTO RTE_MAX_LCORE  // no lcore given, assigned at launch
 
 #define NOT_DISTRIBUTED 0
 #define DISTRIBUTED 1
 
+#define REMOTE_SELECT_RSS 0     // spread new remote flows by RSS hash
+#define REMOTE_SELECT_P2C 1     // send new remote flows to the less loaded of two managers
+#define REMOTE_SELECT_STR_RSS "rss"
+#define REMOTE_SELECT_STR_P2C "p2c"
+
 /******************************Data structures********************************/
 
 
@@ -118,50 +128,20 @@ struct client {
         struct rte_ring *msg_q;
         struct onvm_nf_info *info;
         uint16_t instance_id;
-        /* these stats hold how many packets the client will actually receive,
-         * and how many packets were dropped because the client's queue was full.
-         * The port-info stats, in contrast, record how many packets were received
-         * or transmitted on an actual NIC port.
-         */
-        struct {
-                volatile uint64_t rx;
-                volatile uint64_t rx_drop;
-                volatile uint64_t act_out;
-                volatile uint64_t act_tonf;
-                volatile uint64_t act_drop;
-                volatile uint64_t act_next;
-                volatile uint64_t act_buffer;
-        } stats;
+        /* The manager threads count this client's packets in their own
+         * struct thread_stats, see onvm_mgr.h */
 };
 
 
 /*
- * Shared port info, including statistics information for display by server.
- * Structure will be put in a memzone.
- * - All port id values share one cache line as this data will be read-only
- * during operation.
- * - All rx statistic values share cache lines, as this data is written only
- * by the server process. (rare reads by stats display)
- * - The tx statistics have values for all ports per cache line, but the stats
- * themselves are written by the clients, so we have a distinct set, on different
- * cache lines for each client to use.
+ * One NIC RX queue and the RX thread that polls it. Entries either come
+ * from -q or, by default, give RX thread N queue N of every port.
  */
-struct rx_stats{
-        uint64_t rx[RTE_MAX_ETHPORTS];
-};
-
-
-struct tx_stats{
-        uint64_t tx[RTE_MAX_ETHPORTS];
-        uint64_t tx_drop[RTE_MAX_ETHPORTS];
-};
-
-
-struct port_info {
-        uint8_t num_ports;
-        uint8_t id[RTE_MAX_ETHPORTS];
-        volatile struct rx_stats rx_stats;
-        volatile struct tx_stats tx_stats;
+struct rx_queue_conf {
+        uint8_t port;
+        uint16_t queue;
+        uint16_t thread;
+        unsigned lcore;
 };
 
 
@@ -183,11 +163,25 @@ extern uint16_t num_clients;
 extern uint16_t num_services;
 extern uint16_t default_service;
 extern uint8_t is_distributed;
+extern uint8_t remote_selection;
+extern uint32_t tunnel_ip;
+extern uint16_t num_rx_threads;
+extern uint16_t batch_size;
+extern uint32_t flush_latency_us;
+extern uint64_t flush_latency_cycles;
+extern uint8_t track_latency;
+extern uint16_t exporter_port;
+extern uint32_t flow_entries;
+extern uint8_t shard_flows;
+extern struct rx_queue_conf rx_queue_conf[ONVM_MAX_RX_QUEUE_CONF];
+extern uint16_t num_rx_queue_conf;
 extern uint16_t **services;
 extern uint16_t *nf_per_service_count;
+extern struct onvm_service_map *service_map;
 extern unsigned num_sockets;
 extern struct onvm_service_chain *default_chain;
-extern struct onvm_ft *sdn_ft;
+extern struct onvm_qsbr *mgr_qsbr;
+extern struct onvm_latency_info *latency_info;
 extern ONVM_STATS_OUTPUT stats_destination;
 
 /**********************************Functions**********************************/
@@ -203,4 +197,14 @@ extern ONVM_STATS_OUTPUT stats_destination;
  */
 int init(int argc, char *argv[]);
 
+
+/*
+ * Function returning how many RX queues a port is polled on.
+ *
+ * Input  : the port id
+ * Output : the number of RX queues configured for it
+ *
+ */
+uint16_t onvm_init_port_rx_queues(uint8_t port_id);
+
 #endif  // _ONVM_INIT_H_
@@ -86,6 +86,10 @@
 
 
 #define PACKET_READ_SIZE ((uint16_t)32)
+/* A full batch an NF could not take yet, plus room for one more burst */
+#define PACKET_BUF_SIZE (2 * PACKET_READ_SIZE)
+/* Packets ahead of the one being classified whose headers are prefetched */
+#define RX_PREFETCH_OFFSET 4
 
 #define TO_PORT 0
 #define TO_CLIENT 1
@@ -106,8 +110,50 @@ extern uint16_t next_instance_id;
  * clients or to the NIC
  */
 struct packet_buf {
-        struct rte_mbuf *buffer[PACKET_READ_SIZE];
+        struct rte_mbuf *buffer[PACKET_BUF_SIZE];
         uint16_t count;
+        /* On the owning thread's dirty list */
+        uint8_t dirty;
+        /* TSC by which the oldest buffered packet must be sent */
+        uint64_t deadline;
+};
+
+
+/*
+ * NFs a TX thread dequeues from. The master publishes a new list with a
+ * pointer swap and only reuses the old one once the thread is quiescent.
+ */
+struct tx_nf_list {
+        uint16_t count;
+        uint16_t id[MAX_CLIENTS];
+};
+
+
+/*
+ * Per NF counters kept by one manager thread. rx and rx_drop count how many
+ * packets the thread gave the NF and how many it dropped because the NF's
+ * queue was full, act_* what it did with the packets the NF sent back.
+ */
+struct thread_nf_stats {
+        uint64_t rx;
+        uint64_t rx_drop;
+        uint64_t act_out;
+        uint64_t act_tonf;
+        uint64_t act_drop;
+        uint64_t act_next;
+} __rte_cache_aligned;
+
+
+/*
+ * Counters of one manager thread. Only that thread writes them, so no two
+ * threads share a cache line; the stats thread adds up every thread's.
+ */
+struct thread_stats {
+        struct thread_nf_stats nf[MAX_CLIENTS];
+        /* NIC packets received and sent by this thread, by port */
+        uint64_t port_rx[RTE_MAX_ETHPORTS] __rte_cache_aligned;
+        uint64_t port_tx[RTE_MAX_ETHPORTS];
+        uint64_t port_tx_drop[RTE_MAX_ETHPORTS];
 };
 
 
@@ -115,15 +161,31 @@ struct packet_buf {
  *  includes the packet buffers used by the thread for NFs and ports.
  */
 struct thread_info {
-       unsigned queue_id;
-       unsigned first_cl;
-       unsigned last_cl;
-       /* FIXME: This is confusing since it is non-inclusive. It would be
-        *        better to have this take the first client and the number
-        *        of consecutive clients after it to handle.
-        */
+       /* NIC TX queue this thread sends on, no other thread uses it */
+       unsigned tx_queue_id;
+       /* NIC RX queues this thread polls, RX threads only */
+       struct rx_queue_conf *rx_queues;
+       uint16_t num_rx_queues;
+       /* NFs this thread serves, TX threads only, see onvm_sched.c */
+       struct tx_nf_list *volatile nfs;
        struct packet_buf *nf_rx_buf;
        struct packet_buf *port_tx_buf;
+       /* Buffers holding packets, so flushing never scans empty ones */
+       uint16_t dirty_nfs[MAX_CLIENTS];
+       uint16_t num_dirty_nfs;
+       uint16_t dirty_ports[RTE_MAX_ETHPORTS];
+       uint16_t num_dirty_ports;
+       /* Last NF each NF sent packets to through this thread, for backpressure */
+       uint16_t nf_feeds[MAX_CLIENTS];
+       uint16_t last_nf;
+       int qsbr_id;
+       /* Remote manager each flow is pinned to, NULL if not distributed */
+       struct onvm_zk_flow_table *remote_flows;
+       /* End-to-end latency of the packets this thread sent out, indexed by
+        * the last NF they went through. NULL unless -L was given. */
+       struct onvm_hist *e2e_hist;
+       /* Packet counters, cache aligned, see onvm_stats.c */
+       struct thread_stats *stats;
 };
 
 #endif  // _ONVM_MGR_H_
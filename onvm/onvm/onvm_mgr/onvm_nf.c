@@ -48,6 +48,8 @@
 ******************************************************************************/
 
 #include <rte_log.h>
+#include <errno.h>
+#include <signal.h>
 
 #include "onvm_mgr.h"
 #include "onvm_nf.h"
@@ -93,6 +95,27 @@ inline static int
 onvm_nf_stop(struct onvm_nf_info *nf_info);
 
 
+/*
+ * Function stopping the running NFs whose process is gone without telling
+ * us, e.g. killed or crashed.
+ *
+ */
+static void
+onvm_nf_check_alive(void);
+
+
+/*
+ * Functions bracketing a change to the shared service map, so NFs reading
+ * it (see onvm_service_map_lookup) retry instead of seeing half an update.
+ *
+ */
+static inline void
+onvm_nf_service_map_begin(void);
+
+static inline void
+onvm_nf_service_map_end(void);
+
+
 /********************************Interfaces***********************************/
 
 
@@ -126,6 +149,8 @@ onvm_nf_check_status(void) {
         struct onvm_nf_info *nf;
         int num_msgs = rte_ring_count(incoming_msg_queue);
 
+        onvm_nf_check_alive();
+
         if (rte_ring_dequeue_bulk(incoming_msg_queue, msgs, num_msgs) != 0)
                 return;
 
@@ -176,17 +201,11 @@ onvm_nf_send_msg(uint16_t dest, uint8_t msg_type, void *msg_data) {
 
 inline uint16_t
 onvm_nf_service_to_nf_map(uint16_t service_id, struct rte_mbuf *pkt) {
-        uint16_t num_nfs_available = nf_per_service_count[service_id];
-
-        if (num_nfs_available == 0)
-                return 0;
-
         if (pkt == NULL)
                 return 0;
 
-        uint16_t instance_index = pkt->hash.rss % num_nfs_available;
-        uint16_t instance_id = services[service_id][instance_index];
-        return instance_id;
+        /* Same pick as the NFs' direct handoff, so a flow keeps its NF */
+        return onvm_service_map_lookup(service_map, service_id, pkt->hash.rss);
 }
 
 
@@ -235,12 +254,40 @@ onvm_nf_start(struct onvm_nf_info *nf_info) {
 }
 
 
+static void
+onvm_nf_check_alive(void) {
+        static uint64_t mgr_pid_ns = 0;
+        struct onvm_nf_info *nf;
+        uint16_t i;
+
+        if (mgr_pid_ns == 0)
+                mgr_pid_ns = onvm_pid_ns();
+
+        for (i = 0; i < MAX_CLIENTS; i++) {
+                nf = clients[i].info;
+                /* Only pids from our namespace mean anything to us */
+                if (nf == NULL || nf->status != NF_RUNNING || nf->pid_ns == 0 || nf->pid_ns != mgr_pid_ns)
+                        continue;
+                if (kill(nf->pid, 0) == 0 || errno != ESRCH)
+                        continue;
+
+                RTE_LOG(INFO, APP, "NF %"PRIu16" (pid %d) exited without stopping\n", i, (int)nf->pid);
+                nf->status = NF_STOPPED;
+                if (!onvm_nf_stop(nf))
+                        num_clients--;
+        }
+}
+
+
 inline static int
 onvm_nf_ready(struct onvm_nf_info *info) {
         // Register this NF running within its service
         info->status = NF_RUNNING;
-        uint16_t service_count = nf_per_service_count[info->service_id]++;
+        onvm_nf_service_map_begin();
+        uint16_t service_count = nf_per_service_count[info->service_id];
         services[info->service_id][service_count] = info->instance_id;
+        nf_per_service_count[info->service_id]++;
+        onvm_nf_service_map_end();
 
         // If we're running in distributed mode, register this NF with ZooKeeper
         if (is_distributed == DISTRIBUTED) {
@@ -270,11 +317,18 @@ onvm_nf_stop(struct onvm_nf_info *nf_info) {
         /* Clean up dangling pointers to info struct */
         clients[nf_id].info = NULL;
 
+        /* An NF that died still holds its QSBR reader slot */
+        if (nf_info->qsbr_id != ONVM_QSBR_NO_READER) {
+                onvm_qsbr_unregister(mgr_qsbr, nf_info->qsbr_id);
+                nf_info->qsbr_id = ONVM_QSBR_NO_READER;
+        }
+
         /* Reset stats */
         onvm_stats_clear_client(nf_id);
 
         /* Remove this NF from the service map.
          * Need to shift all elements past it in the array left to avoid gaps */
+        onvm_nf_service_map_begin();
         service_count = --nf_per_service_count[service_id];
         for (mapIndex = 0; mapIndex < MAX_CLIENTS_PER_SERVICE; mapIndex++) {
                 if (services[service_id][mapIndex] == nf_id) {
@@ -294,6 +348,7 @@ onvm_nf_stop(struct onvm_nf_info *nf_info) {
                         services[service_id][mapIndex + 1] = 0;
                 }
         }
+        onvm_nf_service_map_end();
 
         // If we're running in distributed mode, unregister this NF with ZooKeeper
         if (is_distributed == DISTRIBUTED) {
@@ -310,3 +365,17 @@ onvm_nf_stop(struct onvm_nf_info *nf_info) {
 
         return 0;
 }
+
+
+static inline void
+onvm_nf_service_map_begin(void) {
+        service_map->seq++;
+        rte_smp_wmb();
+}
+
+
+static inline void
+onvm_nf_service_map_end(void) {
+        rte_smp_wmb();
+        service_map->seq++;
+}
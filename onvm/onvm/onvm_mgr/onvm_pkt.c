@@ -54,6 +54,7 @@
 #include "onvm_nf.h"
 #include "onvm_zookeeper.h"
 #include "onvm_vxlan.h"
+#include "onvm_flow_expire.h"
 
 
 /**********************Internal Functions Prototypes**************************/
@@ -69,6 +70,19 @@ static void
 onvm_pkt_flush_port_queue(struct thread_info *tx, uint16_t port);
 
 
+/*
+ * Function to record how long packets about to be sent out spent in the
+ * system, in the histogram of the last NF each went through. Called before
+ * the packets are handed to the NIC, which may free them.
+ *
+ * Inputs : the thread's end-to-end histograms
+ *          the packets and their number
+ *
+ */
+static void
+onvm_pkt_record_e2e(struct onvm_hist *hist, struct rte_mbuf *pkts[], uint16_t count);
+
+
 /*
  * Function to send packets to one NF after processing them.
  *
@@ -79,6 +93,19 @@ static void
 onvm_pkt_flush_nf_queue(struct thread_info *thread, uint16_t client);
 
 
+/*
+ * Function to put a buffer on its thread's dirty list when it receives
+ * its first packet, starting the buffer's flush deadline.
+ *
+ * Inputs : the buffer
+ *          the thread's dirty list and its length
+ *          the buffer's index, to store in the list
+ *
+ */
+static inline void
+onvm_pkt_mark_dirty(struct packet_buf *buf, uint16_t *dirty, uint16_t *num_dirty, uint16_t index);
+
+
 /*
  * Function to enqueue a packet on one port's queue.
  *
@@ -132,43 +159,71 @@ onvm_pkt_drop(struct rte_mbuf *pkt);
 
 void
 onvm_pkt_process_rx_batch(struct thread_info *rx, struct rte_mbuf *pkts[], uint16_t rx_count) {
-        uint16_t i;
+        uint16_t i, num_local;
         struct onvm_pkt_meta *meta;
-        struct onvm_flow_entry *flow_entry;
+        struct rte_mbuf *local_pkts[PACKET_READ_SIZE];
+        struct onvm_flow_entry *flow_entries[PACKET_READ_SIZE];
         struct onvm_service_chain *sc;
-        int ret;
+        struct onvm_pkt_priv *priv;
+        uint64_t now;
 
         if (rx == NULL || pkts == NULL)
                 return;
 
+        if (rx->e2e_hist != NULL) {
+                /* One timestamp for the burst, they all arrived together */
+                now = rte_rdtsc();
+                for (i = 0; i < rx_count; i++) {
+                        priv = onvm_get_pkt_priv(pkts[i]);
+                        priv->rx_tsc = priv->hop_tsc = now;
+                }
+        }
+
+        /* The burst is classified in stages so that the header and flow
+         * table cache misses of all its packets overlap: strip the tunnel
+         * headers, look up the flows of the packets that were not tunnelled
+         * in one go, then pick their next hop. */
+        for (i = 0; i < rx_count && i < RX_PREFETCH_OFFSET; i++)
+                rte_prefetch0(rte_pktmbuf_mtod(pkts[i], void *));
+
+        num_local = 0;
         for (i = 0; i < rx_count; i++) {
-                ret = onvm_decapsulate_pkt(pkts[i]);
-                meta = (struct onvm_pkt_meta*) &(((struct rte_mbuf*)pkts[i])->udata64);
-                if (ret == -1) {
-                        // If the packet is not coming from another manager, route on default chain
-                        meta->src = 0;
-                        meta->chain_index = 0;
-                        ret = onvm_flow_dir_get_pkt(pkts[i], &flow_entry);
-                        if (ret >= 0) {
-                                sc = flow_entry->sc;
-                                meta->action = onvm_sc_next_action(sc, pkts[i]);
-                                meta->destination = onvm_sc_next_destination(sc, pkts[i]);
-                        } else {
-                                meta->action = onvm_sc_next_action(default_chain, pkts[i]);
-                                meta->destination = onvm_sc_next_destination(default_chain, pkts[i]);
-                        }
+                if (i + RX_PREFETCH_OFFSET < rx_count)
+                        rte_prefetch0(rte_pktmbuf_mtod(pkts[i + RX_PREFETCH_OFFSET], void *));
+                /* Packets coming from another manager carry their meta */
+                if (onvm_decapsulate_pkt(pkts[i]) == -1)
+                        local_pkts[num_local++] = pkts[i];
+        }
+
+        if (num_local > 0)
+                onvm_flow_dir_get_pkt_bulk(local_pkts, num_local, flow_entries);
+
+        for (i = 0; i < num_local; i++) {
+                // If the packet is not coming from another manager, route on default chain
+                meta = onvm_get_pkt_meta(local_pkts[i]);
+                meta->src = 0;
+                meta->chain_index = 0;
+                sc = NULL;
+                if (flow_entries[i] != NULL) {
+                        onvm_flow_expire_touch(flow_entries[i]);
+                        sc = flow_entries[i]->sc;
                 }
+                if (sc == NULL)
+                        sc = default_chain;
+                meta->action = onvm_sc_next_action(sc, local_pkts[i]);
+                meta->destination = onvm_sc_next_destination(sc, local_pkts[i]);
+        }
+
+        for (i = 0; i < rx_count; i++) {
                 /* PERF: this might hurt performance since it will cause cache
                  * invalidations. Ideally the data modified by the NF manager
                  * would be a different line than that modified/read by NFs.
                  * That may not be possible.
                  */
-
+                meta = onvm_get_pkt_meta(pkts[i]);
                 (meta->chain_index)++;
                 onvm_pkt_enqueue_nf(rx, meta->destination, pkts[i]);
         }
-
-        onvm_pkt_flush_all_nfs(rx);
 }
 
 
@@ -180,23 +235,24 @@ onvm_pkt_process_tx_batch(struct thread_info *tx, struct rte_mbuf *pkts[], uint1
         if (tx == NULL || pkts == NULL || cl == NULL)
                 return;
 
+        tx->last_nf = 0;
         for (i = 0; i < tx_count; i++) {
                 meta = (struct onvm_pkt_meta*) &(((struct rte_mbuf*)pkts[i])->udata64);
                 meta->src = cl->instance_id;
                 if (meta->action == ONVM_NF_ACTION_DROP) {
                         // if the packet is drop, then <return value> is 0
                         // and !<return value> is 1.
-                        cl->stats.act_drop += !onvm_pkt_drop(pkts[i]);
+                        tx->stats->nf[cl->instance_id].act_drop += !onvm_pkt_drop(pkts[i]);
                 } else if (meta->action == ONVM_NF_ACTION_NEXT) {
                         /* TODO: Here we drop the packet : there will be a flow table
                         in the future to know what to do with the packet next */
-                        cl->stats.act_next++;
+                        tx->stats->nf[cl->instance_id].act_next++;
                         onvm_pkt_process_next_action(tx, pkts[i], cl);
                 } else if (meta->action == ONVM_NF_ACTION_TONF) {
-                        cl->stats.act_tonf++;
+                        tx->stats->nf[cl->instance_id].act_tonf++;
                         onvm_pkt_enqueue_nf(tx, meta->destination, pkts[i]);
                 } else if (meta->action == ONVM_NF_ACTION_OUT) {
-                        cl->stats.act_out++;
+                        tx->stats->nf[cl->instance_id].act_out++;
                         onvm_pkt_enqueue_port(tx, meta->destination, pkts[i]);
                 } else {
                         printf("ERROR invalid action : this shouldn't happen.\n");
@@ -204,6 +260,22 @@ onvm_pkt_process_tx_batch(struct thread_info *tx, struct rte_mbuf *pkts[], uint1
                         return;
                 }
         }
+
+        /* Remember where this NF's packets go, see onvm_pkt_nf_blocked */
+        tx->nf_feeds[cl->instance_id] = tx->last_nf;
+}
+
+
+int
+onvm_pkt_nf_blocked(struct thread_info *tx, uint16_t instance_id) {
+        uint16_t dst;
+
+        dst = tx->nf_feeds[instance_id];
+        if (dst == 0)
+                return 0;
+
+        /* Only read another burst if the NF it feeds can absorb it */
+        return tx->nf_rx_buf[dst].count > PACKET_BUF_SIZE - PACKET_READ_SIZE;
 }
 
 
@@ -214,22 +286,75 @@ onvm_pkt_flush_all_ports(struct thread_info *tx) {
         if (tx == NULL)
                 return;
 
-        for (i = 0; i < ports->num_ports; i++)
-                onvm_pkt_flush_port_queue(tx, i);
+        for (i = 0; i < tx->num_dirty_ports; i++) {
+                onvm_pkt_flush_port_queue(tx, tx->dirty_ports[i]);
+                tx->port_tx_buf[tx->dirty_ports[i]].dirty = 0;
+        }
+        tx->num_dirty_ports = 0;
 }
 
 
 void
 onvm_pkt_flush_all_nfs(struct thread_info *tx) {
-        uint16_t i;
+        uint16_t i, kept;
 
         if (tx == NULL)
                 return;
 
-        for (i = 0; i < MAX_CLIENTS; i++)
-                onvm_pkt_flush_nf_queue(tx, i);
+        /* NFs that are backed up keep their leftover packets listed */
+        for (i = 0, kept = 0; i < tx->num_dirty_nfs; i++) {
+                onvm_pkt_flush_nf_queue(tx, tx->dirty_nfs[i]);
+                if (tx->nf_rx_buf[tx->dirty_nfs[i]].count > 0)
+                        tx->dirty_nfs[kept++] = tx->dirty_nfs[i];
+                else
+                        tx->nf_rx_buf[tx->dirty_nfs[i]].dirty = 0;
+        }
+        tx->num_dirty_nfs = kept;
 }
 
+
+void
+onvm_pkt_flush_expired(struct thread_info *thread) {
+        struct packet_buf *buf;
+        uint16_t i, kept;
+        uint64_t now;
+
+        if (thread == NULL)
+                return;
+
+        if (thread->num_dirty_ports == 0 && thread->num_dirty_nfs == 0)
+                return;
+
+        now = rte_rdtsc();
+
+        /* Keep only the buffers that hold packets and still have time left */
+        for (i = 0, kept = 0; i < thread->num_dirty_ports; i++) {
+                buf = &thread->port_tx_buf[thread->dirty_ports[i]];
+                if (buf->count > 0 && now < buf->deadline) {
+                        thread->dirty_ports[kept++] = thread->dirty_ports[i];
+                        continue;
+                }
+                onvm_pkt_flush_port_queue(thread, thread->dirty_ports[i]);
+                buf->dirty = 0;
+        }
+        thread->num_dirty_ports = kept;
+
+        for (i = 0, kept = 0; i < thread->num_dirty_nfs; i++) {
+                buf = &thread->nf_rx_buf[thread->dirty_nfs[i]];
+                if (buf->count > 0 && now < buf->deadline) {
+                        thread->dirty_nfs[kept++] = thread->dirty_nfs[i];
+                        continue;
+                }
+                onvm_pkt_flush_nf_queue(thread, thread->dirty_nfs[i]);
+                if (buf->count > 0)
+                        thread->dirty_nfs[kept++] = thread->dirty_nfs[i];
+                else
+                        buf->dirty = 0;
+        }
+        thread->num_dirty_nfs = kept;
+}
+
+
 void
 onvm_pkt_drop_batch(struct rte_mbuf **pkts, uint16_t size) {
         uint16_t i;
@@ -248,7 +373,6 @@ onvm_pkt_drop_batch(struct rte_mbuf **pkts, uint16_t size) {
 static void
 onvm_pkt_flush_port_queue(struct thread_info *tx, uint16_t port) {
         uint16_t i, sent;
-        volatile struct tx_stats *tx_stats;
 
         if (tx == NULL)
                 return;
@@ -256,9 +380,10 @@ onvm_pkt_flush_port_queue(struct thread_info *tx, uint16_t port) {
         if (tx->port_tx_buf[port].count == 0)
                 return;
 
-        tx_stats = &(ports->tx_stats);
+        if (tx->e2e_hist != NULL)
+                onvm_pkt_record_e2e(tx->e2e_hist, tx->port_tx_buf[port].buffer, tx->port_tx_buf[port].count);
         sent = rte_eth_tx_burst(port,
-                                tx->queue_id,
+                                tx->tx_queue_id,
                                 tx->port_tx_buf[port].buffer,
                                 tx->port_tx_buf[port].count);
         RTE_LOG(DEBUG, APP, "Port %u flushing %u packets (%u in queue)\n", port, sent, tx->port_tx_buf[port].count);
@@ -266,9 +391,9 @@ onvm_pkt_flush_port_queue(struct thread_info *tx, uint16_t port) {
                 for (i = sent; i < tx->port_tx_buf[port].count; i++) {
                         onvm_pkt_drop(tx->port_tx_buf[port].buffer[i]);
                 }
-                tx_stats->tx_drop[port] += (tx->port_tx_buf[port].count - sent);
+                tx->stats->port_tx_drop[port] += (tx->port_tx_buf[port].count - sent);
         }
-        tx_stats->tx[port] += sent;
+        tx->stats->port_tx[port] += sent;
 
         tx->port_tx_buf[port].count = 0;
 }
@@ -276,8 +401,9 @@ onvm_pkt_flush_port_queue(struct thread_info *tx, uint16_t port) {
 
 static void
 onvm_pkt_flush_nf_queue(struct thread_info *thread, uint16_t client) {
-        uint16_t i;
+        uint16_t i, sent;
         struct client *cl;
+        struct packet_buf *buf;
 
         if (thread == NULL)
                 return;
@@ -287,20 +413,37 @@ onvm_pkt_flush_nf_queue(struct thread_info *thread, uint16_t client) {
 
         cl = &clients[client];
 
-        // Ensure destination NF is running and ready to receive packets
-        if (!onvm_nf_is_valid(cl))
-                return;
-
-        if (rte_ring_enqueue_bulk(cl->rx_q, (void **)thread->nf_rx_buf[client].buffer,
-                        thread->nf_rx_buf[client].count) != 0) {
+        // Ensure destination NF is running and ready to receive packets,
+        // it may have stopped since they were buffered
+        if (!onvm_nf_is_valid(cl)) {
                 for (i = 0; i < thread->nf_rx_buf[client].count; i++) {
                         onvm_pkt_drop(thread->nf_rx_buf[client].buffer[i]);
                 }
-                cl->stats.rx_drop += thread->nf_rx_buf[client].count;
-        } else {
-                cl->stats.rx += thread->nf_rx_buf[client].count;
+                thread->nf_rx_buf[client].count = 0;
+                return;
+        }
+
+        buf = &thread->nf_rx_buf[client];
+        sent = rte_ring_enqueue_burst(cl->rx_q, (void **)buf->buffer, buf->count);
+        thread->stats->nf[client].rx += sent;
+        if (unlikely(sent < buf->count)) {
+                /* The NF is backed up, hold the rest for the next flush */
+                memmove(buf->buffer, buf->buffer + sent, (buf->count - sent) * sizeof(buf->buffer[0]));
+        }
+        buf->count -= sent;
+}
+
+
+static inline void
+onvm_pkt_mark_dirty(struct packet_buf *buf, uint16_t *dirty, uint16_t *num_dirty, uint16_t index) {
+        if (buf->count > 0)
+                return;
+
+        buf->deadline = rte_rdtsc() + flush_latency_cycles;
+        if (!buf->dirty) {
+                buf->dirty = 1;
+                dirty[(*num_dirty)++] = index;
         }
-        thread->nf_rx_buf[client].count = 0;
 }
 
 
@@ -310,9 +453,9 @@ onvm_pkt_enqueue_port(struct thread_info *tx, uint16_t port, struct rte_mbuf *bu
         if (tx == NULL || buf == NULL)
                 return;
 
-
+        onvm_pkt_mark_dirty(&tx->port_tx_buf[port], tx->dirty_ports, &tx->num_dirty_ports, port);
         tx->port_tx_buf[port].buffer[tx->port_tx_buf[port].count++] = buf;
-        if (tx->port_tx_buf[port].count == PACKET_READ_SIZE) {
+        if (tx->port_tx_buf[port].count >= batch_size) {
                 onvm_pkt_flush_port_queue(tx, port);
         }
 }
@@ -323,9 +466,7 @@ onvm_pkt_enqueue_nf(struct thread_info *thread, uint16_t dst_service_id, struct
         struct client *cl;
         uint16_t dst_instance_id;
         int64_t remote_id;
-        uint16_t nic_port;
-        struct ether_addr src_addr;
-        struct ether_addr dst_addr;
+        const struct onvm_vxlan_hdr *tunnel_hdr;
 
         if (thread == NULL || pkt == NULL)
                 return;
@@ -333,15 +474,11 @@ onvm_pkt_enqueue_nf(struct thread_info *thread, uint16_t dst_service_id, struct
         // map service to instance and check one exists
         dst_instance_id = onvm_nf_service_to_nf_map(dst_service_id, pkt);
         if (dst_instance_id == 0) {
-                remote_id = onvm_zk_lookup_service(pkt, dst_service_id, &dst_addr);
-                if (remote_id != 0) {
-                        // Send this packet to a remote instance
-                        // Default to port 0 for now
-                        nic_port = 0;
-                        rte_eth_macaddr_get(nic_port, &src_addr);
-                        onvm_encapsulate_pkt(pkt, &src_addr, &dst_addr);
-
-                        onvm_pkt_enqueue_port(thread, nic_port, pkt);
+                remote_id = onvm_zk_lookup_service(thread->remote_flows, pkt, dst_service_id, &tunnel_hdr);
+                if (remote_id != 0 && onvm_encapsulate_pkt(pkt, tunnel_hdr) == 0) {
+                        // Send this packet to a remote instance, out of the
+                        // port other managers know our address for
+                        onvm_pkt_enqueue_port(thread, ports->id[0], pkt);
                 } else {
                         // Nothing to do with this packet, just drop it
                         onvm_pkt_drop(pkt);
@@ -356,8 +493,21 @@ onvm_pkt_enqueue_nf(struct thread_info *thread, uint16_t dst_service_id, struct
                 return;
         }
 
+        thread->last_nf = dst_instance_id;
+        if (unlikely(thread->nf_rx_buf[dst_instance_id].count == PACKET_BUF_SIZE)) {
+                /* Stash is full, only drop if the NF still can't take any */
+                onvm_pkt_flush_nf_queue(thread, dst_instance_id);
+                if (thread->nf_rx_buf[dst_instance_id].count == PACKET_BUF_SIZE) {
+                        onvm_pkt_drop(pkt);
+                        thread->stats->nf[dst_instance_id].rx_drop++;
+                        return;
+                }
+        }
+
+        onvm_pkt_mark_dirty(&thread->nf_rx_buf[dst_instance_id], thread->dirty_nfs,
+                            &thread->num_dirty_nfs, dst_instance_id);
         thread->nf_rx_buf[dst_instance_id].buffer[thread->nf_rx_buf[dst_instance_id].count++] = pkt;
-        if (thread->nf_rx_buf[dst_instance_id].count == PACKET_READ_SIZE) {
+        if (thread->nf_rx_buf[dst_instance_id].count >= batch_size) {
                 onvm_pkt_flush_nf_queue(thread, dst_instance_id);
         }
 }
@@ -374,28 +524,30 @@ onvm_pkt_process_next_action(struct thread_info *tx, struct rte_mbuf *pkt, struc
         struct onvm_pkt_meta *meta = onvm_get_pkt_meta(pkt);
         int ret;
 
+        sc = NULL;
         ret = onvm_flow_dir_get_pkt(pkt, &flow_entry);
         if (ret >= 0) {
+                onvm_flow_expire_touch(flow_entry);
                 sc = flow_entry->sc;
-                meta->action = onvm_sc_next_action(sc, pkt);
-                meta->destination = onvm_sc_next_destination(sc, pkt);
-        } else {
-                meta->action = onvm_sc_next_action(default_chain, pkt);
-                meta->destination = onvm_sc_next_destination(default_chain, pkt);
         }
+        /* No entry, or one that is still being installed */
+        if (sc == NULL)
+                sc = default_chain;
+        meta->action = onvm_sc_next_action(sc, pkt);
+        meta->destination = onvm_sc_next_destination(sc, pkt);
 
         switch (meta->action) {
                 case ONVM_NF_ACTION_DROP:
                         // if the packet is drop, then <return value> is 0
                         // and !<return value> is 1.
-                        cl->stats.act_drop += !onvm_pkt_drop(pkt);
+                        tx->stats->nf[cl->instance_id].act_drop += !onvm_pkt_drop(pkt);
                         break;
                 case ONVM_NF_ACTION_TONF:
-                        cl->stats.act_tonf++;
+                        tx->stats->nf[cl->instance_id].act_tonf++;
                         onvm_pkt_enqueue_nf(tx, meta->destination, pkt);
                         break;
                 case ONVM_NF_ACTION_OUT:
-                        cl->stats.act_out++;
+                        tx->stats->nf[cl->instance_id].act_out++;
                         onvm_pkt_enqueue_port(tx, meta->destination, pkt);
                         break;
                 default:
@@ -408,6 +560,19 @@ onvm_pkt_process_next_action(struct thread_info *tx, struct rte_mbuf *pkt, struc
 /*******************************Helper function*******************************/
 
 
+static void
+onvm_pkt_record_e2e(struct onvm_hist *hist, struct rte_mbuf *pkts[], uint16_t count) {
+        uint64_t now = rte_rdtsc();
+        uint16_t i, src;
+
+        for (i = 0; i < count; i++) {
+                src = onvm_get_pkt_meta(pkts[i])->src;
+                if (likely(src < MAX_CLIENTS))
+                        onvm_hist_record(&hist[src], now - onvm_get_pkt_priv(pkts[i])->rx_tsc);
+        }
+}
+
+
 static int
 onvm_pkt_drop(struct rte_mbuf *pkt) {
         rte_pktmbuf_free(pkt);
@@ -58,11 +58,12 @@
 
 
 /*
- * Interface to process packets in a given RX queue.
+ * Interface to process packets in a given RX queue. The whole batch is
+ * decapsulated, then its flows are looked up together.
  *
  * Inputs : a pointer to the rx queue
  *          an array of packets
- *          the size of the array
+ *          the size of the array, at most PACKET_READ_SIZE
  *
  */
 void
@@ -83,7 +84,22 @@ onvm_pkt_process_tx_batch(struct thread_info *tx, struct rte_mbuf *pkts[], uint1
 
 
 /*
- * Interface to send packets to all ports after processing them.
+ * Interface telling a TX thread to leave an NF's packets in its TX ring,
+ * because the NF it last sent packets to through this thread is backed
+ * up. The packets then queue up in the upstream NF instead of being
+ * dropped in the middle of the chain.
+ *
+ * Inputs : a pointer to the tx queue
+ *          the instance id of the NF to read from
+ * Output : 1 if the NF should be skipped this pass, 0 otherwise
+ *
+ */
+int
+onvm_pkt_nf_blocked(struct thread_info *tx, uint16_t instance_id);
+
+
+/*
+ * Interface to send the packets buffered for every port.
  *
  * Input : a pointer to the tx queue
  *
@@ -93,7 +109,7 @@ onvm_pkt_flush_all_ports(struct thread_info *tx);
 
 
 /*
- * Interface to send packets to all NFs after processing them.
+ * Interface to send the packets buffered for every NF.
  *
  * Input : a pointer to the tx queue
  *
@@ -102,6 +118,18 @@ void
 onvm_pkt_flush_all_nfs(struct thread_info *tx);
 
 
+/*
+ * Interface to send the buffered packets that have waited their maximum
+ * latency (see -u). Full buffers are already sent as they fill up, so
+ * this is called once per loop pass of the RX and TX threads.
+ *
+ * Input : a pointer to the thread's state
+ *
+ */
+void
+onvm_pkt_flush_expired(struct thread_info *thread);
+
+
 /*
  * Interface to drop a batch of packets.
  *
@@ -0,0 +1,285 @@
+/*********************************************************************
+ *                     openNetVM
+ *              https://sdnfv.github.io
+ *
+ *   BSD LICENSE
+ *
+ *   Copyright(c)
+ *            2015-2016 George Washington University
+ *            2015-2016 University of California Riverside
+ *            2010-2014 Intel Corporation. All rights reserved.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ********************************************************************/
+
+
+/******************************************************************************
+
+                              onvm_sched.c
+
+       This file assigns running NFs to the manager's TX threads.
+
+******************************************************************************/
+
+#include <rte_log.h>
+
+#include "onvm_mgr.h"
+#include "onvm_nf.h"
+#include "onvm_sched.h"
+
+#define NO_THREAD UINT16_MAX
+
+
+/*
+ * A TX thread and its two NF lists: the one it is reading and a spare the
+ * master fills in before swapping them.
+ */
+struct tx_sched_thread {
+        struct thread_info *info;
+        struct tx_nf_list lists[2];
+        uint8_t cur;
+};
+
+static struct tx_sched_thread *sched_threads;
+static unsigned sched_count;
+
+/* Number of threads that currently have at least one NF */
+static unsigned sched_active;
+
+/* TX thread serving each NF, NO_THREAD if none */
+static uint16_t nf_thread[MAX_CLIENTS];
+
+/* Last TX count and resulting rate of each NF */
+static uint64_t nf_tx_last[MAX_CLIENTS];
+static uint64_t nf_rate[MAX_CLIENTS];
+
+
+/************************Internal functions prototypes************************/
+
+
+/*
+ * Function ordering NF instance ids by decreasing TX rate, for qsort.
+ */
+static int
+onvm_sched_compare_rate(const void *a, const void *b);
+
+
+/*
+ * Function giving the number of TX threads needed for a total TX rate.
+ * The thread count grows as soon as the rate calls for it, but only
+ * shrinks once the rate fits well within the fewer threads.
+ *
+ * Input  : the total rate of all NFs, and the number of NFs
+ * Output : the number of threads to spread the NFs over
+ *
+ */
+static unsigned
+onvm_sched_threads_needed(uint64_t total, unsigned nfs);
+
+
+/*
+ * Function handing every TX thread its new list of NFs. NFs that move are
+ * first removed from their old thread, and only added to the new one once
+ * the old thread has been quiescent, so two threads never dequeue from
+ * the same NF's ring.
+ *
+ * Input  : the running NFs, how many there are, and the thread
+ *          assigned to each NF by instance id
+ *
+ */
+static void
+onvm_sched_publish(const uint16_t *ids, unsigned nfs, const uint16_t *assign);
+
+
+/********************************Interfaces***********************************/
+
+
+int
+onvm_sched_init(struct thread_info **tx_threads, unsigned count) {
+        unsigned i;
+
+        sched_threads = calloc(count, sizeof(struct tx_sched_thread));
+        if (sched_threads == NULL)
+                return -1;
+
+        for (i = 0; i < count; i++) {
+                sched_threads[i].info = tx_threads[i];
+                tx_threads[i]->nfs = &sched_threads[i].lists[0];
+        }
+        for (i = 0; i < MAX_CLIENTS; i++)
+                nf_thread[i] = NO_THREAD;
+
+        sched_count = count;
+        sched_active = 0;
+
+        return 0;
+}
+
+
+void
+onvm_sched_balance(unsigned difftime) {
+        uint16_t ids[MAX_CLIENTS], assign[MAX_CLIENTS];
+        uint64_t cur_load[RTE_MAX_LCORE] = {0}, new_load[RTE_MAX_LCORE] = {0};
+        uint64_t tx, total = 0, cur_max = 0, new_max = 0;
+        unsigned i, t, best, nfs = 0, threads;
+        uint8_t changed = 0;
+
+        if (sched_count == 0 || difftime == 0)
+                return;
+
+        for (i = 0; i < MAX_CLIENTS; i++) {
+                tx = clients_stats[i].tx;
+                nf_rate[i] = (tx - nf_tx_last[i]) / difftime;
+                nf_tx_last[i] = tx;
+                assign[i] = NO_THREAD;
+
+                if (!onvm_nf_is_valid(&clients[i])) {
+                        /* A stopped NF has to leave its thread */
+                        if (nf_thread[i] != NO_THREAD)
+                                changed = 1;
+                        continue;
+                }
+
+                /* Idle NFs still need polling, so count them as some load */
+                nf_rate[i] = RTE_MAX(nf_rate[i], (uint64_t)1);
+                ids[nfs++] = i;
+                total += nf_rate[i];
+                if (nf_thread[i] == NO_THREAD)
+                        changed = 1;
+                else
+                        cur_load[nf_thread[i]] += nf_rate[i];
+        }
+
+        threads = onvm_sched_threads_needed(total, nfs);
+        if (threads != sched_active)
+                changed = 1;
+
+        /* Longest processing time first: busiest NF to least loaded thread */
+        qsort(ids, nfs, sizeof(ids[0]), onvm_sched_compare_rate);
+        for (i = 0; i < nfs; i++) {
+                best = 0;
+                for (t = 1; t < threads; t++) {
+                        if (new_load[t] < new_load[best])
+                                best = t;
+                }
+                assign[ids[i]] = best;
+                new_load[best] += nf_rate[ids[i]];
+        }
+
+        for (t = 0; t < sched_count; t++) {
+                cur_max = RTE_MAX(cur_max, cur_load[t]);
+                new_max = RTE_MAX(new_max, new_load[t]);
+        }
+
+        /* Moving an NF costs a quiescent period, so only do it for a real gain */
+        if (!changed && cur_max <= new_max * TX_SCHED_IMBALANCE)
+                return;
+
+        onvm_sched_publish(ids, nfs, assign);
+        sched_active = threads;
+
+        RTE_LOG(INFO, APP, "Assigned %u NFs to %u of %u TX threads (%" PRIu64 " pps total)\n",
+                nfs, threads, sched_count, total);
+}
+
+
+/*****************************Internal functions******************************/
+
+
+static int
+onvm_sched_compare_rate(const void *a, const void *b) {
+        const uint64_t rate_a = nf_rate[*(const uint16_t *)a];
+        const uint64_t rate_b = nf_rate[*(const uint16_t *)b];
+
+        if (rate_a == rate_b)
+                return 0;
+        return rate_a > rate_b ? -1 : 1;
+}
+
+
+static unsigned
+onvm_sched_threads_needed(uint64_t total, unsigned nfs) {
+        unsigned needed;
+
+        if (nfs == 0)
+                return 0;
+
+        needed = total / TX_SCHED_THREAD_PPS + 1;
+        if (needed < sched_active &&
+            total > (uint64_t)(sched_active - 1) * TX_SCHED_THREAD_PPS * 3 / 4)
+                needed = sched_active;
+
+        return RTE_MIN(needed, RTE_MIN(sched_count, nfs));
+}
+
+
+static void
+onvm_sched_publish(const uint16_t *ids, unsigned nfs, const uint16_t *assign) {
+        struct tx_sched_thread *st;
+        struct tx_nf_list *list;
+        const struct tx_nf_list *cur;
+        unsigned i, t;
+
+        /* First only keep the NFs that stay, in the spare list */
+        for (t = 0; t < sched_count; t++) {
+                st = &sched_threads[t];
+                cur = &st->lists[st->cur];
+                list = &st->lists[!st->cur];
+
+                list->count = 0;
+                for (i = 0; i < cur->count; i++) {
+                        if (assign[cur->id[i]] == t)
+                                list->id[list->count++] = cur->id[i];
+                }
+
+                rte_smp_wmb();
+                st->info->nfs = list;
+        }
+        onvm_qsbr_synchronize(mgr_qsbr);
+
+        /* No thread reads the old lists now, so fill them in completely */
+        for (t = 0; t < sched_count; t++) {
+                st = &sched_threads[t];
+                list = &st->lists[st->cur];
+
+                list->count = 0;
+                for (i = 0; i < nfs; i++) {
+                        if (assign[ids[i]] == t)
+                                list->id[list->count++] = ids[i];
+                }
+
+                rte_smp_wmb();
+                st->info->nfs = list;
+        }
+        /* Leave the spare lists free for the next call */
+        onvm_qsbr_synchronize(mgr_qsbr);
+
+        for (i = 0; i < MAX_CLIENTS; i++)
+                nf_thread[i] = assign[i];
+}
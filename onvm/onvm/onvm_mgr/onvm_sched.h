@@ -0,0 +1,99 @@
+/*********************************************************************
+ *                     openNetVM
+ *              https://sdnfv.github.io
+ *
+ *   BSD LICENSE
+ *
+ *   Copyright(c)
+ *            2015-2016 George Washington University
+ *            2015-2016 University of California Riverside
+ *            2010-2014 Intel Corporation. All rights reserved.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ********************************************************************/
+
+
+/******************************************************************************
+
+                                 onvm_sched.h
+
+
+      Header file for the assignment of running NFs to manager TX threads
+
+
+******************************************************************************/
+
+
+#ifndef _ONVM_SCHED_H_
+#define _ONVM_SCHED_H_
+
+#include "onvm_mgr.h"
+
+
+/***********************************Macros************************************/
+
+
+/* Packets per second one TX thread is expected to keep up with */
+#define TX_SCHED_THREAD_PPS 4000000
+/* Only move NFs if it lowers the busiest thread's load by this factor */
+#define TX_SCHED_IMBALANCE 1.25
+/* How long a TX thread with no NFs sleeps between checks */
+#define TX_SCHED_PARK_US 500
+
+
+/*********************************Interfaces**********************************/
+
+
+/*
+ * Interface registering the TX threads NFs are spread over. Every thread
+ * starts with an empty list, so it is parked until an NF is assigned.
+ *
+ * Input  : the TX threads' state, and how many there are
+ * Output : 0 on success, -1 if the lists can't be allocated
+ *
+ */
+int
+onvm_sched_init(struct thread_info **tx_threads, unsigned count);
+
+
+/*
+ * Interface reassigning running NFs to TX threads from their measured TX
+ * rates. Uses as few threads as can keep up with the total rate, placing
+ * the busiest NFs first on the least loaded thread. New and stopped NFs
+ * are always picked up; otherwise NFs only move if the load becomes
+ * noticeably more even. Called from the master thread only.
+ *
+ * Input  : the time since the last call, in seconds
+ *
+ */
+void
+onvm_sched_balance(unsigned difftime);
+
+
+#endif  // _ONVM_SCHED_H_
@@ -50,9 +50,13 @@
 #include <unistd.h>
 #include <time.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "onvm_mgr.h"
 #include "onvm_stats.h"
+#include "onvm_stats_shm.h"
 #include "onvm_nf.h"
 #include "onvm_zookeeper.h"
 
@@ -77,6 +81,25 @@ static void
 onvm_stats_display_clients(unsigned difftime);
 
 
+/*
+ * Function writing the current totals to the shared stats segment.
+ *
+ */
+static void
+onvm_stats_shm_update(void);
+
+
+/*
+ * Function displaying the latency percentiles of one client since the last
+ * display, and adding them to its JSON object.
+ *
+ * Input : the client id
+ *
+ */
+static void
+onvm_stats_display_client_latency(uint16_t id);
+
+
 /*
  * Function clearing the terminal and moving back the cursor to the top left.
  *
@@ -118,6 +141,25 @@ onvm_json_reset_objects(void);
 static FILE *stats_out = NULL;
 static FILE *json_stats_out = NULL;
 
+/*********************Manager Threads*****************************************/
+
+/* Every RX and TX thread, whose counters and histograms are added up here */
+static struct thread_info *mgr_threads[RTE_MAX_LCORE];
+static unsigned num_mgr_threads = 0;
+
+/* Thread counters of each client when it was last cleared */
+static struct thread_nf_stats client_stats_base[MAX_CLIENTS];
+
+/*********************Shared Stats Segment************************************/
+
+/* mmapped ONVM_STATS_SHM_NAME, or private memory if it could not be
+ * created, so the history is still kept */
+static struct onvm_stats_shm *stats_shm = NULL;
+static uint8_t stats_shm_shared = 0;
+
+/* Sample being filled by the current display, added to the history after */
+static struct onvm_stats_shm_sample cur_sample;
+
 /****************************Interfaces***************************************/
 
 void
@@ -152,12 +194,90 @@ onvm_stats_set_output(ONVM_STATS_OUTPUT output) {
                 onvm_json_nf_stats_arr = NULL;
 }
 
+void
+onvm_stats_add_thread(struct thread_info *thread) {
+        if (num_mgr_threads < RTE_MAX_LCORE)
+                mgr_threads[num_mgr_threads++] = thread;
+}
+
+int
+onvm_stats_shm_init(void) {
+        int fd;
+        void *addr;
+
+        RTE_BUILD_BUG_ON(ONVM_STATS_SHM_MAX_PORTS != RTE_MAX_ETHPORTS);
+        RTE_BUILD_BUG_ON(ONVM_STATS_SHM_MAX_NFS != MAX_CLIENTS);
+        RTE_BUILD_BUG_ON(ONVM_STATS_SHM_MAX_SERVICES != MAX_SERVICES);
+
+        addr = MAP_FAILED;
+        fd = shm_open(ONVM_STATS_SHM_NAME, O_CREAT | O_RDWR | O_TRUNC, 0644);
+        if (fd >= 0) {
+                if (ftruncate(fd, sizeof(*stats_shm)) == 0)
+                        addr = mmap(NULL, sizeof(*stats_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                close(fd);
+                if (addr == MAP_FAILED)
+                        shm_unlink(ONVM_STATS_SHM_NAME);
+        }
+
+        if (addr != MAP_FAILED) {
+                stats_shm_shared = 1;
+        } else {
+                addr = rte_zmalloc("stats history", sizeof(*stats_shm), 0);
+                if (addr == NULL)
+                        return -1;
+        }
+
+        stats_shm = addr;
+        stats_shm->magic = ONVM_STATS_SHM_MAGIC;
+        stats_shm->version = ONVM_STATS_SHM_VERSION;
+        stats_shm->size = sizeof(*stats_shm);
+        stats_shm->tsc_hz = rte_get_tsc_hz();
+        return stats_shm_shared ? 0 : -1;
+}
+
+const struct onvm_stats_shm_sample *
+onvm_stats_history(unsigned age) {
+        uint64_t count;
+
+        if (stats_shm == NULL)
+                return NULL;
+
+        count = stats_shm->history_count;
+        if (age >= count || age >= ONVM_STATS_SHM_HISTORY)
+                return NULL;
+        return &stats_shm->history[(count - 1 - age) % ONVM_STATS_SHM_HISTORY];
+}
+
+double
+onvm_stats_history_rx_use(uint16_t id, unsigned samples) {
+        const struct onvm_stats_shm_sample *sample;
+        double total = 0;
+        unsigned age, count = 0;
+
+        for (age = 0; age < samples && (sample = onvm_stats_history(age)) != NULL; age++) {
+                if (!sample->nf[id].valid)
+                        break;
+                total += sample->nf[id].rx_ring_use;
+                count++;
+        }
+
+        return count == 0 ? -1 : total / count;
+}
+
 void
 onvm_stats_cleanup(void) {
         if (stats_destination == ONVM_STATS_WEB) {
                 fclose(stats_out);
                 fclose(json_stats_out);
         }
+
+        if (stats_shm != NULL && stats_shm_shared) {
+                munmap(stats_shm, sizeof(*stats_shm));
+                shm_unlink(ONVM_STATS_SHM_NAME);
+        } else if (stats_shm != NULL) {
+                rte_free(stats_shm);
+        }
+        stats_shm = NULL;
 }
 
 void
@@ -168,10 +288,14 @@ onvm_stats_display_all(unsigned difftime) {
 
         onvm_stats_truncate();
         onvm_json_reset_objects();
+        memset(&cur_sample, 0, sizeof(cur_sample));
 
         onvm_stats_display_ports(difftime);
         onvm_stats_display_clients(difftime);
 
+        if (stats_shm != NULL)
+                onvm_stats_shm_update();
+
         if (json_stats_out) {
                 fprintf(json_stats_out, "%s\n", cJSON_Print(onvm_json_root));
         }
@@ -184,18 +308,48 @@ void
 onvm_stats_clear_all_clients(void) {
         unsigned i;
 
+        for (i = 0; i < MAX_CLIENTS; i++)
+                onvm_stats_sum_client(i, &client_stats_base[i]);
+}
+
+void
+onvm_stats_clear_client(uint16_t id) {
+        onvm_stats_sum_client(id, &client_stats_base[id]);
+}
+
+
+void
+onvm_stats_sum_port(uint8_t port, uint64_t *rx, uint64_t *tx, uint64_t *tx_drop) {
+        unsigned i;
+
+        *rx = *tx = *tx_drop = 0;
+        for (i = 0; i < num_mgr_threads; i++) {
+                *rx += mgr_threads[i]->stats->port_rx[port];
+                *tx += mgr_threads[i]->stats->port_tx[port];
+                *tx_drop += mgr_threads[i]->stats->port_tx_drop[port];
+        }
         for (i = 0; i < MAX_CLIENTS; i++) {
-                clients[i].stats.rx = clients[i].stats.rx_drop = 0;
-                clients[i].stats.act_drop = clients[i].stats.act_tonf = 0;
-                clients[i].stats.act_next = clients[i].stats.act_out = 0;
+                *tx += clients_stats[i].port_tx[port];
+                *tx_drop += clients_stats[i].port_tx_drop[port];
         }
 }
 
+
 void
-onvm_stats_clear_client(uint16_t id) {
-        clients[id].stats.rx = clients[id].stats.rx_drop = 0;
-        clients[id].stats.act_drop = clients[id].stats.act_tonf = 0;
-        clients[id].stats.act_next = clients[id].stats.act_out = 0;
+onvm_stats_sum_client(uint16_t id, struct thread_nf_stats *sum) {
+        const struct thread_nf_stats *nf;
+        unsigned i;
+
+        memset(sum, 0, sizeof(*sum));
+        for (i = 0; i < num_mgr_threads; i++) {
+                nf = &mgr_threads[i]->stats->nf[id];
+                sum->rx += nf->rx;
+                sum->rx_drop += nf->rx_drop;
+                sum->act_out += nf->act_out;
+                sum->act_tonf += nf->act_tonf;
+                sum->act_drop += nf->act_drop;
+                sum->act_next += nf->act_next;
+        }
 }
 
 
@@ -207,12 +361,15 @@ onvm_stats_display_ports(unsigned difftime) {
         unsigned i = 0;
         uint64_t nic_rx_pkts = 0;
         uint64_t nic_tx_pkts = 0;
+        uint64_t nic_tx_drop = 0;
         uint64_t nic_rx_pps = 0;
         uint64_t nic_tx_pps = 0;
         char* port_label = NULL;
         /* Arrays to store last TX/RX count to calculate rate */
         static uint64_t tx_last[RTE_MAX_ETHPORTS];
         static uint64_t rx_last[RTE_MAX_ETHPORTS];
+        static uint64_t tx_drop_last[RTE_MAX_ETHPORTS];
+        uint32_t flows, size;
 
         ONVM_SAFE_FPRINTF(stats_out, "PORTS\n");
         ONVM_SAFE_FPRINTF(stats_out, "-----\n");
@@ -221,12 +378,15 @@ onvm_stats_display_ports(unsigned difftime) {
                                     onvm_stats_print_MAC(ports->id[i]));
         ONVM_SAFE_FPRINTF(stats_out, "\n\n");
         for (i = 0; i < ports->num_ports; i++) {
-                nic_rx_pkts = ports->rx_stats.rx[ports->id[i]];
-                nic_tx_pkts = ports->tx_stats.tx[ports->id[i]];
+                onvm_stats_sum_port(ports->id[i], &nic_rx_pkts, &nic_tx_pkts, &nic_tx_drop);
 
                 nic_rx_pps = (nic_rx_pkts - rx_last[i]) / difftime;
                 nic_tx_pps = (nic_tx_pkts - tx_last[i]) / difftime;
 
+                cur_sample.port[ports->id[i]].rx_pps = nic_rx_pps;
+                cur_sample.port[ports->id[i]].tx_pps = nic_tx_pps;
+                cur_sample.port[ports->id[i]].tx_drop_pps = (nic_tx_drop - tx_drop_last[i]) / difftime;
+
                 ONVM_SAFE_FPRINTF(stats_out, ONVM_CONSOLE_PORT_STATS_FMT,
                                 (unsigned)ports->id[i],
                                 nic_rx_pkts,
@@ -250,7 +410,14 @@ onvm_stats_display_ports(unsigned difftime) {
 
                 rx_last[i] = nic_rx_pkts;
                 tx_last[i] = nic_tx_pkts;
+                tx_drop_last[i] = nic_tx_drop;
         }
+
+        size = onvm_flow_dir_size();
+        flows = sdn_ft_info->flows;
+        ONVM_SAFE_FPRINTF(stats_out, "\n" ONVM_CONSOLE_FLOW_TABLE_FMT, flows, size,
+                          (uint64_t)flows * 100 / size, onvm_flow_dir_num_shards(),
+                          sdn_ft_info->resizes, sdn_ft_info->add_fails, sdn_ft_info->rules);
 }
 
 
@@ -262,30 +429,48 @@ onvm_stats_display_clients(unsigned difftime) {
         static uint64_t call_count = 0;
         static uint64_t nf_tx_last[MAX_CLIENTS];
         static uint64_t nf_rx_last[MAX_CLIENTS];
+        static uint64_t nf_rx_drop_last[MAX_CLIENTS];
+        static uint64_t nf_tx_drop_last[MAX_CLIENTS];
+        struct onvm_stats_shm_nf_sample *sample;
+        struct thread_nf_stats sum;
+        double rx_use_trend;
+        /* Only push stats to ZooKeeper every few calls */
+        const uint8_t zk_update = is_distributed == DISTRIBUTED && call_count++ % ZK_STAT_UPDATE_FREQ == 0;
 
         ONVM_SAFE_FPRINTF(stats_out, "\nCLIENTS\n");
         ONVM_SAFE_FPRINTF(stats_out, "-------\n");
         for (i = 0; i < MAX_CLIENTS; i++) {
                 if (!onvm_nf_is_valid(&clients[i]))
                         continue;
-                const uint64_t rx = clients[i].stats.rx;
-                const uint64_t rx_drop = clients[i].stats.rx_drop;
-                const uint64_t tx = clients_stats->tx[i];
-                const uint64_t tx_drop = clients_stats->tx_drop[i];
-                const uint64_t act_drop = clients[i].stats.act_drop;
-                const uint64_t act_next = clients[i].stats.act_next;
-                const uint64_t act_out = clients[i].stats.act_out;
-                const uint64_t act_tonf = clients[i].stats.act_tonf;
-                const uint64_t act_buffer = clients_stats->tx_buffer[i];
-                const uint64_t act_returned = clients_stats->tx_returned[i];
+                onvm_stats_sum_client(i, &sum);
+                const uint64_t rx = sum.rx - client_stats_base[i].rx;
+                const uint64_t rx_drop = sum.rx_drop - client_stats_base[i].rx_drop;
+                const uint64_t tx = clients_stats[i].tx;
+                const uint64_t tx_drop = clients_stats[i].tx_drop;
+                const uint64_t act_drop = sum.act_drop - client_stats_base[i].act_drop;
+                const uint64_t act_next = sum.act_next - client_stats_base[i].act_next;
+                const uint64_t act_out = sum.act_out - client_stats_base[i].act_out;
+                const uint64_t act_tonf = sum.act_tonf - client_stats_base[i].act_tonf;
+                const uint64_t act_buffer = clients_stats[i].tx_buffer;
+                const uint64_t act_returned = clients_stats[i].tx_returned;
+                const uint64_t tx_direct = clients_stats[i].tx_direct;
                 const uint64_t rx_pps = (rx - nf_rx_last[i])/difftime;
                 const uint64_t tx_pps = (tx - nf_tx_last[i])/difftime;
                 const float rx_ring_usage = rte_ring_count(clients[i].rx_q) / (float)CLIENT_QUEUE_RINGSIZE;
 
+                sample = &cur_sample.nf[i];
+                sample->valid = 1;
+                sample->service_id = clients[i].info->service_id;
+                sample->rx_pps = rx_pps;
+                sample->tx_pps = tx_pps;
+                sample->rx_drop_pps = (rx_drop - nf_rx_drop_last[i]) / difftime;
+                sample->tx_drop_pps = (tx_drop - nf_tx_drop_last[i]) / difftime;
+                sample->rx_ring_use = rx_ring_usage;
+
                 ONVM_SAFE_FPRINTF(stats_out, ONVM_CONSOLE_NF_STATS_FMT,
                                 clients[i].info->instance_id,
                                 rx, rx_drop, act_next, act_drop, act_returned,
-                                tx, tx_drop, act_out, act_tonf, act_buffer);
+                                tx, tx_drop, act_out, act_tonf, act_buffer, tx_direct);
 
                 /* Only print this information out if we haven't already printed it to the console above */
                 ONVM_SNPRINTF(nf_label, 6, "NF %d", i);
@@ -304,9 +489,17 @@ onvm_stats_display_clients(unsigned difftime) {
                 cJSON_AddNumberToObject(onvm_json_nf_stats[i],
                                         "Free Cores", clients[i].info->headroom);
 
-                if (is_distributed == DISTRIBUTED && call_count++ % ZK_STAT_UPDATE_FREQ == 0) {
-                        /* Update this NF's stats in ZooKeeper if needed */
-                        if (onvm_zk_update_nf_stats(clients[i].info->service_id, i, onvm_json_nf_stats[i]) != ZOK) {
+                if (latency_info->enabled)
+                        onvm_stats_display_client_latency(i);
+
+                if (zk_update) {
+                        /* Queue this NF's stats for ZooKeeper, scaling on
+                         * the RX ring use since the last update rather than
+                         * on whatever it happens to be right now */
+                        rx_use_trend = onvm_stats_history_rx_use(i, ZK_STAT_UPDATE_FREQ);
+                        if (rx_use_trend < 0)
+                                rx_use_trend = rx_ring_usage;
+                        if (onvm_zk_update_nf_stats(clients[i].info->service_id, i, rx_use_trend, clients[i].info->headroom) != ZOK) {
                                 RTE_LOG(INFO, APP, "ERROR updating ZK stats\n");
                         }
                 }
@@ -314,14 +507,141 @@ onvm_stats_display_clients(unsigned difftime) {
                 free(nf_label);
                 nf_label = NULL;
 
-                nf_rx_last[i] = clients[i].stats.rx;
-                nf_tx_last[i] = clients_stats->tx[i];
+                nf_rx_last[i] = rx;
+                nf_tx_last[i] = tx;
+                nf_rx_drop_last[i] = rx_drop;
+                nf_tx_drop_last[i] = tx_drop;
+        }
+
+        /* Send every NF's stats to ZooKeeper at once */
+        if (zk_update && onvm_zk_publish_nf_stats() != ZOK) {
+                RTE_LOG(INFO, APP, "ERROR publishing ZK stats\n");
         }
 
         ONVM_SAFE_FPRINTF(stats_out, "\n");
 }
 
 
+static void
+onvm_stats_shm_update(void) {
+        struct onvm_stats_shm_port *port;
+        struct onvm_stats_shm_nf *nf;
+        struct onvm_stats_shm_service *service;
+        struct thread_nf_stats sum;
+        struct timespec now;
+        unsigned i;
+
+        /* Odd while writing, see struct onvm_stats_shm */
+        stats_shm->seq++;
+        rte_smp_wmb();
+
+        clock_gettime(CLOCK_REALTIME, &now);
+        stats_shm->update_tsc = rte_rdtsc();
+        stats_shm->update_time_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+        cur_sample.time_ns = stats_shm->update_time_ns;
+        stats_shm->history[stats_shm->history_count % ONVM_STATS_SHM_HISTORY] = cur_sample;
+        stats_shm->history_count++;
+        stats_shm->num_ports = ports->num_ports;
+        stats_shm->num_nfs = num_clients;
+        stats_shm->num_services = num_services;
+        stats_shm->flow_table_flows = sdn_ft_info->flows;
+        stats_shm->flow_table_size = onvm_flow_dir_size();
+        stats_shm->flow_table_resizes = sdn_ft_info->resizes;
+        stats_shm->flow_table_add_fails = sdn_ft_info->add_fails;
+
+        for (i = 0; i < ports->num_ports; i++) {
+                port = &stats_shm->port[ports->id[i]];
+                port->enabled = 1;
+                onvm_stats_sum_port(ports->id[i], &port->rx, &port->tx, &port->tx_drop);
+        }
+
+        memset(stats_shm->service, 0, sizeof(stats_shm->service));
+        for (i = 0; i < num_services; i++)
+                stats_shm->service[i].num_nfs = nf_per_service_count[i];
+
+        for (i = 0; i < MAX_CLIENTS; i++) {
+                nf = &stats_shm->nf[i];
+                if (!onvm_nf_is_valid(&clients[i])) {
+                        memset(nf, 0, sizeof(*nf));
+                        continue;
+                }
+
+                onvm_stats_sum_client(i, &sum);
+                nf->valid = 1;
+                nf->status = clients[i].info->status;
+                nf->instance_id = clients[i].info->instance_id;
+                nf->service_id = clients[i].info->service_id;
+                nf->headroom = clients[i].info->headroom;
+                nf->rx = sum.rx - client_stats_base[i].rx;
+                nf->rx_drop = sum.rx_drop - client_stats_base[i].rx_drop;
+                nf->act_out = sum.act_out - client_stats_base[i].act_out;
+                nf->act_tonf = sum.act_tonf - client_stats_base[i].act_tonf;
+                nf->act_drop = sum.act_drop - client_stats_base[i].act_drop;
+                nf->act_next = sum.act_next - client_stats_base[i].act_next;
+                nf->tx = clients_stats[i].tx;
+                nf->tx_drop = clients_stats[i].tx_drop;
+                nf->tx_buffer = clients_stats[i].tx_buffer;
+                nf->tx_returned = clients_stats[i].tx_returned;
+                nf->tx_direct = clients_stats[i].tx_direct;
+                nf->rx_ring_count = rte_ring_count(clients[i].rx_q);
+                nf->rx_ring_size = nf->rx_ring_count + rte_ring_free_count(clients[i].rx_q);
+                nf->tx_ring_count = rte_ring_count(clients[i].tx_q);
+                nf->tx_ring_size = nf->tx_ring_count + rte_ring_free_count(clients[i].tx_q);
+
+                if (nf->service_id < MAX_SERVICES) {
+                        service = &stats_shm->service[nf->service_id];
+                        service->rx += nf->rx;
+                        service->tx += nf->tx;
+                }
+        }
+
+        rte_smp_wmb();
+        stats_shm->seq++;
+}
+
+
+static void
+onvm_stats_display_client_latency(uint16_t id) {
+        /* Snapshots from the last display, percentiles cover the samples since */
+        static struct onvm_hist hop_last[MAX_CLIENTS];
+        static struct onvm_hist e2e_last[MAX_CLIENTS];
+        struct onvm_hist hop, e2e;
+        double hop_us[3], e2e_us[3];
+        const double pct[3] = {0.5, 0.99, 0.999};
+        unsigned i;
+
+        hop = latency_info->hop[id];
+        e2e = latency_info->out[id];
+        for (i = 0; i < num_mgr_threads; i++)
+                if (mgr_threads[i]->e2e_hist != NULL)
+                        onvm_hist_add(&e2e, &mgr_threads[i]->e2e_hist[id]);
+
+        for (i = 0; i < 3; i++) {
+                hop_us[i] = onvm_cycles_to_us(onvm_hist_percentile(&hop, &hop_last[id], pct[i]));
+                e2e_us[i] = onvm_cycles_to_us(onvm_hist_percentile(&e2e, &e2e_last[id], pct[i]));
+        }
+        hop_last[id] = hop;
+        e2e_last[id] = e2e;
+
+        for (i = 0; i < 3; i++) {
+                cur_sample.nf[id].hop_ns[i] = hop_us[i] * 1000;
+                cur_sample.nf[id].e2e_ns[i] = e2e_us[i] * 1000;
+        }
+
+        ONVM_SAFE_FPRINTF(stats_out, ONVM_CONSOLE_NF_LATENCY_FMT,
+                        hop_us[0], hop_us[1], hop_us[2],
+                        e2e_us[0], e2e_us[1], e2e_us[2]);
+
+        cJSON_AddNumberToObject(onvm_json_nf_stats[id], "Hop p50", hop_us[0]);
+        cJSON_AddNumberToObject(onvm_json_nf_stats[id], "Hop p99", hop_us[1]);
+        cJSON_AddNumberToObject(onvm_json_nf_stats[id], "Hop p99.9", hop_us[2]);
+        cJSON_AddNumberToObject(onvm_json_nf_stats[id], "E2E p50", e2e_us[0]);
+        cJSON_AddNumberToObject(onvm_json_nf_stats[id], "E2E p99", e2e_us[1]);
+        cJSON_AddNumberToObject(onvm_json_nf_stats[id], "E2E p99.9", e2e_us[2]);
+}
+
+
 /***************************Helper functions**********************************/
 
 
@@ -68,7 +68,9 @@
 
 #define ONVM_CONSOLE_PORT_STATS_FMT "Port %u - rx: %9"PRIu64"  (%9"PRIu64" pps)\t tx: %9"PRIu64"  (%9"PRIu64" pps)\n"
 #define ONVM_CONSOLE_NF_STATS_FMT "Client %2u - rx: %9"PRIu64" rx_drop: %9"PRIu64" next: %9"PRIu64" drop: %9"PRIu64" ret: %9"PRIu64"\n" \
-                               "            tx: %9"PRIu64" tx_drop: %9"PRIu64" out:  %9"PRIu64" tonf: %9"PRIu64" buf: %9"PRIu64" \n"
+                               "            tx: %9"PRIu64" tx_drop: %9"PRIu64" out:  %9"PRIu64" tonf: %9"PRIu64" buf: %9"PRIu64" direct: %9"PRIu64"\n"
+#define ONVM_CONSOLE_FLOW_TABLE_FMT "Flow table - flows: %9"PRIu32" / %9"PRIu32" (%3"PRIu64"%%)  shards: %"PRIu16"  resizes: %"PRIu32"  add failures: %"PRIu64"  rules: %"PRIu32"\n"
+#define ONVM_CONSOLE_NF_LATENCY_FMT "            hop p50: %7.1f p99: %7.1f p99.9: %7.1f us  e2e p50: %7.1f p99: %7.1f p99.9: %7.1f us\n"
 
 #define ONVM_SNPRINTF(str_, sz_, fmt_, ...)                                     \
         do {                                                                    \
@@ -112,6 +114,38 @@ cJSON* onvm_json_nf_stats[MAX_CLIENTS];
  */
 void onvm_stats_set_output(ONVM_STATS_OUTPUT output);
 
+/*
+ * Interface called by the manager to create the binary stats segment
+ * (ONVM_STATS_SHM_NAME, see onvm_stats_shm.h), refreshed every time the
+ * stats are displayed. Monitoring tools can mmap it and read it at any rate.
+ * If it can't be shared, it is kept in private memory so the history is
+ * still available to the manager.
+ *
+ * Output : 0 on success, -1 if the segment could not be shared
+ *
+ */
+int onvm_stats_shm_init(void);
+
+/*
+ * Interface giving one sample of the stats history, one per stats update.
+ * Only valid on the master thread, which adds the samples.
+ *
+ * Input  : how many updates ago the sample was taken, 0 for the latest
+ * Output : the sample, NULL if the history doesn't go back that far
+ *
+ */
+struct onvm_stats_shm_sample;
+const struct onvm_stats_shm_sample *onvm_stats_history(unsigned age);
+
+/*
+ * Interface giving an NF's mean RX ring use over its last samples.
+ *
+ * Input  : the client id, how many samples to average at most
+ * Output : the mean, from 0 to 1, or -1 if it has no samples
+ *
+ */
+double onvm_stats_history_rx_use(uint16_t id, unsigned samples);
+
 /*
  * Interface to close out file descriptions and clean up memory
  * To be called when the stats loop is done
@@ -130,11 +164,8 @@ void onvm_stats_display_all(unsigned difftime);
 
 /*
  * Interface called by the ONVM Manager to clear all clients statistics
- * available.
- *
- * Note : this function doesn't use onvm_stats_clear_client for each client,
- * since with a huge number of clients, the additional functions calls would
- * incur a visible slowdown.
+ * available. The counters are owned by the threads writing them, so this
+ * only records their current values as the new zero.
  *
  */
 void onvm_stats_clear_all_clients(void);
@@ -148,6 +179,37 @@ void onvm_stats_clear_all_clients(void);
  */
 void onvm_stats_clear_client(uint16_t id);
 
+/*
+ * Interface called by the ONVM Manager to add the counters and latency
+ * histograms of one RX or TX thread to the ones displayed.
+ *
+ * Input : the thread
+ *
+ */
+struct thread_info;
+void onvm_stats_add_thread(struct thread_info *thread);
+
+/*
+ * Interface adding up the counters every manager thread and NF keeps for a
+ * port. Only reads the counters, so any thread may call it.
+ *
+ * Input  : the port id
+ * Output : the packets received, sent and dropped on TX
+ *
+ */
+void onvm_stats_sum_port(uint8_t port, uint64_t *rx, uint64_t *tx, uint64_t *tx_drop);
+
+/*
+ * Interface adding up the counters every manager thread keeps for a client,
+ * since it started. Only reads the counters, so any thread may call it.
+ *
+ * Input  : the client id
+ * Output : the totals
+ *
+ */
+struct thread_nf_stats;
+void onvm_stats_sum_client(uint16_t id, struct thread_nf_stats *sum);
+
 /*
  * Returns a human-readable string for the passed port's MAC Address
  *
@@ -0,0 +1,194 @@
+/*********************************************************************
+ *                     openNetVM
+ *              https://sdnfv.github.io
+ *
+ *   BSD LICENSE
+ *
+ *   Copyright(c)
+ *            2015-2016 George Washington University
+ *            2015-2016 University of California Riverside
+ *            2010-2014 Intel Corporation. All rights reserved.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ********************************************************************/
+
+
+/******************************************************************************
+
+                               onvm_stats_shm.h
+
+
+      Layout of the binary stats segment the manager keeps in shared
+      memory: the current totals and a history of per-second samples.
+      It only depends on <stdint.h>, so monitoring tools can include it
+      to mmap and read the segment.
+
+
+******************************************************************************/
+
+
+#ifndef _ONVM_STATS_SHM_H_
+#define _ONVM_STATS_SHM_H_
+
+#include <stdint.h>
+
+
+/***********************************Macros************************************/
+
+
+/* shm_open name, the segment is /dev/shm/onvm_stats on Linux */
+#define ONVM_STATS_SHM_NAME "/onvm_stats"
+#define ONVM_STATS_SHM_MAGIC 0x4f4e564d         // "ONVM"
+/* Bumped whenever the layout below changes */
+#define ONVM_STATS_SHM_VERSION 3
+
+/* Same as RTE_MAX_ETHPORTS, MAX_CLIENTS and MAX_SERVICES in the manager */
+#define ONVM_STATS_SHM_MAX_PORTS 32
+#define ONVM_STATS_SHM_MAX_NFS 16
+#define ONVM_STATS_SHM_MAX_SERVICES 16
+
+/* Samples kept in the history, one per stats update (every second) */
+#define ONVM_STATS_SHM_HISTORY 600
+
+
+/******************************Data structures********************************/
+
+
+/* All counters are totals since the manager started, readers derive rates */
+struct onvm_stats_shm_port {
+        uint8_t enabled;
+        uint64_t rx;
+        uint64_t tx;
+        uint64_t tx_drop;
+};
+
+
+struct onvm_stats_shm_nf {
+        uint8_t valid;                  /* the other fields are 0 if not */
+        uint8_t status;                 /* NF_RUNNING, NF_PAUSED... */
+        uint16_t instance_id;
+        uint16_t service_id;
+        uint16_t headroom;
+        uint64_t rx;
+        uint64_t rx_drop;
+        uint64_t tx;
+        uint64_t tx_drop;
+        uint64_t tx_buffer;
+        uint64_t tx_returned;
+        uint64_t tx_direct;
+        uint64_t act_out;
+        uint64_t act_tonf;
+        uint64_t act_drop;
+        uint64_t act_next;
+        /* packets waiting in the NF's rings, and how many they can hold */
+        uint32_t rx_ring_count;
+        uint32_t rx_ring_size;
+        uint32_t tx_ring_count;
+        uint32_t tx_ring_size;
+};
+
+
+struct onvm_stats_shm_service {
+        uint16_t num_nfs;               /* local instances */
+        uint64_t rx;                    /* sums over the instances */
+        uint64_t tx;
+};
+
+
+/* Rates over one stats interval, per port and NF, for the history */
+struct onvm_stats_shm_port_sample {
+        uint64_t rx_pps;
+        uint64_t tx_pps;
+        uint64_t tx_drop_pps;
+};
+
+
+struct onvm_stats_shm_nf_sample {
+        uint8_t valid;                  /* the NF was running */
+        uint16_t service_id;
+        uint64_t rx_pps;
+        uint64_t tx_pps;
+        uint64_t rx_drop_pps;
+        uint64_t tx_drop_pps;
+        float rx_ring_use;              /* 0 to 1, when sampled */
+        /* latency percentiles over the interval in ns, 0 without -L */
+        uint32_t hop_ns[3];             /* p50, p99, p99.9 */
+        uint32_t e2e_ns[3];
+};
+
+
+struct onvm_stats_shm_sample {
+        uint64_t time_ns;               /* CLOCK_REALTIME */
+        struct onvm_stats_shm_port_sample port[ONVM_STATS_SHM_MAX_PORTS];
+        struct onvm_stats_shm_nf_sample nf[ONVM_STATS_SHM_MAX_NFS];
+};
+
+
+/*
+ * The segment. The manager writes it once per stats interval; seq is odd
+ * while it does. To get a consistent copy, readers retry until they see the
+ * same even seq before and after copying:
+ *
+ *      do {
+ *              seq = shm->seq;
+ *              (read barrier)
+ *              copy = *shm;
+ *              (read barrier)
+ *      } while ((seq & 1) || seq != shm->seq);
+ *
+ * Readers should check magic, version and size before anything else.
+ */
+struct onvm_stats_shm {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t size;                  /* sizeof(struct onvm_stats_shm) */
+        volatile uint32_t seq;
+        uint64_t tsc_hz;
+        uint64_t update_tsc;            /* manager TSC at the last update */
+        uint64_t update_time_ns;        /* CLOCK_REALTIME at the last update */
+        uint16_t num_ports;
+        uint16_t num_nfs;
+        uint16_t num_services;
+        /* flow director table: flows in it, entries it has room for, times
+         * it grew, and flows that could not be added for lack of room */
+        uint32_t flow_table_flows;
+        uint32_t flow_table_size;
+        uint32_t flow_table_resizes;
+        uint64_t flow_table_add_fails;
+        struct onvm_stats_shm_port port[ONVM_STATS_SHM_MAX_PORTS];
+        struct onvm_stats_shm_nf nf[ONVM_STATS_SHM_MAX_NFS];
+        struct onvm_stats_shm_service service[ONVM_STATS_SHM_MAX_SERVICES];
+        /* Ring of the last ONVM_STATS_SHM_HISTORY samples. history_count
+         * only grows: the latest sample is at
+         * (history_count - 1) % ONVM_STATS_SHM_HISTORY. */
+        uint64_t history_count;
+        struct onvm_stats_shm_sample history[ONVM_STATS_SHM_HISTORY];
+};
+
+#endif  // _ONVM_STATS_SHM_H_
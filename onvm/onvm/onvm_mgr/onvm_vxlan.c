@@ -51,6 +51,8 @@ https://github.com/sdnfv/onvm-dpdk/blob/master/examples/tep_termination/vxlan.c
 
 ******************************************************************************/
 
+#include <string.h>
+#include <rte_memcpy.h>
 #include <rte_mbuf.h>
 #include <rte_ether.h>
 #include <rte_ip.h>
@@ -63,64 +65,83 @@ https://github.com/sdnfv/onvm-dpdk/blob/master/examples/tep_termination/vxlan.c
 #include "onvm_vxlan.h"
 #include "../onvm_nflib/onvm_common.h"
 #include "../onvm_nflib/onvm_pkt_helper.h"
+#include "../onvm_nflib/onvm_flow_table.h"
 
 static uint64_t process_inner_cksums(struct ether_hdr *eth_hdr, union tunnel_offload_info *info);
 static uint16_t get_psd_sum(void *l3_hdr, uint16_t ethertype, uint64_t ol_flags);
 
 void
-onvm_encapsulate_pkt(struct rte_mbuf *pkt, struct ether_addr *src_addr, struct ether_addr *dst_addr)
+onvm_vxlan_hdr_init(struct onvm_vxlan_hdr *hdr, const struct ether_addr *src_addr, const struct ether_addr *dst_addr,
+                    uint32_t src_ip, uint32_t dst_ip)
+{
+        memset(hdr, 0, sizeof(struct onvm_vxlan_hdr));
+
+        /* set up outer Ethernet header*/
+        ether_addr_copy(src_addr, &hdr->eth.s_addr);
+        ether_addr_copy(dst_addr, &hdr->eth.d_addr);
+        hdr->eth.ether_type = rte_cpu_to_be_16(ETHER_TYPE_IPv4);
+
+        /* set up outer IP header
+         * since our switches are L2 switches, this really doesn't matter,
+         * save that we can recognize it on the receiving side */
+        hdr->ip.version_ihl = IP_VHL_DEF;
+        hdr->ip.fragment_offset = IP_DN_FRAGMENT_FLAG;
+        hdr->ip.time_to_live = IP_DEFTTL;
+        hdr->ip.next_proto_id = IPPROTO_UDP;
+        hdr->ip.src_addr = src_ip;
+        hdr->ip.dst_addr = dst_ip;
+
+        /* checksum with a total length of 0, patched per packet */
+        hdr->ip.hdr_checksum = rte_ipv4_cksum(&hdr->ip);
+
+        /*UDP HEADER*/
+        hdr->udp.dst_port = rte_cpu_to_be_16(DEFAULT_VXLAN_PORT);
+        hdr->udp.src_port = rte_cpu_to_be_16(DEFAULT_VXLAN_PORT);
+
+        /*VXLAN HEADER*/
+        hdr->vxlan.vx_flags = rte_cpu_to_be_32(VXLAN_HF_VNI);
+        hdr->vxlan.vx_vni = rte_cpu_to_be_32(0);
+}
+
+int
+onvm_encapsulate_pkt(struct rte_mbuf *pkt, const struct onvm_vxlan_hdr *tmpl)
 {
         uint64_t ol_flags = 0;
-        uint32_t old_len = pkt->pkt_len;
+        uint32_t cksum;
+        uint16_t ip_len;
         union tunnel_offload_info tx_offload = { .data = 0 };
         struct ether_hdr *phdr = rte_pktmbuf_mtod(pkt, struct ether_hdr *);
         struct onvm_pkt_meta *old_meta = onvm_get_pkt_meta(pkt);
-        const uint8_t src_ip[4] = VXLAN_SRC_IP;
-        const uint8_t dst_ip[4] = VXLAN_DST_IP;
+        struct onvm_vxlan_hdr *hdr;
+        struct onvm_pkt_meta *dst_meta;
 
-        /* Allocate space for new ethernet, IPv4, UDP and VXLAN headers */
-        size_t new_data_len = sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr)
-                            + sizeof(struct udp_hdr) + sizeof(struct vxlan_hdr)
-                            + sizeof(struct onvm_pkt_meta);
-        struct ether_hdr *pneth = (struct ether_hdr *) rte_pktmbuf_prepend(pkt, new_data_len);
+        /* inner IP checksum offload, done before the inner header moves */
+        ol_flags |= process_inner_cksums(phdr, &tx_offload);
 
-        struct ipv4_hdr *ip = (struct ipv4_hdr *) &pneth[1];
-        struct udp_hdr *udp = (struct udp_hdr *) &ip[1];
-        struct vxlan_hdr *vxlan = (struct vxlan_hdr *) &udp[1];
-        struct onvm_pkt_meta *dst_meta = (struct onvm_pkt_meta *) &vxlan[1];
-        int i;
+        /* Allocate space for new ethernet, IPv4, UDP and VXLAN headers */
+        hdr = (struct onvm_vxlan_hdr *) rte_pktmbuf_prepend(pkt,
+                        sizeof(struct onvm_vxlan_hdr) + sizeof(struct onvm_pkt_meta));
+        if (unlikely(hdr == NULL))
+                return -1;
+        dst_meta = (struct onvm_pkt_meta *) &hdr[1];
 
-        /* set up outer Ethernet header*/
-        pneth->s_addr = *src_addr;
-        pneth->d_addr = *dst_addr;
-        pneth->ether_type = ETHER_TYPE_IPv4;
+        rte_memcpy(hdr, tmpl, sizeof(struct onvm_vxlan_hdr));
 
-        /* set up outer IP header
-         * since our switches are L2 switches, this really doesn't matter,
-         * save that we can recognize it on the receiving side */
-        ip->version_ihl = IP_VHL_DEF;
-        ip->type_of_service = 0;
-        ip->total_length = 0;
-        ip->packet_id = 0;
-        ip->fragment_offset = IP_DN_FRAGMENT_FLAG;
-        ip->time_to_live = IP_DEFTTL;
-        ip->next_proto_id = IPPROTO_UDP;
-        ip->hdr_checksum = 0;
-
-        ip->src_addr = 0;
-        ip->dst_addr = 0;
-        for (i = 0; i < 4; i++) {
-                ip->src_addr |= src_ip[i] << (8 * i);
-                ip->dst_addr |= dst_ip[i] << (8 * i);
-        }
-        ip->total_length = rte_cpu_to_be_16(pkt->data_len - sizeof(struct ether_hdr));
+        /* Only the lengths differ from the template. The template checksum
+         * covers a length of 0, so add the new length in (RFC 1624) */
+        ip_len = pkt->pkt_len - sizeof(struct ether_hdr);
+        hdr->ip.total_length = rte_cpu_to_be_16(ip_len);
+        hdr->udp.dgram_len = rte_cpu_to_be_16(ip_len - sizeof(struct ipv4_hdr));
+        cksum = (uint16_t)~tmpl->ip.hdr_checksum;
+        cksum += hdr->ip.total_length;
+        cksum = (cksum & 0xFFFF) + (cksum >> 16);
+        cksum = (cksum & 0xFFFF) + (cksum >> 16);
+        hdr->ip.hdr_checksum = (uint16_t)~cksum;
 
-        /* outer IP checksum */
-        ol_flags |= PKT_TX_OUTER_IP_CKSUM;
-        ip->hdr_checksum = 0;
+        /* Spread tunnels over the receiver's RX queues by the inner flow.
+         * The UDP checksum is 0, so nothing else needs updating */
+        hdr->udp.src_port = rte_cpu_to_be_16(VXLAN_SRC_PORT_MIN + pkt->hash.rss % VXLAN_SRC_PORT_RANGE);
 
-        /* inner IP checksum offload */
-        ol_flags |= process_inner_cksums(phdr, &tx_offload);
         pkt->l2_len = tx_offload.l2_len;
         pkt->l3_len = tx_offload.l3_len;
         pkt->l4_len = tx_offload.l4_len;
@@ -129,22 +150,9 @@ onvm_encapsulate_pkt(struct rte_mbuf *pkt, struct ether_addr *src_addr, struct e
         pkt->outer_l2_len = sizeof(struct ether_hdr);
         pkt->outer_l3_len = sizeof(struct ipv4_hdr);
 
-        pkt->ol_flags |= ol_flags;
+        pkt->ol_flags |= ol_flags | PKT_TX_OUTER_IPV4;
         pkt->tso_segsz = tx_offload.tso_segsz;
 
-        /*VXLAN HEADER*/
-        vxlan->vx_flags = rte_cpu_to_be_32(VXLAN_HF_VNI);
-        vxlan->vx_vni = rte_cpu_to_be_32(0);
-
-        /*UDP HEADER*/
-        udp->dgram_cksum = 0;
-        udp->dgram_len = rte_cpu_to_be_16(old_len
-                                + sizeof(struct udp_hdr)
-                                + sizeof(struct vxlan_hdr));
-
-        udp->dst_port = rte_cpu_to_be_16(DEFAULT_VXLAN_PORT);
-        udp->src_port = rte_cpu_to_be_16(DEFAULT_VXLAN_PORT);
-
         /* Copy onvm_pkt_meta data into the packet data */
         dst_meta->action = old_meta->action;
         dst_meta->destination = rte_cpu_to_be_16(old_meta->destination);
@@ -152,7 +160,7 @@ onvm_encapsulate_pkt(struct rte_mbuf *pkt, struct ether_addr *src_addr, struct e
         dst_meta->chain_index = old_meta->chain_index;
         dst_meta->flags = old_meta->flags;
 
-        return;
+        return 0;
 }
 
 int
@@ -163,6 +171,7 @@ onvm_decapsulate_pkt(struct rte_mbuf *pkt)
         struct udp_hdr *udp_hdr;
         struct onvm_pkt_meta *pkt_meta;
         struct onvm_pkt_meta *dst_meta;
+        struct onvm_ft_ipv4_5tuple key;
 
         if (!onvm_pkt_is_udp(pkt))
                 return -1;
@@ -193,6 +202,13 @@ onvm_decapsulate_pkt(struct rte_mbuf *pkt)
 
         rte_pktmbuf_adj(pkt, sizeof(struct onvm_pkt_meta));
 
+        /* The NIC hashed the tunnel's headers, the flow director and the
+         * service map need the inner flow's hash */
+        if (onvm_ft_fill_key(&key, pkt) == 0) {
+                pkt->hash.rss = onvm_softrss(&key);
+                pkt->ol_flags |= PKT_RX_RSS_HASH;
+        }
+
         return 0;
 }
 
@@ -53,6 +53,7 @@
 #include <rte_mbuf.h>
 #include <rte_ether.h>
 #include <rte_ip.h>
+#include <rte_udp.h>
 
 #define RTE_LOGTYPE_VXLAN RTE_LOGTYPE_USER2
 
@@ -67,12 +68,24 @@
 #define IP_DN_FRAGMENT_FLAG 0x0040
 #define VXLAN_HF_VNI 0x08000000
 #define DEFAULT_VXLAN_PORT 4789
+#define VXLAN_SRC_PORT_MIN 49152        // Source ports carry flow entropy (RFC 7348)
+#define VXLAN_SRC_PORT_RANGE 16384
 
-// Dummy IP addresses to use in vxlan encapsulation
-// Our switches are L2 switches, so they won't look at this
+// Default IP addresses to use in vxlan encapsulation when a manager
+// does not publish its own. Our switches are L2 switches, so they
+// won't look at this, but the receiving NIC hashes on it
 #define VXLAN_SRC_IP {10, 1, 2, 3}
 #define VXLAN_DST_IP {10, 4, 5, 6}
 
+/* Outer headers to one remote manager. Built once by onvm_vxlan_hdr_init
+ * with a zero length, then copied in front of every packet. */
+struct onvm_vxlan_hdr {
+        struct ether_hdr eth;
+        struct ipv4_hdr ip;
+        struct udp_hdr udp;
+        struct vxlan_hdr vxlan;
+} __attribute__((__packed__));
+
 /* structure that caches offload info for the current packet */
 union tunnel_offload_info {
         uint64_t data;
@@ -88,6 +101,18 @@ union tunnel_offload_info {
 
 int onvm_decapsulate_pkt(struct rte_mbuf *pkt);
 
-void onvm_encapsulate_pkt(struct rte_mbuf *pkt, struct ether_addr *src_addr, struct ether_addr *dst_addr);
+/*
+ * Build the outer header template for packets from src_addr to dst_addr
+ * IP addresses are in network order
+ */
+void onvm_vxlan_hdr_init(struct onvm_vxlan_hdr *hdr, const struct ether_addr *src_addr, const struct ether_addr *dst_addr,
+                         uint32_t src_ip, uint32_t dst_ip);
+
+/*
+ * Prepend a copy of the template and the packet's onvm_pkt_meta, then fix
+ * up the lengths, outer IP checksum and UDP source port. Returns 0, or -1
+ * if the packet has no room for the headers.
+ */
+int onvm_encapsulate_pkt(struct rte_mbuf *pkt, const struct onvm_vxlan_hdr *tmpl);
 
 #endif
@@ -48,6 +48,9 @@
 
 ******************************************************************************/
 
+#include <stdio.h>
+#include <stdlib.h>
+
 #include "onvm_zk_common.h"
 
 inline int
@@ -81,6 +84,41 @@ onvm_zk_create_or_update(zhandle_t *zh, const char* path, const char *data, int
         return ret;
 }
 
+int
+mac_string_to_struct(const char *data, struct ether_addr *addr) {
+        unsigned int temp[ETHER_ADDR_LEN];
+        int bytes_found;
+        int i;
+
+        bytes_found = sscanf(data, MAC_ADDR_FMT,
+                &temp[0],
+                &temp[1],
+                &temp[2],
+                &temp[3],
+                &temp[4],
+                &temp[5]);
+        if (bytes_found != ETHER_ADDR_LEN) {
+                return 0;
+        }
+
+        for (i = 0; i < ETHER_ADDR_LEN; i++) {
+                addr->addr_bytes[i] = (uint8_t) temp[i];
+        }
+        return ETHER_ADDR_LEN;
+}
+
+void
+free_String_vector(struct String_vector *v) {
+    if (v->data) {
+        int32_t i;
+        for (i=0; i<v->count; i++) {
+            free(v->data[i]);
+        }
+        free(v->data);
+        v->data = 0;
+    }
+}
+
 const char *
 zk_state_to_string(int state) {
         if (state == 0)
@@ -51,16 +51,31 @@
 #ifndef ONVM_ZK_COMMON_H_
 #define ONVM_ZK_COMMON_H_
 
+#include <rte_ether.h>
 #include <zookeeper/zookeeper.h>
 
 #define RTE_LOGTYPE_ZK RTE_LOGTYPE_USER2
 
+#define MAC_ADDR_FMT "%x:%x:%x:%x:%x:%x"
+#define MAC_STR_LEN 18
+
 inline int
 onvm_zk_create_if_not_exists(zhandle_t *zh, const char *path, const char *data, int data_len, int flags, char *path_buffer, int path_buffer_len);
 
 inline int
 onvm_zk_create_or_update(zhandle_t *zh, const char *path, const char*data, int data_len, int flags);
 
+/*
+ * Parse a MAC address as stored in a /manager node.
+ * Returns ETHER_ADDR_LEN on success, 0 if the string is not a MAC address.
+ */
+int mac_string_to_struct(const char *data, struct ether_addr *addr);
+
+/*
+ * Free the children list returned by zoo_get_children and friends
+ */
+void free_String_vector(struct String_vector *v);
+
 const char *zk_state_to_string(int state);
 
 const char *zk_event_type_to_string(int type);
@@ -0,0 +1,673 @@
+/*********************************************************************
+ *                     openNetVM
+ *              https://sdnfv.github.io
+ *
+ *   BSD LICENSE
+ *
+ *   Copyright(c)
+ *            2015-2016 George Washington University
+ *            2015-2016 University of California Riverside
+ *            2010-2014 Intel Corporation. All rights reserved.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ********************************************************************/
+
+
+/******************************************************************************
+
+                              onvm_zk_resolver.c
+
+    Keeps an in-memory mirror of /manager, /service and /nf current using
+    ZooKeeper watches. Watch callbacks only queue work, a background
+    thread re-reads the changed nodes and publishes RCU style snapshots
+    that the RX and TX threads read without ever waiting on ZooKeeper.
+
+
+******************************************************************************/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <unistd.h>
+#include <rte_cycles.h>
+#include <rte_hash.h>
+#include <rte_lcore.h>
+#include <rte_log.h>
+#include <rte_malloc.h>
+#include <rte_ring.h>
+#include <rte_spinlock.h>
+
+#include "../onvm_nflib/onvm_common.h"
+#include "../onvm_nflib/onvm_flow_table.h"
+#include "../onvm_nflib/onvm_qsbr.h"
+#include "onvm_init.h"
+#include "onvm_zookeeper.h"
+#include "onvm_zk_common.h"
+#include "onvm_zk_resolver.h"
+
+/* Work for the resolver thread, queued as (kind << 16) | service id */
+#define ZK_REQ_MANAGERS 0       // re-read /manager and every manager node
+#define ZK_REQ_SERVICE 1        // re-read /service/<id> and its children
+#define ZK_REQ_NF 2             // re-read /nf/<id> and its stat nodes
+#define ZK_REQ_KINDS 3
+#define ZK_REQ_BURST 32
+
+static zhandle_t *resolver_zh = NULL;
+static int64_t resolver_local_id;
+static struct ether_addr resolver_local_mac;
+static pthread_t resolver_thread;
+static volatile uint8_t resolver_keep_running = 0;
+
+// Work queued by the watcher, dequeued by the resolver thread
+static struct rte_ring *resolver_ring = NULL;
+// Set while a request is in the ring so each one is queued at most once
+static rte_atomic16_t resolver_pending[ZK_REQ_KINDS][MAX_SERVICES];
+
+// Mirror of /manager and /service, only used by the resolver thread
+static struct onvm_zk_remote_mgr mirror_mgrs[ZK_RESOLVER_MAX_MGRS];
+static uint16_t mirror_mgr_count;
+static struct {
+        uint16_t count;
+        int64_t manager_id[ZK_RESOLVER_MAX_MGRS];
+} mirror_services[MAX_SERVICES];
+static volatile time_t mirror_last_modified[MAX_SERVICES];
+
+// Mirror of /nf, also read by the master thread when scaling
+static rte_spinlock_t mirror_nf_lock;
+static struct onvm_zk_nf_stat mirror_nfs[MAX_SERVICES][ZK_RESOLVER_MAX_NFS];
+static uint16_t mirror_nf_count[MAX_SERVICES];
+
+// Published snapshots, read by the packet threads
+static struct onvm_zk_remote_service *volatile remote_services[MAX_SERVICES];
+static uint64_t remote_services_version = 0;
+
+// Snapshots waiting for a grace period before they can be freed
+static struct onvm_zk_remote_service *retired[MAX_SERVICES];
+static uint16_t retired_count;
+
+/*********************Internal Functions Prototypes***************************/
+
+static void *onvm_zk_resolver_main(void *arg);
+static void onvm_zk_resolver_queue(uint16_t kind, uint16_t service_id);
+static int onvm_zk_resolver_watch_creation(const char *path, uint16_t kind, uint16_t service_id);
+static int onvm_zk_mirror_managers(void);
+static int onvm_zk_mirror_service(uint16_t service_id);
+static int onvm_zk_mirror_nf(uint16_t service_id);
+static void onvm_zk_resolver_publish(uint16_t service_id);
+static void onvm_zk_resolver_retire(struct onvm_zk_remote_service *svc);
+static void onvm_zk_resolver_reclaim(void);
+static void onvm_zk_flow_table_sweep(struct onvm_zk_flow_table *flows);
+
+/*
+ * Choose a remote manager for a new flow. With power of two choices the
+ * second candidate comes from other bits of the hash and the one with the
+ * emptier RX rings wins, which keeps flows away from saturated instances
+ * without every thread piling onto the same least loaded manager.
+ */
+static inline uint16_t
+onvm_zk_resolver_pick(struct onvm_zk_remote_service *svc, uint32_t hash) {
+        uint16_t first, second;
+
+        first = hash % svc->count;
+        if (remote_selection != REMOTE_SELECT_P2C || svc->count == 1)
+                return first;
+
+        second = (first + 1 + (hash >> 16) % (svc->count - 1)) % svc->count;
+        return svc->mgr[second].rx_use < svc->mgr[first].rx_use ? second : first;
+}
+
+/*****************************************************************************/
+
+int
+onvm_zk_resolver_start(zhandle_t *zh, int64_t local_id, uint8_t tunnel_port) {
+        int i, j;
+
+        if (resolver_keep_running) return 0;
+
+        resolver_ring = rte_ring_create(ZK_RESOLVER_RING_NAME, ZK_RESOLVER_RING_SIZE,
+                                        rte_socket_id(), RING_F_SC_DEQ);
+        if (resolver_ring == NULL) {
+                RTE_LOG(ERR, ZK, "Cannot create resolver ring\n");
+                return -1;
+        }
+
+        for (i = 0; i < ZK_REQ_KINDS; i++) {
+                for (j = 0; j < MAX_SERVICES; j++) {
+                        rte_atomic16_init(&resolver_pending[i][j]);
+                }
+        }
+        for (i = 0; i < MAX_SERVICES; i++) {
+                remote_services[i] = NULL;
+                mirror_services[i].count = 0;
+                mirror_last_modified[i] = 0;
+                mirror_nf_count[i] = 0;
+        }
+        mirror_mgr_count = 0;
+        retired_count = 0;
+        rte_spinlock_init(&mirror_nf_lock);
+
+        resolver_zh = zh;
+        resolver_local_id = local_id;
+        rte_eth_macaddr_get(tunnel_port, &resolver_local_mac);
+        resolver_keep_running = 1;
+
+        // Load the whole mirror, this also sets the initial watches
+        onvm_zk_resolver_notify(NULL);
+
+        if (pthread_create(&resolver_thread, NULL, onvm_zk_resolver_main, NULL) != 0) {
+                RTE_LOG(ERR, ZK, "Cannot start resolver thread\n");
+                resolver_keep_running = 0;
+                return -1;
+        }
+
+        return 0;
+}
+
+void
+onvm_zk_resolver_stop(void) {
+        int i;
+
+        if (!resolver_keep_running) return;
+
+        resolver_keep_running = 0;
+        pthread_join(resolver_thread, NULL);
+
+        for (i = 0; i < MAX_SERVICES; i++) {
+                if (remote_services[i] != NULL) {
+                        onvm_zk_resolver_retire(remote_services[i]);
+                        remote_services[i] = NULL;
+                }
+        }
+        onvm_zk_resolver_reclaim();
+        resolver_zh = NULL;
+}
+
+void
+onvm_zk_resolver_notify(const char *path) {
+        unsigned int id;
+        int i;
+
+        if (!resolver_keep_running) return;
+
+        if (path == NULL) {
+                onvm_zk_resolver_queue(ZK_REQ_MANAGERS, 0);
+                for (i = 0; i < MAX_SERVICES; i++) {
+                        onvm_zk_resolver_queue(ZK_REQ_SERVICE, i);
+                        onvm_zk_resolver_queue(ZK_REQ_NF, i);
+                }
+                return;
+        }
+
+        if (strncmp(path, MGR_NODE_BASE, sizeof(MGR_NODE_BASE) - 1) == 0) {
+                onvm_zk_resolver_queue(ZK_REQ_MANAGERS, 0);
+        } else if (sscanf(path, SERVICE_NODE_BASE "/%u", &id) == 1 && id < MAX_SERVICES) {
+                onvm_zk_resolver_queue(ZK_REQ_SERVICE, id);
+        } else if (sscanf(path, NF_NODE_BASE "/%u", &id) == 1 && id < MAX_SERVICES) {
+                onvm_zk_resolver_queue(ZK_REQ_NF, id);
+        }
+}
+
+struct onvm_zk_flow_table *
+onvm_zk_flow_table_create(void) {
+        struct onvm_zk_flow_table *flows;
+
+        flows = rte_calloc("onvm_zk_flow_table", 1, sizeof(struct onvm_zk_flow_table), 0);
+        if (flows == NULL)
+                return NULL;
+
+        flows->ft = onvm_ft_create(ZK_REMOTE_FLOW_ENTRIES, sizeof(struct onvm_zk_remote_flow));
+        if (flows->ft == NULL) {
+                rte_free(flows);
+                return NULL;
+        }
+
+        return flows;
+}
+
+int64_t
+onvm_zk_resolver_lookup(struct onvm_zk_flow_table *flows, struct rte_mbuf *pkt, uint16_t service_id, const struct onvm_vxlan_hdr **hdr) {
+        struct onvm_zk_remote_service *svc;
+        struct onvm_zk_remote_flow *flow;
+        uint16_t index;
+        int ret;
+        int i;
+
+        if (unlikely(service_id >= MAX_SERVICES))
+                return 0;
+
+        svc = remote_services[service_id];
+        if (svc == NULL || svc->count == 0)
+                return 0;
+
+        // Without a usable flow table fall back to spreading by hash alone
+        index = pkt->hash.rss % svc->count;
+        if (flows == NULL)
+                goto found;
+
+        ret = onvm_ft_lookup_pkt(flows->ft, pkt, (char **)&flow);
+        if (ret == -ENOENT) {
+                ret = onvm_ft_add_pkt(flows->ft, pkt, (char **)&flow);
+                if (ret == -ENOSPC) {
+                        onvm_zk_flow_table_sweep(flows);
+                        ret = onvm_ft_add_pkt(flows->ft, pkt, (char **)&flow);
+                }
+                if (ret < 0)
+                        goto found;
+                index = onvm_zk_resolver_pick(svc, pkt->hash.rss);
+                goto pin;
+        } else if (ret < 0) {
+                goto found;
+        }
+
+        if (likely(flow->service_id == service_id)) {
+                if (likely(flow->version == svc->version)) {
+                        index = flow->index;
+                        goto touch;
+                }
+                // The snapshot changed, keep the flow on its manager if
+                // that one still runs the service
+                for (i = 0; i < svc->count; i++) {
+                        if (svc->mgr[i].manager_id == flow->manager_id) {
+                                index = i;
+                                goto pin;
+                        }
+                }
+        }
+        index = onvm_zk_resolver_pick(svc, pkt->hash.rss);
+
+pin:
+        flow->service_id = service_id;
+        flow->manager_id = svc->mgr[index].manager_id;
+        flow->version = svc->version;
+        flow->index = index;
+touch:
+        flow->last_used = rte_rdtsc();
+
+found:
+        *hdr = &svc->mgr[index].hdr;
+        return svc->mgr[index].manager_id;
+}
+
+uint16_t
+onvm_zk_resolver_nf_stats(uint16_t service_id, struct onvm_zk_nf_stat *stats, uint16_t max) {
+        uint16_t count;
+
+        if (service_id >= MAX_SERVICES) return 0;
+
+        rte_spinlock_lock(&mirror_nf_lock);
+        count = RTE_MIN(mirror_nf_count[service_id], max);
+        memcpy(stats, mirror_nfs[service_id], count * sizeof(struct onvm_zk_nf_stat));
+        rte_spinlock_unlock(&mirror_nf_lock);
+
+        return count;
+}
+
+time_t
+onvm_zk_resolver_last_modified(uint16_t service_id) {
+        if (service_id >= MAX_SERVICES) return 0;
+        return mirror_last_modified[service_id];
+}
+
+/*****************************************************************************
+                        HELPER FUNCTIONS
+*****************************************************************************/
+
+static void *
+onvm_zk_resolver_main(void *arg) {
+        void *reqs[ZK_REQ_BURST];
+        uint16_t kind, service_id;
+        unsigned count, i;
+        int j;
+
+        (void)(arg);
+        while (resolver_keep_running) {
+                count = rte_ring_sc_dequeue_burst(resolver_ring, reqs, ZK_REQ_BURST);
+                if (count == 0) {
+                        usleep(ZK_RESOLVER_IDLE_US);
+                        continue;
+                }
+
+                for (i = 0; i < count; i++) {
+                        kind = (uint16_t)((uintptr_t)reqs[i] >> 16);
+                        service_id = (uint16_t)((uintptr_t)reqs[i] & 0xFFFF);
+                        // Clear first so a watch firing while we read queues another pass
+                        rte_atomic16_clear(&resolver_pending[kind][service_id]);
+
+                        if (kind == ZK_REQ_MANAGERS) {
+                                if (onvm_zk_mirror_managers() != ZOK) continue;
+                                for (j = 0; j < MAX_SERVICES; j++) {
+                                        onvm_zk_resolver_publish(j);
+                                }
+                        } else if (kind == ZK_REQ_SERVICE) {
+                                if (onvm_zk_mirror_service(service_id) != ZOK) continue;
+                                onvm_zk_resolver_publish(service_id);
+                        } else if (kind == ZK_REQ_NF) {
+                                // Loads changed, the snapshot carries them
+                                if (onvm_zk_mirror_nf(service_id) != ZOK) continue;
+                                onvm_zk_resolver_publish(service_id);
+                        }
+                }
+
+                onvm_zk_resolver_reclaim();
+        }
+
+        return NULL;
+}
+
+static void
+onvm_zk_resolver_queue(uint16_t kind, uint16_t service_id) {
+        void *req = (void *)(uintptr_t)((kind << 16) | service_id);
+
+        if (!rte_atomic16_test_and_set(&resolver_pending[kind][service_id]))
+                return;
+
+        if (rte_ring_mp_enqueue(resolver_ring, req) == -ENOBUFS) {
+                RTE_LOG(INFO, ZK, "Resolver ring full, dropping update for service %u\n", service_id);
+                rte_atomic16_clear(&resolver_pending[kind][service_id]);
+        }
+}
+
+/*
+ * Children and data watches are only set on nodes that exist, so ask to be
+ * told when a missing node is created.
+ */
+static int
+onvm_zk_resolver_watch_creation(const char *path, uint16_t kind, uint16_t service_id) {
+        int ret;
+
+        ret = zoo_exists(resolver_zh, path, 1, NULL);
+        if (ret == ZOK) {
+                // Created since we last looked, read it again
+                onvm_zk_resolver_queue(kind, service_id);
+        } else if (ret != ZNONODE) {
+                RTE_LOG(INFO, ZK, "Can't watch %s (%s)\n", path, zk_status_to_string(ret));
+                return ret;
+        }
+        return ZOK;
+}
+
+static int
+onvm_zk_mirror_managers(void) {
+        const uint8_t default_ip[4] = VXLAN_DST_IP;
+        struct onvm_zk_remote_mgr *mgr;
+        struct String_vector children;
+        char path_buf[128];
+        char data_buf[ZK_RESOLVER_DATA_LEN];
+        char *ip;
+        uint16_t count;
+        int data_len;
+        int ret;
+        int i;
+
+        memset(&children, 0, sizeof(children));
+        ret = zoo_get_children(resolver_zh, MGR_NODE_BASE, 1, &children);
+        if (ret != ZOK) {
+                RTE_LOG(INFO, ZK, "Can't list managers (%s)\n", zk_status_to_string(ret));
+                return ret;
+        }
+
+        count = 0;
+        for (i = 0; i < children.count && count < ZK_RESOLVER_MAX_MGRS; i++) {
+                mgr = &mirror_mgrs[count];
+                sprintf(path_buf, MGR_NODE_STR_FMT, children.data[i]);
+                data_len = sizeof(data_buf) - 1;
+                ret = zoo_get(resolver_zh, path_buf, 1, data_buf, &data_len, NULL);
+                if (ret != ZOK || data_len <= 0) continue;
+                data_buf[data_len] = '\0';
+
+                // Data is "MAC IP", older managers only publish the MAC
+                if (!mac_string_to_struct(data_buf, &mgr->mac)) continue;
+                ip = strchr(data_buf, ' ');
+                if (ip == NULL || inet_pton(AF_INET, ip + 1, &mgr->ip) != 1)
+                        memcpy(&mgr->ip, default_ip, sizeof(mgr->ip));
+                mgr->manager_id = (int64_t)strtoull(children.data[i], NULL, 10);
+                onvm_vxlan_hdr_init(&mgr->hdr, &resolver_local_mac, &mgr->mac, tunnel_ip, mgr->ip);
+                count++;
+        }
+        mirror_mgr_count = count;
+
+        free_String_vector(&children);
+        return ZOK;
+}
+
+static int
+onvm_zk_mirror_service(uint16_t service_id) {
+        struct String_vector children;
+        char path_buf[128];
+        char data_buf[ZK_RESOLVER_DATA_LEN];
+        uint16_t count;
+        int data_len;
+        int ret;
+        int i;
+
+        sprintf(path_buf, SERVICE_NODE_FMT, service_id);
+
+        // The data holds the last time an instance started or stopped
+        data_len = sizeof(data_buf) - 1;
+        ret = zoo_get(resolver_zh, path_buf, 1, data_buf, &data_len, NULL);
+        if (ret == ZOK && data_len > 0) {
+                data_buf[data_len] = '\0';
+                mirror_last_modified[service_id] = (time_t)strtoul(data_buf, NULL, 10);
+        }
+
+        memset(&children, 0, sizeof(children));
+        if (ret == ZOK)
+                ret = zoo_get_children(resolver_zh, path_buf, 1, &children);
+        if (ret == ZNONODE) {
+                mirror_services[service_id].count = 0;
+                mirror_last_modified[service_id] = 0;
+                return onvm_zk_resolver_watch_creation(path_buf, ZK_REQ_SERVICE, service_id);
+        }
+        if (ret != ZOK) {
+                RTE_LOG(INFO, ZK, "Can't resolve service %u (%s)\n", service_id, zk_status_to_string(ret));
+                return ret;
+        }
+
+        count = 0;
+        for (i = 0; i < children.count && count < ZK_RESOLVER_MAX_MGRS; i++) {
+                mirror_services[service_id].manager_id[count++] = (int64_t)strtoull(children.data[i], NULL, 10);
+        }
+        mirror_services[service_id].count = count;
+
+        free_String_vector(&children);
+        return ZOK;
+}
+
+static int
+onvm_zk_mirror_nf(uint16_t service_id) {
+        static struct onvm_zk_nf_stat nfs[ZK_RESOLVER_MAX_NFS];
+        struct onvm_zk_nf_stat *nf;
+        struct String_vector children;
+        struct Stat stat;
+        uint16_t free_cores;
+        double rx_use;
+        char path_buf[128];
+        char data_buf[ZK_RESOLVER_DATA_LEN];
+        uint16_t count;
+        int data_len;
+        int ret;
+        int i;
+
+        count = 0;
+        memset(&children, 0, sizeof(children));
+        sprintf(path_buf, NF_SERVICE_BASE, service_id);
+        ret = zoo_get_children(resolver_zh, path_buf, 1, &children);
+        if (ret == ZNONODE) {
+                ret = onvm_zk_resolver_watch_creation(path_buf, ZK_REQ_NF, service_id);
+                goto publish;
+        }
+        if (ret != ZOK) {
+                RTE_LOG(INFO, ZK, "Can't list NFs for service %u (%s)\n", service_id, zk_status_to_string(ret));
+                return ret;
+        }
+
+        for (i = 0; i < children.count && count < ZK_RESOLVER_MAX_NFS; i++) {
+                sprintf(path_buf, NF_STAT_CHILD_FMT, service_id, children.data[i]);
+                data_len = sizeof(data_buf) - 1;
+                ret = zoo_get(resolver_zh, path_buf, 1, data_buf, &data_len, &stat);
+                if (ret != ZOK || data_len <= 0) continue;
+                data_buf[data_len] = '\0';
+
+                if (sscanf(data_buf, "%lf %" SCNu16, &rx_use, &free_cores) != 2) continue;
+
+                nf = &nfs[count++];
+                nf->manager_id = stat.ephemeralOwner;
+                nf->rx_use = rx_use;
+                nf->free_cores = free_cores;
+        }
+        free_String_vector(&children);
+        ret = ZOK;
+
+publish:
+        rte_spinlock_lock(&mirror_nf_lock);
+        memcpy(mirror_nfs[service_id], nfs, count * sizeof(struct onvm_zk_nf_stat));
+        mirror_nf_count[service_id] = count;
+        rte_spinlock_unlock(&mirror_nf_lock);
+
+        return ret;
+}
+
+/*
+ * Build the remote manager list for a service from the mirror and swap it
+ * in if it changed.
+ */
+static void
+onvm_zk_resolver_publish(uint16_t service_id) {
+        struct onvm_zk_remote_service *svc;
+        struct onvm_zk_remote_service *old;
+        struct onvm_zk_remote_mgr *mgr;
+        int64_t manager_id;
+        uint16_t nfs;
+        int i, j;
+
+        svc = rte_zmalloc("onvm_zk_remote_service", sizeof(struct onvm_zk_remote_service), 0);
+        if (svc == NULL) {
+                RTE_LOG(INFO, ZK, "Cannot allocate remote service %u\n", service_id);
+                return;
+        }
+
+        for (i = 0; i < mirror_services[service_id].count; i++) {
+                manager_id = mirror_services[service_id].manager_id[i];
+                if (manager_id == resolver_local_id) continue;
+
+                // Skip managers we have no address for (yet)
+                for (j = 0; j < mirror_mgr_count; j++) {
+                        if (mirror_mgrs[j].manager_id == manager_id) {
+                                svc->mgr[svc->count++] = mirror_mgrs[j];
+                                break;
+                        }
+                }
+        }
+
+        // Load of each manager from the stats its instances publish.
+        // Only this thread writes the NF mirror, so no need for the lock
+        for (i = 0; i < svc->count; i++) {
+                mgr = &svc->mgr[i];
+                mgr->rx_use = 0;
+                nfs = 0;
+                for (j = 0; j < mirror_nf_count[service_id]; j++) {
+                        if (mirror_nfs[service_id][j].manager_id == mgr->manager_id) {
+                                mgr->rx_use += mirror_nfs[service_id][j].rx_use;
+                                nfs++;
+                        }
+                }
+                if (nfs > 0)
+                        mgr->rx_use /= nfs;
+        }
+
+        old = remote_services[service_id];
+        if (old != NULL) {
+                svc->version = old->version;
+                if (memcmp(old, svc, sizeof(struct onvm_zk_remote_service)) == 0) {
+                        rte_free(svc);
+                        return;
+                }
+        }
+        svc->version = ++remote_services_version;
+
+        // The snapshot must be fully written before the packet threads can see it
+        rte_smp_wmb();
+        remote_services[service_id] = svc;
+
+        if (old != NULL)
+                onvm_zk_resolver_retire(old);
+}
+
+static void
+onvm_zk_resolver_retire(struct onvm_zk_remote_service *svc) {
+        if (retired_count == MAX_SERVICES)
+                onvm_zk_resolver_reclaim();
+        retired[retired_count++] = svc;
+}
+
+/*
+ * Wait until no packet thread can hold a retired snapshot, then free them
+ */
+static void
+onvm_zk_resolver_reclaim(void) {
+        uint16_t i;
+
+        if (retired_count == 0) return;
+
+        onvm_qsbr_synchronize(mgr_qsbr);
+        for (i = 0; i < retired_count; i++) {
+                rte_free(retired[i]);
+        }
+        retired_count = 0;
+}
+
+/*
+ * Evict flows that have been idle for a while. Only a few entries are
+ * examined per call so a full table does not stall the packet thread.
+ */
+static void
+onvm_zk_flow_table_sweep(struct onvm_zk_flow_table *flows) {
+        struct onvm_zk_remote_flow *flow;
+        const void *key;
+        void *data;
+        uint64_t idle;
+        uint64_t now;
+        int32_t index;
+        int i;
+
+        now = rte_rdtsc();
+        idle = ZK_REMOTE_FLOW_IDLE_SEC * rte_get_tsc_hz();
+        for (i = 0; i < ZK_REMOTE_FLOW_SWEEP; i++) {
+                index = onvm_ft_iterate(flows->ft, &key, &data, &flows->sweep_next);
+                if (index < 0) {
+                        flows->sweep_next = 0;
+                        continue;
+                }
+
+                flow = (struct onvm_zk_remote_flow *)onvm_ft_get_data(flows->ft, index);
+                if (now - flow->last_used > idle)
+                        onvm_ft_remove_key(flows->ft, (struct onvm_ft_ipv4_5tuple *)key);
+        }
+}
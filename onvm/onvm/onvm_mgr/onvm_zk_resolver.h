@@ -0,0 +1,170 @@
+/*********************************************************************
+ *                     openNetVM
+ *              https://sdnfv.github.io
+ *
+ *   BSD LICENSE
+ *
+ *   Copyright(c)
+ *            2015-2016 George Washington University
+ *            2015-2016 University of California Riverside
+ *            2010-2014 Intel Corporation. All rights reserved.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ********************************************************************/
+
+
+/******************************************************************************
+
+                              onvm_zk_resolver.h
+
+    Header file for the in-memory mirror of the ZooKeeper tree used to
+    resolve remote services without blocking the packet path
+
+
+******************************************************************************/
+
+#ifndef ONVM_ZK_RESOLVER_H_
+#define ONVM_ZK_RESOLVER_H_
+
+#include <inttypes.h>
+#include <time.h>
+#include <rte_ether.h>
+#include <rte_mbuf.h>
+#include <zookeeper/zookeeper.h>
+
+#include "../onvm_nflib/onvm_common.h"
+#include "onvm_vxlan.h"
+
+#define ZK_RESOLVER_MAX_MGRS 16         // Managers kept in the mirror
+#define ZK_RESOLVER_MAX_NFS (ZK_RESOLVER_MAX_MGRS * MAX_CLIENTS_PER_SERVICE) // NF stat nodes kept per service
+#define ZK_RESOLVER_RING_NAME "ZK_Resolver_Ring"
+#define ZK_RESOLVER_RING_SIZE 256       // Must be a power of 2 and > 2 * MAX_SERVICES + 1
+#define ZK_RESOLVER_IDLE_US 1000        // Sleep when there are no watch events to handle
+#define ZK_RESOLVER_DATA_LEN 512        // Largest node we read
+
+#define ZK_REMOTE_FLOW_ENTRIES 4096     // Flows pinned to a remote manager, per packet thread
+#define ZK_REMOTE_FLOW_IDLE_SEC 30      // Flows idle this long may be evicted when the table is full
+#define ZK_REMOTE_FLOW_SWEEP 64         // Entries examined per eviction pass
+
+struct onvm_zk_remote_mgr {
+        int64_t manager_id;
+        struct ether_addr mac;
+        uint32_t ip;                    // Tunnel IP, network order
+        float rx_use;                   // Average RX ring use of its instances of the service
+        struct onvm_vxlan_hdr hdr;      // Outer headers from our tunnel port to this manager
+};
+
+/*
+ * Snapshot of where a service runs remotely. Snapshots are never modified
+ * after they are published, the resolver builds a new one and swaps the
+ * pointer. A count of 0 means the service is not running remotely.
+ */
+struct onvm_zk_remote_service {
+        uint64_t version;               // Changes every time a snapshot is published
+        uint16_t count;
+        struct onvm_zk_remote_mgr mgr[ZK_RESOLVER_MAX_MGRS];
+};
+
+/* Remote manager a flow is pinned to. The index into the snapshot is
+ * only trusted while the snapshot version has not changed. */
+struct onvm_zk_remote_flow {
+        int64_t manager_id;
+        uint64_t version;
+        uint64_t last_used;             // TSC of the last packet
+        uint16_t service_id;
+        uint16_t index;
+};
+
+/* Per packet thread flow table, so it needs no locking */
+struct onvm_zk_flow_table {
+        struct onvm_ft *ft;
+        uint32_t sweep_next;            // Where the last eviction pass stopped
+};
+
+/* Mirror of one /nf/<service>/<nf> stat node */
+struct onvm_zk_nf_stat {
+        int64_t manager_id;
+        double rx_use;
+        int free_cores;
+};
+
+/**
+ * Start the resolver thread and load the mirror
+ * PARAM zh: connected ZooKeeper handle, only used by the resolver thread
+ * PARAM local_id: this manager's id, excluded from lookups
+ * PARAM tunnel_port: the NIC port packets to other managers leave from
+ * RETURNS: 0 on success, -1 on failure
+ */
+int onvm_zk_resolver_start(zhandle_t *zh, int64_t local_id, uint8_t tunnel_port);
+
+/**
+ * Stop the resolver thread and free the mirror
+ * Must be called after the packet threads are done with lookups
+ */
+void onvm_zk_resolver_stop(void);
+
+/**
+ * Called from the ZooKeeper watcher when a watched node changes
+ * Only queues work for the resolver thread, so it is safe to call from
+ * the ZooKeeper completion thread
+ * PARAM path: the node that changed, or NULL to reload everything
+ */
+void onvm_zk_resolver_notify(const char *path);
+
+/**
+ * Allocate a flow table for one packet thread
+ * RETURNS: the table, or NULL on failure
+ */
+struct onvm_zk_flow_table *onvm_zk_flow_table_create(void);
+
+/**
+ * Look up where to send a packet for a service that is not running locally
+ * New flows are spread over the remote managers running the service and
+ * then stay on the same manager for as long as it runs the service
+ * Reads the mirror only and never blocks
+ * Must be called from a thread registered with the manager's QSBR
+ * PARAM flows: the calling thread's flow table, or NULL to pick per packet
+ * PARAM hdr: set to the outer header template for the chosen manager, only
+ *            valid until the thread's next quiescent state
+ * RETURNS: the manager ID to send this packet to, or 0 if nowhere to go
+ */
+int64_t onvm_zk_resolver_lookup(struct onvm_zk_flow_table *flows, struct rte_mbuf *pkt, uint16_t service_id, const struct onvm_vxlan_hdr **hdr);
+
+/**
+ * Copy the mirrored NF stats for a service
+ * RETURNS: the number of entries copied into stats, at most max
+ */
+uint16_t onvm_zk_resolver_nf_stats(uint16_t service_id, struct onvm_zk_nf_stat *stats, uint16_t max);
+
+/**
+ * RETURNS: the last time a service was started or stopped anywhere, 0 if unknown
+ */
+time_t onvm_zk_resolver_last_modified(uint16_t service_id);
+
+#endif
@@ -52,15 +52,32 @@
 #include <zookeeper/proto.h>
 #include <zookeeper/zookeeper.h>
 
+#include <rte_log.h>
+
 #include "onvm_zk_common.h"
+#include "onvm_zk_resolver.h"
 #include "onvm_zk_watch.h"
 
 void
 onvm_zk_watcher(zhandle_t *zzh, int type, int state, const char *path, void* context) {
-        // Don't need to do anything here for now
         (void)(zzh);
-        (void)(type);
-        (void)(state);
-        (void)(path);
         (void)(context);
+
+        /* This runs on the ZooKeeper completion thread, so only queue work
+         * for the resolver here. A synchronous zoo_* call would deadlock. */
+        if (type == ZOO_SESSION_EVENT) {
+                if (state == ZOO_CONNECTED_STATE) {
+                        /* Watches are restored on reconnect, but reads that
+                         * failed while disconnected never set theirs */
+                        onvm_zk_resolver_notify(NULL);
+                } else if (state == ZOO_EXPIRED_SESSION_STATE) {
+                        RTE_LOG(INFO, ZK, "ZooKeeper session expired, remote services will not be updated\n");
+                }
+                return;
+        }
+
+        if (type == ZOO_CHILD_EVENT || type == ZOO_CHANGED_EVENT ||
+            type == ZOO_CREATED_EVENT || type == ZOO_DELETED_EVENT) {
+                onvm_zk_resolver_notify(path);
+        }
 }
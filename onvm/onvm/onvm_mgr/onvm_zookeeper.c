@@ -50,6 +50,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <arpa/inet.h>
 #include <time.h>
 #include <unistd.h>
 #include <rte_log.h>
@@ -60,32 +61,33 @@
 #include "onvm_nf.h"
 #include "onvm_zookeeper.h"
 #include "onvm_zk_common.h"
+#include "onvm_zk_resolver.h"
 #include "onvm_zk_watch.h"
 #include "zoo_queue.h"
 
-#define EXPIRATION_CACHE_LEN 10
-#define MAC_STR_LEN 18
-
 // Handle to our zookeeper connection
 static zhandle_t *zh = NULL;
 static const clientid_t *myid = NULL;
 static char *nf_stat_paths[MAX_CLIENTS];
 
-// Cache of remote MAC addresses
-struct remote_service_result {
-        char mac_address[MAC_STR_LEN];
-        time_t expiration;
-};
-static struct remote_service_result service_lookup_cache[MAX_SERVICES];
+// NF stats queued for the next multi op. They stay untouched until the
+// completion runs, so one publish can be outstanding at a time
+static zoo_op_t stat_ops[MAX_CLIENTS];
+static zoo_op_result_t stat_results[MAX_CLIENTS];
+static char stat_data[MAX_CLIENTS][NF_STAT_LEN];
+static int stat_count = 0;
+static volatile uint8_t stat_in_flight = 0;
+
+// When we last scaled each service. The resolver's mirror only sees our
+// own updates once the watch fires, which is too late for the hold-off
+static time_t last_scaled[MAX_SERVICES];
 
-static time_t get_service_last_modified(uint16_t service_id);
 static uint16_t can_scale_locally(uint16_t service_id);
 static int64_t can_scale_remotely(uint16_t service_id);
 static int enqueue_remote_scale_msg(int64_t manager_id, uint16_t service_id);
 
 static inline int update_service_last_modified(uint16_t service_id);
-static inline int mac_string_to_struct(const char *data, struct ether_addr *addr);
-static inline void free_String_vector(struct String_vector *v);
+static void publish_nf_stats_completion(int rc, const void *data);
 
 int
 onvm_zk_connect(int mode) {
@@ -114,10 +116,12 @@ onvm_zk_client_id(void) {
 }
 
 int
-onvm_zk_init(const char *port_addr) {
+onvm_zk_init(const char *port_addr, uint32_t tunnel_addr) {
         int64_t zk_id;
         size_t addr_len;
         char path_buf[128];
+        char data_buf[64];
+        char ip_buf[INET_ADDRSTRLEN];
         int ret;
 
         if (!zh) return ZINVALIDSTATE;
@@ -139,8 +143,10 @@ onvm_zk_init(const char *port_addr) {
         // Create an ephemeral node for this instance
         // We won't have to clean this up, since it'll go away when the manager exits
         sprintf(path_buf, MGR_NODE_FMT, zk_id);
-        addr_len = strlen(port_addr);
-        ret = zoo_create(zh, path_buf, port_addr, addr_len, &ZOO_OPEN_ACL_UNSAFE, ZOO_EPHEMERAL, NULL, 0);
+        inet_ntop(AF_INET, &tunnel_addr, ip_buf, sizeof(ip_buf));
+        snprintf(data_buf, sizeof(data_buf), MGR_DATA_FMT, port_addr, ip_buf);
+        addr_len = strlen(data_buf);
+        ret = zoo_create(zh, path_buf, data_buf, addr_len, &ZOO_OPEN_ACL_UNSAFE, ZOO_EPHEMERAL, NULL, 0);
 
         // Ensure the global queue base node exists
         ret = onvm_zk_create_if_not_exists(zh, SCALE_QUEUE_BASE, "", 0, 0, NULL, 0);
@@ -148,8 +154,10 @@ onvm_zk_init(const char *port_addr) {
                 return ret;
         }
 
-        // Set up the remote lookup cache
-        memset(service_lookup_cache, 0, MAX_SERVICES * sizeof(struct remote_service_result));
+        // Remote services are resolved off the packet path
+        if (onvm_zk_resolver_start(zh, zk_id, ports->id[0]) != 0) {
+                return ZSYSTEMERROR;
+        }
 
         return ret;
 }
@@ -188,16 +196,15 @@ onvm_zk_nf_start(uint16_t service_id, uint16_t service_count, uint16_t instance_
 
         // And now for this NF's stats
         sprintf(path_buf, NF_INSTANCE_FMT, service_id);
-        sprintf(data_buf, NF_STAT_FMT, 0.0); // the ring starts at 0% used
+        sprintf(data_buf, NF_STAT_FMT, 0.0, (uint16_t)0); // the ring starts at 0% used
         ret = onvm_zk_create_if_not_exists(zh, path_buf, data_buf, strlen(data_buf), ZOO_SEQUENCE|ZOO_EPHEMERAL, res_path_buf, sizeof(res_path_buf) - 1);
         if (ret != ZOK) {
                 return ret;
         }
-        nf_stat_paths[instance_id] = malloc(strlen(res_path_buf));
+        nf_stat_paths[instance_id] = strdup(res_path_buf);
         if (!nf_stat_paths[instance_id]) {
                 return ZINVALIDSTATE;
         }
-        strncpy(nf_stat_paths[instance_id], res_path_buf, strlen(res_path_buf));
         printf("Created stat node (%s): %s\n", zk_status_to_string(ret), nf_stat_paths[instance_id]);
 
         // Create a node for this (service + manager) pair, if needed, else updadte the value
@@ -237,6 +244,7 @@ onvm_zk_nf_stop(uint16_t service_id, uint16_t service_count, uint16_t instance_i
         // Delete the NF's stats node
         ret = zoo_delete(zh, nf_stat_paths[instance_id], -1);
         free(nf_stat_paths[instance_id]);
+        nf_stat_paths[instance_id] = NULL;
 
         return ret;
 }
@@ -244,104 +252,47 @@ onvm_zk_nf_stop(uint16_t service_id, uint16_t service_count, uint16_t instance_i
 void
 onvm_zk_disconnect(void) {
         if (!zh) return;
+        onvm_zk_resolver_stop();
         zookeeper_close(zh);
         myid = NULL;
 }
 
 int64_t
-onvm_zk_lookup_service(struct rte_mbuf *pkt, uint16_t service_id, struct ether_addr *dst) {
-        char path_buf[128];
-        char data_buf[MAC_STR_LEN + 1];
-        struct String_vector children;
-        struct Stat stat;
-        time_t now;
-        int ret;
-        int data_len;
-        int64_t result;
-        int chosen_instance_index;
-
+onvm_zk_lookup_service(struct onvm_zk_flow_table *flows, struct rte_mbuf *pkt, uint16_t service_id, const struct onvm_vxlan_hdr **hdr) {
         if (!zh) return 0;
-
-        /* First, check our cache */
-        now = time(NULL);
-        if (now <= service_lookup_cache[service_id].expiration) {
-                return mac_string_to_struct(service_lookup_cache[service_id].mac_address, dst)
-                        ? -1
-                        : 0;
-        }
-
-        sprintf(path_buf, SERVICE_NODE_FMT, service_id);
-        ret = zoo_get_children2(zh, path_buf, 0, &children, &stat);
-        if (ret != ZOK || stat.numChildren == 0) {
-                return 0;
-        }
-
-        // Assume this service is not running locally so just take the first
-        chosen_instance_index = pkt->hash.rss % children.count;
-        sprintf(path_buf, MGR_NODE_STR_FMT, children.data[chosen_instance_index]);
-        data_len = sizeof(data_buf) / sizeof(char);
-        ret = zoo_get(zh, path_buf, 0, data_buf, &data_len, &stat);
-        if (ret != ZOK || (data_len == 0 && stat.dataLength == 0)) {
-                printf("Can't get dest @ %s (%s)\n", path_buf, zk_status_to_string(ret));
-                result = 0;
-                goto lookup_done;
-        }
-        data_buf[data_len] = '\0';
-
-        /* Cache the resulting MAC address */
-        // TODO should use the flow table, this may vary per-flow
-        strncpy(service_lookup_cache[service_id].mac_address, data_buf, MAC_STR_LEN);
-        service_lookup_cache[service_id].expiration = now + EXPIRATION_CACHE_LEN;
-
-        result = mac_string_to_struct(data_buf, dst)
-                ? stat.ephemeralOwner
-                : 0;
-lookup_done:
-        free_String_vector(&children);
-        return result;
+        return onvm_zk_resolver_lookup(flows, pkt, service_id, hdr);
 }
 
 int
-onvm_zk_update_nf_stats(uint16_t service_id, uint16_t instance_id, cJSON *stats_json) {
-        char *json_string = NULL;
-        double rx_use;
+onvm_zk_update_nf_stats(uint16_t service_id, uint16_t instance_id, double rx_use, uint16_t free_cores) {
         time_t last_update;
         time_t now;
         uint16_t local_instance;
         int64_t remote_instance;
-        cJSON *rx_use_json;
         int ret;
 
         if (!zh || !nf_stat_paths[instance_id]) return ZINVALIDSTATE;
 
-        ret = zoo_exists(zh, nf_stat_paths[instance_id], 0, NULL);
-        if (ret != ZOK) goto done;
-
-        /* Build a JSON String of the stat data */
-        json_string = cJSON_Print(stats_json);
-        if (!json_string) return ZBADARGUMENTS;
-
-        /* Update the state values in ZooKeeper */
-        ret = zoo_set(zh, nf_stat_paths[instance_id], json_string, strlen(json_string), -1);
-        if (ret != ZOK) goto done;
+        /* Queue the stats, unless the last batch is still being sent */
+        if (!stat_in_flight && stat_count < MAX_CLIENTS) {
+                snprintf(stat_data[stat_count], NF_STAT_LEN, NF_STAT_FMT, rx_use, free_cores);
+                zoo_set_op_init(&stat_ops[stat_count], nf_stat_paths[instance_id],
+                                stat_data[stat_count], strlen(stat_data[stat_count]), -1, NULL);
+                stat_count++;
+        }
 
         /* Make scheduling decisions */
-        rx_use_json = cJSON_GetObjectItem(stats_json, "RX Use");
-        if (!rx_use_json) {
-                RTE_LOG(INFO, APP, "Can't get RX Use from JSON\n");
-                goto done;
-        }
-        rx_use = rx_use_json->valuedouble;
+        ret = ZOK;
         now = time(NULL);
-        last_update = get_service_last_modified(service_id);
-        printf("Instance %u RX use: %f\n", instance_id, rx_use);
+        last_update = onvm_zk_resolver_last_modified(service_id);
+        if (last_scaled[service_id] > last_update)
+                last_update = last_scaled[service_id];
 
         /* Only scale if the RX Queue is saturated */
-        if (rx_use < SCALE_RX_USE_MAX) goto done;
+        if (rx_use < SCALE_RX_USE_MAX) return ret;
 
         /* Do not start or stop an instance within 30 seconds of the last action */
-        printf("Now %lu, timeout %lu\n", (unsigned long)now, (unsigned long)(last_update + SCALE_TIMEOUT_SEC));
-        if (now < last_update + SCALE_TIMEOUT_SEC) goto done;
+        if (now < last_update + SCALE_TIMEOUT_SEC) return ret;
 
         /* We want to start instances on the same machine, where we can */
         local_instance = can_scale_locally(service_id);
@@ -349,18 +300,34 @@ onvm_zk_update_nf_stats(uint16_t service_id, uint16_t instance_id, cJSON *stats_
                 /* Send scale message to local instance */
                 ret = onvm_nf_send_msg(local_instance, MSG_SCALE, NULL);
                 if (ret != 0) RTE_LOG(INFO, APP, "Unable to tell NF %u to scale: %d\n", local_instance, ret);
-                else update_service_last_modified(service_id);
-                goto done;
+                else {
+                        last_scaled[service_id] = now;
+                        update_service_last_modified(service_id);
+                }
+                return ret;
         }
 
         remote_instance = can_scale_remotely(service_id);
         if (remote_instance != 0) {
-                enqueue_remote_scale_msg(remote_instance, service_id);
-                goto done;
+                ret = enqueue_remote_scale_msg(remote_instance, service_id);
+                if (ret == ZOK) last_scaled[service_id] = now;
         }
 
-done:
-        if (json_string) free((void*)json_string);
+        return ret;
+}
+
+int
+onvm_zk_publish_nf_stats(void) {
+        int ret;
+
+        if (!zh || stat_in_flight || stat_count == 0) return ZOK;
+
+        stat_in_flight = 1;
+        ret = zoo_amulti(zh, stat_count, stat_ops, stat_results, publish_nf_stats_completion, NULL);
+        if (ret != ZOK) {
+                stat_in_flight = 0;
+                stat_count = 0;
+        }
         return ret;
 }
 
@@ -381,29 +348,18 @@ update_service_last_modified(uint16_t service_id) {
         return onvm_zk_create_or_update(zh, path_buf, data_buf, len, 0);
 }
 
-static time_t
-get_service_last_modified(uint16_t service_id) {
-        char path_buf[32];
-        char data_buf[32];
-        struct Stat stat;
-        time_t last_time;
-        int data_len;
-        int ret;
-
-        if (!zh) return 0;
-
-        sprintf(path_buf, SERVICE_NODE_FMT, service_id);
-        data_len = sizeof(data_buf) / sizeof(char);
-        ret = zoo_get(zh, path_buf, 0, data_buf, &data_len, &stat);
-        if (ret != ZOK || data_len <= 0) {
-                printf("Can't get last modified for service %s: %s, len: %d\n", path_buf, zk_status_to_string(ret), data_len);
-                return 0;
+/*
+ * Runs on the ZooKeeper completion thread once the stats multi op is done
+ */
+static void
+publish_nf_stats_completion(int rc, const void *data) {
+        (void)(data);
+        if (rc != ZOK) {
+                RTE_LOG(INFO, APP, "ERROR updating ZK stats: %s\n", zk_status_to_string(rc));
         }
-
-        data_buf[data_len] = '\0';
-        printf("Last modified %s: %s (%d)\n", path_buf, data_buf, data_len);
-        last_time = (time_t) strtoul(data_buf, NULL, 10);
-        return last_time;
+        stat_count = 0;
+        rte_smp_wmb();
+        stat_in_flight = 0;
 }
 
 static uint16_t
@@ -441,80 +397,21 @@ enqueue_remote_scale_msg(int64_t manager_id, uint16_t service_id) {
 
 static int64_t
 can_scale_remotely(uint16_t service_id) {
-        struct String_vector children;
-        struct Stat stat;
-        char path_buf[128];
-        char data_buf[128];
-        cJSON *stat_data;
-        cJSON *headroom_data;
+        struct onvm_zk_nf_stat stats[ZK_RESOLVER_MAX_NFS];
         int64_t best_instance;
-        int data_len;
         int best_headroom;
-        int headroom;
-        int ret;
-        int i;
-
-        if (!zh) return 0;
+        uint16_t count;
+        uint16_t i;
 
-        sprintf(path_buf, NF_SERVICE_BASE, service_id);
-        ret = zoo_get_children2(zh, path_buf, 0, &children, &stat);
-        if (ret != ZOK || stat.numChildren == 0) return 0;
-
-        sprintf(path_buf, MGR_NODE_STR_FMT, children.data[0]);
+        count = onvm_zk_resolver_nf_stats(service_id, stats, ZK_RESOLVER_MAX_NFS);
         best_instance = 0;
         best_headroom = 0;
-        for (i = 0; i < children.count; i++) {
-                sprintf(path_buf, NF_STAT_CHILD_FMT, service_id, children.data[i]);
-                data_len = sizeof(data_buf) / sizeof(char);
-                ret = zoo_get(zh, path_buf, 0, data_buf, &data_len, &stat);
-                if (ret != ZOK || data_len == 0) continue;
-
-                stat_data = cJSON_Parse(data_buf);
-                headroom_data = cJSON_GetObjectItem(stat_data, "Free Cores");
-                if (!headroom_data) continue;
-                headroom = headroom_data->valuedouble;
-                if (headroom > best_headroom) {
-                        best_headroom = headroom;
-                        best_instance = stat.ephemeralOwner;
+        for (i = 0; i < count; i++) {
+                if (stats[i].free_cores > best_headroom) {
+                        best_headroom = stats[i].free_cores;
+                        best_instance = stats[i].manager_id;
                 }
-                cJSON_Delete(stat_data);
         }
 
-        free_String_vector(&children);
         return best_instance;
 }
-
-static inline int
-mac_string_to_struct(const char *data, struct ether_addr *addr) {
-        unsigned int temp[ETHER_ADDR_LEN];
-        int bytes_found;
-        int i;
-
-        bytes_found = sscanf(data, MAC_ADDR_FMT,
-                &temp[0],
-                &temp[1],
-                &temp[2],
-                &temp[3],
-                &temp[4],
-                &temp[5]);
-        if (bytes_found != ETHER_ADDR_LEN) {
-                return 0;
-        }
-
-        for (i = 0; i < ETHER_ADDR_LEN; i++) {
-                addr->addr_bytes[i] = (uint8_t) temp[i];
-        }
-        return ETHER_ADDR_LEN;
-}
-
-static inline void
-free_String_vector(struct String_vector *v) {
-    if (v->data) {
-        int32_t i;
-        for (i=0; i<v->count; i++) {
-            free(v->data[i]);
-        }
-        free(v->data);
-        v->data = 0;
-    }
-}
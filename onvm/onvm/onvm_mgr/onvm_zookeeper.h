@@ -58,6 +58,7 @@
 #include "cJSON.h"
 #include "onvm_init.h"
 #include "onvm_nf.h"
+#include "onvm_zk_resolver.h"
 
 #define ZK_CONNECT_ASYNC 0
 #define ZK_CONNECT_BLOCKING 1
@@ -65,6 +66,7 @@
 #define MGR_NODE_BASE "/manager"
 #define MGR_NODE_FMT "/manager/%" PRId64
 #define MGR_NODE_STR_FMT "/manager/%s"
+#define MGR_DATA_FMT "%s %s" // Format with MAC address and tunnel IP
 
 #define SERVICE_NODE_BASE "/service"
 #define SERVICE_NODE_FMT SERVICE_NODE_BASE "/%" PRIu16 // Format with service ID
@@ -75,13 +77,13 @@
 #define NF_SERVICE_BASE NF_NODE_BASE "/%" PRIu16 // format with service id
 #define NF_STAT_CHILD_FMT "/nf/%" PRIu16 "/%s" // Format with service ID and child path
 #define NF_INSTANCE_FMT NF_SERVICE_BASE "/nf" // format with service id and ZOO_SEQUENCE when creating
-#define NF_STAT_FMT "%.5f" // Format with percentage of the ring in use
+#define NF_STAT_FMT "%.5f %" PRIu16 // Format with percentage of the ring in use and free cores
+#define NF_STAT_LEN 32
 #define ZK_STAT_UPDATE_FREQ 5 // Update every X times the stats loop is called
 #define SCALE_QUEUE_BASE "/scale"
 #define SCALE_QUEUE_FMT SCALE_QUEUE_BASE "/%" PRId64  // format with manager id
 #define SCALE_DATA_FMT "%"PRIu16
 
-#define MAC_ADDR_FMT "%x:%x:%x:%x:%x:%x"
 #define SCALE_RX_USE_MAX 0.70
 #define SCALE_TIMEOUT_SEC 10
 
@@ -104,8 +106,9 @@ int64_t onvm_zk_client_id(void);
  * Initialize this manager's connection to ZooKeeper
  * Creates an ephemeral node for this manager instance
  * PARAM: MAC address for other instances to send packets here
+ * PARAM: IP address (network order) other instances tunnel packets to
  */
-int onvm_zk_init(const char *port_addr);
+int onvm_zk_init(const char *port_addr, uint32_t tunnel_addr);
 
 /**
  * When a new NF starts, update the stat in ZooKeeper
@@ -127,14 +130,27 @@ void onvm_zk_disconnect(void);
 
 /**
  * Look up and see if this service is running somewhere else
+ * Answers from the resolver's cache and never waits on ZooKeeper
+ * PARAM: the calling thread's remote flow table, flows stay on one manager
+ * PARAM: the packet to send
  * PARAM: the service ID to lookup
+ * PARAM: set to the outer headers to encapsulate the packet with
  * RETURNS: the manager ID to send this packet to, or 0 if nowhere to go
  */
-int64_t onvm_zk_lookup_service(struct rte_mbuf *pkt, uint16_t service_id, struct ether_addr *dst);
+int64_t onvm_zk_lookup_service(struct onvm_zk_flow_table *flows, struct rte_mbuf *pkt, uint16_t service_id, const struct onvm_vxlan_hdr **hdr);
 
 /**
- * Update the stats for this NF. Store the json stats we generate in ZK for all managers
+ * Update the stats for this NF and make scaling decisions for its service
+ * The stats are queued for the next onvm_zk_publish_nf_stats, this does not wait on ZK
+ * PARAM: rx_use is the fraction of the NF's RX ring in use
+ * PARAM: free_cores is the NF's headroom
  */
-int onvm_zk_update_nf_stats(uint16_t service_id, uint16_t instance_id, cJSON *stats_json);
+int onvm_zk_update_nf_stats(uint16_t service_id, uint16_t instance_id, double rx_use, uint16_t free_cores);
+
+/**
+ * Publish the queued NF stats to ZK for all managers with a single asynchronous multi op
+ * Nothing is sent while the previous publish is still in flight
+ */
+int onvm_zk_publish_nf_stats(void);
 
 #endif
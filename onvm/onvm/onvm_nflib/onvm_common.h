@@ -44,6 +44,8 @@
 
 #include <rte_mbuf.h>
 #include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include "onvm_msg_common.h"
 
@@ -83,24 +85,90 @@ static inline uint8_t onvm_get_pkt_chain_index(struct rte_mbuf* pkt) {
 }
 
 /*
- * Define a structure with stats from the clients.
+ * Kept in the private area of every mbuf of the manager's pool, right after
+ * the rte_mbuf. Only written when latency tracking (-L) is on. Packets an NF
+ * allocates itself carry whatever the previous user of the mbuf left here.
+ */
+struct onvm_pkt_priv {
+        uint64_t rx_tsc;        /* when the manager received the packet */
+        uint64_t hop_tsc;       /* when the previous hop was done with it */
+};
+
+static inline struct onvm_pkt_priv* onvm_get_pkt_priv(struct rte_mbuf* pkt) {
+        return (struct onvm_pkt_priv*)(pkt + 1);
+}
+
+/*
+ * Stats one client keeps about the packets it hands back. The memzone holds
+ * one block per client, each on its own cache line(s), and only that client
+ * writes it, so NFs never invalidate each other's lines.
  */
 struct client_tx_stats {
         /* these stats hold how many packets the manager will actually receive,
          * and how many packets were dropped because the manager's queue was full.
          */
-        uint64_t tx[MAX_CLIENTS];
-        uint64_t tx_drop[MAX_CLIENTS];
-        uint64_t tx_buffer[MAX_CLIENTS];
-        uint64_t tx_returned[MAX_CLIENTS];
-        /* FIXME: Why are these stats kept separately from the rest?
-         * Would it be better to have an array of struct client_tx_stats instead
-         * of putting the array inside the struct? How can we avoid cache
-         * invalidations from different NFs updating these stats?
-         */
+        uint64_t tx;
+        uint64_t tx_drop;
+        uint64_t tx_buffer;
+        uint64_t tx_returned;
+        /* packets handed straight to the next NF, bypassing the manager */
+        uint64_t tx_direct;
+        /* packets sent out on the NF's own NIC TX queue, by port */
+        uint64_t port_tx[RTE_MAX_ETHPORTS];
+        uint64_t port_tx_drop[RTE_MAX_ETHPORTS];
+} __rte_cache_aligned;
+
+/* MAX_CLIENTS blocks, indexed by instance id */
+extern struct client_tx_stats *clients_stats;
+
+/*
+ * Shared port info, put in a memzone so NFs transmitting themselves can
+ * find the ports and their TX queues. It is read-only during operation;
+ * the port statistics are kept by each thread or NF sending or receiving,
+ * see struct thread_stats and struct client_tx_stats.
+ */
+struct port_info {
+        uint8_t num_ports;
+        uint8_t id[RTE_MAX_ETHPORTS];
+        /* NIC TX queues 0..nf_tx_queues-1 of every port are left for NFs
+         * that transmit themselves (NF N uses queue N), 0 if the NICs
+         * don't have that many. The manager threads use the ones after. */
+        uint16_t nf_tx_queues;
 };
 
-extern struct client_tx_stats *clients_stats;
+/*
+ * Service to NF instance map. Only the manager writes it; NFs read it to
+ * hand packets for a local service straight to the next NF. seq is odd
+ * while the manager is changing the map.
+ */
+struct onvm_service_map {
+        volatile uint32_t seq;
+        uint16_t count[MAX_SERVICES];
+        uint16_t nf[MAX_SERVICES][MAX_CLIENTS_PER_SERVICE];
+};
+
+/*
+ * Picks the local NF instance of a service for a packet hash, 0 if the
+ * service has no local instance.
+ */
+static inline uint16_t
+onvm_service_map_lookup(const struct onvm_service_map *map, uint16_t service_id, uint32_t hash) {
+        uint32_t seq;
+        uint16_t count, instance_id;
+
+        if (service_id >= MAX_SERVICES)
+                return 0;
+
+        do {
+                seq = map->seq;
+                rte_smp_rmb();
+                count = map->count[service_id];
+                instance_id = count == 0 ? 0 : map->nf[service_id][hash % count];
+                rte_smp_rmb();
+        } while ((seq & 1) || seq != map->seq);
+
+        return instance_id;
+}
 
 /* Function prototype for NF packet handlers */
 typedef int(*pkt_handler)(struct rte_mbuf* pkt, struct onvm_pkt_meta* meta);
@@ -129,6 +197,13 @@ struct onvm_nf_info {
 
         // Pointer to the NF's packet handler function, if in single packet mode
         pkt_handler nf_pkt_function;
+
+        // QSBR reader slot held while in onvm_nflib_run, see onvm_qsbr.h
+        int qsbr_id;
+
+        // So the manager notices the NF dying without stopping, see onvm_pid_ns
+        pid_t pid;
+        uint64_t pid_ns;
 };
 
 /*
@@ -153,12 +228,18 @@ struct onvm_service_chain {
 #define MZ_CLIENT_INFO "MProc_client_info"
 #define MZ_SCP_INFO "MProc_scp_info"
 #define MZ_FTP_INFO "MProc_ftp_info"
+#define MZ_QSBR_INFO "MProc_qsbr_info"
+#define MZ_SERVICE_MAP "MProc_service_map"
+#define MZ_LATENCY_INFO "MProc_latency_info"
 
 #define _MGR_MSG_QUEUE_NAME "MSG_MSG_QUEUE"
 #define _NF_MSG_QUEUE_NAME "NF_%u_MSG_QUEUE"
 #define _NF_MEMPOOL_NAME "NF_INFO_MEMPOOL"
 #define _NF_MSG_POOL_NAME "NF_MSG_MEMPOOL"
 #define _NF_STATE_MEMPOOL_NAME "NF_STATE_MEMPOOL"
+#define _FLOW_DIR_RETIRE_QUEUE_NAME "FLOW_DIR_RETIRE_QUEUE"
+#define _FLOW_DIR_CACHE_QUEUE_NAME "FLOW_DIR_CACHE_QUEUE"
+#define _FLOW_DIR_CACHE_POOL_NAME "FLOW_DIR_CACHE_POOL"
 
 /* common names for NF states */
 #define NF_WAITING_FOR_ID 0     // First step in startup process, doesn't have ID confirmed by manager yet
@@ -210,6 +291,19 @@ get_msg_queue_name(unsigned id) {
 
 }
 
+/*
+ * The pid namespace of this process, 0 if unknown. Pids only mean the same
+ * process to processes in the same namespace, NFs in containers have their own.
+ */
+static inline uint64_t
+onvm_pid_ns(void) {
+        struct stat st;
+
+        if (stat("/proc/self/ns/pid", &st) != 0)
+                return 0;
+        return st.st_ino;
+}
+
 #define RTE_LOGTYPE_APP RTE_LOGTYPE_USER1
 
 #endif  // _COMMON_H_
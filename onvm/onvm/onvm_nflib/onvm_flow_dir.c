@@ -45,33 +45,88 @@
 #include <rte_memzone.h>
 #include <rte_mbuf.h>
 #include <rte_malloc.h>
+#include <rte_ring.h>
+#include <rte_mempool.h>
 #include "onvm_common.h"
 #include "onvm_flow_table.h"
 #include "onvm_flow_dir.h"
+#include "onvm_qsbr.h"
 
 #define NO_FLAGS 0
-#define SDN_FT_ENTRIES 1024
+#define FLOW_DIR_BULK_MAX 64    // packets sorted by shard at a time, one bit each
+#define FLOW_DIR_CACHE_POOL_CACHE 32
 
-struct onvm_ft *sdn_ft;
-struct onvm_ft **sdn_ft_p;
+struct onvm_flow_dir_info *sdn_ft_info;
+static struct rte_ring *retire_queue;
+static struct onvm_qsbr *flow_dir_qsbr;
+static struct rte_ring *cache_queue;
+static struct rte_mempool *cache_pool;
+
+static int onvm_flow_dir_add_done(int ret);
+static void onvm_flow_dir_retire_entry(struct onvm_flow_entry *flow_entry);
+static void onvm_flow_dir_release_chain(struct onvm_service_chain *sc);
+static int onvm_flow_dir_get_exact(struct rte_mbuf *pkt, struct onvm_flow_entry **flow_entry);
+static int onvm_flow_dir_classify_pkt(struct rte_mbuf *pkt, int ret, struct onvm_flow_entry **flow_entry);
+static struct onvm_flow_rule *onvm_flow_dir_classify(struct onvm_ft_ipv4_5tuple *key);
+static struct onvm_flow_tuple *onvm_flow_dir_get_tuple(struct onvm_ft_ipv4_5tuple *mask, int create);
+static void onvm_flow_dir_mask_key(struct onvm_ft_ipv4_5tuple *masked, struct onvm_ft_ipv4_5tuple *key,
+                                   struct onvm_ft_ipv4_5tuple *mask);
+static void onvm_flow_dir_request_cache(struct onvm_ft_ipv4_5tuple *key);
+static void onvm_flow_dir_cache_flow(struct onvm_ft_ipv4_5tuple *key);
+static inline uint16_t onvm_flow_dir_pkt_shard(struct rte_mbuf *pkt);
+static inline struct onvm_ft *onvm_flow_dir_pkt_table(struct rte_mbuf *pkt);
+static inline struct onvm_ft *onvm_flow_dir_key_table(struct onvm_ft_ipv4_5tuple *key);
 
 int
-onvm_flow_dir_init(void)
+onvm_flow_dir_init(uint32_t entries, uint16_t shards)
 {
 	const struct rte_memzone *mz_ftp;
+        struct onvm_ft *ft;
+        uint32_t shard_entries;
+        uint16_t i;
 
-	sdn_ft = onvm_ft_create(SDN_FT_ENTRIES, sizeof(struct onvm_flow_entry));
-        if(sdn_ft == NULL) {
-                rte_exit(EXIT_FAILURE, "Unable to create flow table\n");
-        }
-        mz_ftp = rte_memzone_reserve(MZ_FTP_INFO, sizeof(struct onvm_ft *),
+        mz_ftp = rte_memzone_reserve(MZ_FTP_INFO, sizeof(struct onvm_flow_dir_info),
                                   rte_socket_id(), NO_FLAGS);
         if (mz_ftp == NULL) {
                 rte_exit(EXIT_FAILURE, "Canot reserve memory zone for flow table pointer\n");
         }
-        memset(mz_ftp->addr, 0, sizeof(struct onvm_ft *));
-        sdn_ft_p = mz_ftp->addr;
-        *sdn_ft_p = sdn_ft;
+        memset(mz_ftp->addr, 0, sizeof(struct onvm_flow_dir_info));
+        sdn_ft_info = mz_ftp->addr;
+        rte_spinlock_init(&sdn_ft_info->lock);
+
+        if (shards == 0 || shards > SDN_FT_MAX_SHARDS)
+                rte_exit(EXIT_FAILURE, "Unable to split flow table in %u shards\n", shards);
+        sdn_ft_info->num_shards = shards;
+        for (i = 0; i < SDN_FT_SHARD_BUCKETS; i++) {
+                sdn_ft_info->shard_of[i] = i % shards;
+        }
+        shard_entries = RTE_MAX(entries / shards, (uint32_t)SDN_FT_MIN_ENTRIES);
+        for (i = 0; i < shards; i++) {
+                ft = onvm_ft_create(shard_entries, sizeof(struct onvm_flow_entry));
+                if(ft == NULL) {
+                        rte_exit(EXIT_FAILURE, "Unable to create flow table\n");
+                }
+                sdn_ft_info->ft[i] = ft;
+        }
+        sdn_ft_info->shard_entries = sdn_ft_info->ft[0]->cnt;
+
+        /* Writers in any process retire, the manager's expiry thread frees */
+        retire_queue = rte_ring_create(_FLOW_DIR_RETIRE_QUEUE_NAME, SDN_FT_RETIRE_QUEUE_SIZE,
+                                       rte_socket_id(), RING_F_SC_DEQ);
+        if (retire_queue == NULL)
+                rte_exit(EXIT_FAILURE, "Cannot create flow dir retire queue\n");
+        flow_dir_qsbr = onvm_qsbr_lookup(MZ_QSBR_INFO);
+
+        /* Readers in any process ask for flows to be cached, the manager's
+         * expiry thread caches them */
+        cache_queue = rte_ring_create(_FLOW_DIR_CACHE_QUEUE_NAME, SDN_FC_CACHE_QUEUE_SIZE,
+                                      rte_socket_id(), RING_F_SC_DEQ);
+        cache_pool = rte_mempool_create(_FLOW_DIR_CACHE_POOL_NAME, SDN_FC_CACHE_QUEUE_SIZE,
+                                        sizeof(struct onvm_ft_ipv4_5tuple), FLOW_DIR_CACHE_POOL_CACHE,
+                                        0, NULL, NULL, NULL, NULL, rte_socket_id(), NO_FLAGS);
+        if (cache_queue == NULL || cache_pool == NULL)
+                rte_exit(EXIT_FAILURE, "Cannot create flow dir cache queue\n");
+        sdn_ft_info->rules_gen = 1;
 
 	return 0;
 }
@@ -80,31 +135,116 @@ int
 onvm_flow_dir_nf_init(void)
 {
 	const struct rte_memzone *mz_ftp;
-        struct onvm_ft **ftp;
 
         mz_ftp = rte_memzone_lookup(MZ_FTP_INFO);
         if (mz_ftp == NULL)
                 rte_exit(EXIT_FAILURE, "Cannot get table pointer\n");
-        ftp = mz_ftp->addr;
-        sdn_ft = *ftp;
+        sdn_ft_info = mz_ftp->addr;
+        retire_queue = rte_ring_lookup(_FLOW_DIR_RETIRE_QUEUE_NAME);
+        flow_dir_qsbr = onvm_qsbr_lookup(MZ_QSBR_INFO);
+        cache_queue = rte_ring_lookup(_FLOW_DIR_CACHE_QUEUE_NAME);
+        cache_pool = rte_mempool_lookup(_FLOW_DIR_CACHE_POOL_NAME);
 
 	return 0;
 }
 
+/* An entry cached from the rules before they last changed */
+static inline int
+onvm_flow_dir_is_stale(struct onvm_flow_entry *flow_entry){
+        return flow_entry->rule_gen != 0 && flow_entry->rule_gen != sdn_ft_info->rules_gen;
+}
+
 int
 onvm_flow_dir_get_pkt( struct rte_mbuf *pkt, struct onvm_flow_entry **flow_entry){
 	int ret;
-	ret = onvm_ft_lookup_pkt(sdn_ft, pkt, (char **)flow_entry);
+	ret = onvm_flow_dir_get_exact(pkt, flow_entry);
+        if (likely(sdn_ft_info->num_tuples == 0))
+                return ret;
+        if ((ret >= 0 && !onvm_flow_dir_is_stale(*flow_entry)) || (ret < 0 && ret != -ENOENT))
+                return ret;
 
-	return ret;
+	return onvm_flow_dir_classify_pkt(pkt, ret, flow_entry);
+}
+
+int
+onvm_flow_dir_get_pkt_bulk(struct rte_mbuf **pkts, uint16_t count, struct onvm_flow_entry **flow_entries){
+        struct rte_mbuf *group_pkts[FLOW_DIR_BULK_MAX];
+        struct onvm_flow_entry *group_entries[FLOW_DIR_BULK_MAX];
+        uint16_t shards[FLOW_DIR_BULK_MAX];
+        uint8_t group_idx[FLOW_DIR_BULK_MAX];
+        uint16_t start, n, i, j, shard;
+        uint64_t pending;
+	int ret, hit, found = 0;
+
+        if (onvm_flow_dir_num_shards() == 1) {
+                found = onvm_ft_lookup_pkt_bulk(onvm_flow_dir_table(0), pkts, count, (char **)flow_entries);
+                /* Like a failed shard below, the whole burst missed */
+                if (found < 0) {
+                        for (i = 0; i < count; i++)
+                                flow_entries[i] = NULL;
+                        found = 0;
+                }
+                goto classify;
+        }
+
+        for (start = 0; start < count; start += n) {
+                n = RTE_MIN(count - start, FLOW_DIR_BULK_MAX);
+                pending = 0;
+                for (i = 0; i < n; i++) {
+                        shards[i] = onvm_flow_dir_pkt_shard(pkts[start + i]);
+                        pending |= 1ULL << i;
+                }
+                /* Usually the whole burst came from one queue and is all in
+                 * its shard, otherwise look up one shard's packets at a time */
+                while (pending != 0) {
+                        shard = shards[__builtin_ctzll(pending)];
+                        for (i = __builtin_ctzll(pending), j = 0; i < n; i++) {
+                                if (shards[i] != shard)
+                                        continue;
+                                group_idx[j] = i;
+                                group_pkts[j++] = pkts[start + i];
+                                pending &= ~(1ULL << i);
+                        }
+                        ret = onvm_ft_lookup_pkt_bulk(onvm_flow_dir_table(shard), group_pkts, j,
+                                                      (char **)group_entries);
+                        for (i = 0; i < j; i++) {
+                                flow_entries[start + group_idx[i]] = ret < 0 ? NULL : group_entries[i];
+                        }
+                        if (ret > 0)
+                                found += ret;
+                }
+        }
+
+classify:
+        if (likely(sdn_ft_info->num_tuples == 0))
+                return found;
+        /* Flows the exact entries miss, or cached before the rules changed */
+        for (i = 0; i < count; i++) {
+                hit = flow_entries[i] != NULL;
+                if (hit && !onvm_flow_dir_is_stale(flow_entries[i]))
+                        continue;
+                ret = onvm_flow_dir_classify_pkt(pkts[i], hit ? 0 : -ENOENT, &flow_entries[i]);
+                if (ret < 0) {
+                        flow_entries[i] = NULL;
+                        found -= hit;
+                } else {
+                        found += !hit;
+                }
+        }
+
+	return found;
 }
 
 int
 onvm_flow_dir_add_pkt(struct rte_mbuf *pkt, struct onvm_flow_entry **flow_entry){
 	int ret;
-       	ret = onvm_ft_add_pkt(sdn_ft, pkt, (char**)flow_entry);
+	/* Adding returns the existing entry too, only count new flows */
+	ret = onvm_flow_dir_get_exact(pkt, flow_entry);
+	if (ret != -ENOENT)
+		return ret;
+       	ret = onvm_ft_add_pkt(onvm_flow_dir_pkt_table(pkt), pkt, (char**)flow_entry);
 
-	return ret;
+	return onvm_flow_dir_add_done(ret);
 }
 
 int
@@ -113,7 +253,7 @@ onvm_flow_dir_del_pkt(struct rte_mbuf* pkt){
 	struct onvm_flow_entry *flow_entry;
 	int ref_cnt;
 
-        ret = onvm_flow_dir_get_pkt(pkt, &flow_entry);
+        ret = onvm_flow_dir_get_exact(pkt, &flow_entry);
 	if (ret >= 0) {
 		ref_cnt = flow_entry->sc->ref_cnt--;
 		if (ref_cnt <= 0) {
@@ -129,11 +269,13 @@ onvm_flow_dir_del_and_free_pkt(struct rte_mbuf *pkt){
 	int ret;
 	struct onvm_flow_entry *flow_entry;
 
-	ret = onvm_flow_dir_get_pkt(pkt, &flow_entry);
+	ret = onvm_flow_dir_get_exact(pkt, &flow_entry);
 	if (ret >= 0) {
-		rte_free(flow_entry->sc);
-		rte_free(flow_entry->key);
-		ret = onvm_ft_remove_pkt(sdn_ft, pkt);
+		ret = onvm_ft_remove_pkt(onvm_flow_dir_pkt_table(pkt), pkt);
+		if (ret >= 0) {
+			sdn_ft_info->flows--;
+			onvm_flow_dir_retire_entry(flow_entry);
+		}
 	}
 
 	return ret;
@@ -142,7 +284,7 @@ onvm_flow_dir_del_and_free_pkt(struct rte_mbuf *pkt){
 int
 onvm_flow_dir_get_key(struct onvm_ft_ipv4_5tuple *key, struct onvm_flow_entry **flow_entry){
 	int ret;
-        ret = onvm_ft_lookup_key(sdn_ft, key, (char **)flow_entry);
+        ret = onvm_ft_lookup_key(onvm_flow_dir_key_table(key), key, (char **)flow_entry);
 
         return ret;
 }
@@ -150,9 +292,12 @@ onvm_flow_dir_get_key(struct onvm_ft_ipv4_5tuple *key, struct onvm_flow_entry **
 int
 onvm_flow_dir_add_key(struct onvm_ft_ipv4_5tuple *key, struct onvm_flow_entry **flow_entry){
         int ret;
-        ret = onvm_ft_add_key(sdn_ft, key, (char**)flow_entry);
+        ret = onvm_flow_dir_get_key(key, flow_entry);
+        if (ret != -ENOENT)
+                return ret;
+        ret = onvm_ft_add_key(onvm_flow_dir_key_table(key), key, (char**)flow_entry);
 
-        return ret;
+        return onvm_flow_dir_add_done(ret);
 }
 
 int
@@ -179,9 +324,355 @@ onvm_flow_dir_del_and_free_key(struct onvm_ft_ipv4_5tuple *key){
 
         ret = onvm_flow_dir_get_key(key, &flow_entry);
         if (ret >= 0) {
-                rte_free(flow_entry->sc);
-                rte_free(flow_entry->key);
-                ret = onvm_ft_remove_key(sdn_ft, key);
+                ret = onvm_ft_remove_key(onvm_flow_dir_key_table(key), key);
+                if (ret >= 0) {
+                        sdn_ft_info->flows--;
+                        onvm_flow_dir_retire_entry(flow_entry);
+                }
+        }
+
+        return ret;
+}
+
+void
+onvm_flow_dir_set_chain(struct onvm_flow_entry *flow_entry, struct onvm_service_chain *sc){
+        struct onvm_service_chain *old;
+
+        old = flow_entry->sc;
+        /* Readers must not see the chain before what it, and the entry, hold */
+        rte_smp_wmb();
+        flow_entry->sc = sc;
+        if (old != sc)
+                onvm_flow_dir_release_chain(old);
+}
+
+void
+onvm_flow_dir_retire(void *ptr){
+        if (ptr == NULL)
+                return;
+
+        if (retire_queue != NULL && rte_ring_enqueue(retire_queue, ptr) != -ENOBUFS)
+                return;
+
+        /* The manager is not keeping up, wait for the readers ourselves */
+        if (flow_dir_qsbr != NULL)
+                onvm_qsbr_synchronize(flow_dir_qsbr);
+        rte_free(ptr);
+}
+
+unsigned
+onvm_flow_dir_take_retired(void **ptrs, unsigned n){
+        if (retire_queue == NULL)
+                return 0;
+
+        return rte_ring_dequeue_burst(retire_queue, ptrs, n);
+}
+
+int
+onvm_flow_dir_add_rule(struct onvm_ft_ipv4_5tuple *key, struct onvm_ft_ipv4_5tuple *mask, uint16_t priority,
+                       uint16_t idle_timeout, uint16_t hard_timeout, struct onvm_service_chain *sc){
+        struct onvm_flow_tuple *tuple;
+        struct onvm_flow_rule *rule;
+        struct onvm_ft_ipv4_5tuple masked;
+        int ret;
+
+        tuple = onvm_flow_dir_get_tuple(mask, 1);
+        if (tuple == NULL)
+                return -ENOSPC;
+        onvm_flow_dir_mask_key(&masked, key, mask);
+        ret = onvm_ft_lookup_key(tuple->ft, &masked, (char **)&rule);
+        if (ret == -ENOENT) {
+                ret = onvm_ft_add_key(tuple->ft, &masked, (char **)&rule);
+                if (ret < 0)
+                        return ret;
+                /* Readers skip the rule until it has a chain */
+                memset(rule, 0, sizeof(struct onvm_flow_rule));
+                tuple->rules++;
+                sdn_ft_info->rules++;
+        } else if (ret < 0) {
+                return ret;
+        }
+
+        rule->priority = priority;
+        rule->entry.idle_timeout = idle_timeout;
+        rule->entry.hard_timeout = hard_timeout;
+        if (priority > tuple->max_priority)
+                tuple->max_priority = priority;
+        onvm_flow_dir_set_chain(&rule->entry, sc);
+        sdn_ft_info->rules_gen++;
+
+        return 0;
+}
+
+int
+onvm_flow_dir_del_rule(struct onvm_ft_ipv4_5tuple *key, struct onvm_ft_ipv4_5tuple *mask){
+        struct onvm_flow_tuple *tuple;
+        struct onvm_flow_rule *rule;
+        struct onvm_ft_ipv4_5tuple masked;
+        int ret;
+
+        tuple = onvm_flow_dir_get_tuple(mask, 0);
+        if (tuple == NULL)
+                return -ENOENT;
+        onvm_flow_dir_mask_key(&masked, key, mask);
+        ret = onvm_ft_lookup_key(tuple->ft, &masked, (char **)&rule);
+        if (ret < 0)
+                return ret;
+        ret = onvm_ft_remove_key(tuple->ft, &masked);
+        if (ret < 0)
+                return ret;
+
+        tuple->rules--;
+        sdn_ft_info->rules--;
+        /* Flows cached from the rule hold its chain until they are dropped */
+        onvm_flow_dir_release_chain(rule->entry.sc);
+        sdn_ft_info->rules_gen++;
+
+        return 0;
+}
+
+unsigned
+onvm_flow_dir_fill_cache(unsigned n){
+        struct onvm_ft_ipv4_5tuple *keys[FLOW_DIR_BULK_MAX];
+        unsigned count, i, done = 0;
+
+        if (cache_queue == NULL)
+                return 0;
+
+        while (done < n) {
+                count = rte_ring_dequeue_burst(cache_queue, (void **)keys,
+                                               RTE_MIN(n - done, (unsigned)FLOW_DIR_BULK_MAX));
+                if (count == 0)
+                        break;
+                for (i = 0; i < count; i++) {
+                        onvm_flow_dir_cache_flow(keys[i]);
+                }
+                rte_mempool_put_bulk(cache_pool, (void **)keys, count);
+                done += count;
+        }
+
+        return done;
+}
+
+static int
+onvm_flow_dir_get_exact(struct rte_mbuf *pkt, struct onvm_flow_entry **flow_entry){
+        return onvm_ft_lookup_pkt(onvm_flow_dir_pkt_table(pkt), pkt, (char **)flow_entry);
+}
+
+/* A packet the exact entries missed (ret < 0), or hit an entry cached
+ * before the rules changed. Either way the manager fixes the cache. */
+static int
+onvm_flow_dir_classify_pkt(struct rte_mbuf *pkt, int ret, struct onvm_flow_entry **flow_entry){
+        struct onvm_ft_ipv4_5tuple key;
+        struct onvm_flow_rule *rule;
+
+        if (onvm_ft_fill_key(&key, pkt) < 0)
+                return ret;
+        rule = onvm_flow_dir_classify(&key);
+        if (rule == NULL && ret < 0)
+                return ret;
+
+        onvm_flow_dir_request_cache(&key);
+        if (rule == NULL)
+                return -ENOENT;
+        *flow_entry = &rule->entry;
+
+        return 0;
+}
+
+/* The highest priority rule matching a flow, if any */
+static struct onvm_flow_rule *
+onvm_flow_dir_classify(struct onvm_ft_ipv4_5tuple *key){
+        struct onvm_flow_tuple *tuple;
+        struct onvm_flow_rule *rule, *best = NULL;
+        struct onvm_ft_ipv4_5tuple masked;
+        uint16_t i, num_tuples;
+
+        num_tuples = sdn_ft_info->num_tuples;
+        /* A tuple is set up before it is counted */
+        rte_smp_rmb();
+        for (i = 0; i < num_tuples; i++) {
+                tuple = &sdn_ft_info->tuples[i];
+                if (tuple->rules == 0 || (best != NULL && tuple->max_priority <= best->priority))
+                        continue;
+                onvm_flow_dir_mask_key(&masked, key, &tuple->mask);
+                if (onvm_ft_lookup_key(tuple->ft, &masked, (char **)&rule) < 0 || rule->entry.sc == NULL)
+                        continue;
+                if (best == NULL || rule->priority > best->priority)
+                        best = rule;
+        }
+
+        return best;
+}
+
+/* The tuple holding the rules with this mask. New tuples are only created
+ * by writers, and stay once their rules are gone. */
+static struct onvm_flow_tuple *
+onvm_flow_dir_get_tuple(struct onvm_ft_ipv4_5tuple *mask, int create){
+        struct onvm_flow_tuple *tuple;
+        struct onvm_ft_ipv4_5tuple norm;
+        uint16_t i, num_tuples;
+
+        /* Masks are compared whole, without the padding */
+        onvm_flow_dir_mask_key(&norm, mask, mask);
+        num_tuples = sdn_ft_info->num_tuples;
+        for (i = 0; i < num_tuples; i++) {
+                if (memcmp(&sdn_ft_info->tuples[i].mask, &norm, sizeof(norm)) == 0)
+                        return &sdn_ft_info->tuples[i];
+        }
+        if (!create || num_tuples == SDN_FC_MAX_TUPLES)
+                return NULL;
+
+        tuple = &sdn_ft_info->tuples[num_tuples];
+        tuple->ft = onvm_ft_create(SDN_FC_TUPLE_RULES, sizeof(struct onvm_flow_rule));
+        if (tuple->ft == NULL)
+                return NULL;
+        tuple->mask = norm;
+        tuple->rules = 0;
+        tuple->max_priority = 0;
+        rte_smp_wmb();
+        sdn_ft_info->num_tuples = num_tuples + 1;
+
+        return tuple;
+}
+
+static void
+onvm_flow_dir_mask_key(struct onvm_ft_ipv4_5tuple *masked, struct onvm_ft_ipv4_5tuple *key,
+                       struct onvm_ft_ipv4_5tuple *mask){
+        /* Keys are hashed with their padding, which must be zero */
+        memset(masked, 0, sizeof(struct onvm_ft_ipv4_5tuple));
+        masked->src_addr = key->src_addr & mask->src_addr;
+        masked->dst_addr = key->dst_addr & mask->dst_addr;
+        masked->src_port = key->src_port & mask->src_port;
+        masked->dst_port = key->dst_port & mask->dst_port;
+        masked->proto = key->proto & mask->proto;
+}
+
+/* Readers don't write the table, they hand the flow to the manager. Until it
+ * is cached its packets ask again, so a request that finds the queue full is
+ * simply dropped. */
+static void
+onvm_flow_dir_request_cache(struct onvm_ft_ipv4_5tuple *key){
+        struct onvm_ft_ipv4_5tuple *req;
+
+        if (cache_pool == NULL || rte_mempool_get(cache_pool, (void **)&req) != 0)
+                return;
+        *req = *key;
+        if (rte_ring_enqueue(cache_queue, req) == -ENOBUFS)
+                rte_mempool_put(cache_pool, req);
+}
+
+/* Give a flow an exact entry with the chain of the rule it matches now, or
+ * drop the entry cached from a rule if none does. Entries installed
+ * directly are left alone. */
+static void
+onvm_flow_dir_cache_flow(struct onvm_ft_ipv4_5tuple *key){
+        struct onvm_flow_entry *flow_entry;
+        struct onvm_flow_rule *rule;
+        struct onvm_ft_ipv4_5tuple *fk;
+        int ret;
+
+        rule = onvm_flow_dir_classify(key);
+        ret = onvm_flow_dir_get_key(key, &flow_entry);
+        if (ret >= 0) {
+                if (flow_entry->rule_gen == 0 || flow_entry->rule_gen == sdn_ft_info->rules_gen)
+                        return;
+                if (rule == NULL) {
+                        if (onvm_ft_remove_key(onvm_flow_dir_key_table(key), key) >= 0) {
+                                sdn_ft_info->flows--;
+                                onvm_flow_dir_retire(flow_entry->key);
+                                onvm_flow_dir_release_chain(flow_entry->sc);
+                        }
+                        return;
+                }
+                flow_entry->idle_timeout = rule->entry.idle_timeout ? rule->entry.idle_timeout : SDN_FC_CACHE_IDLE;
+                flow_entry->hard_timeout = rule->entry.hard_timeout;
+                flow_entry->rule_gen = sdn_ft_info->rules_gen;
+                if (flow_entry->sc != rule->entry.sc) {
+                        rule->entry.sc->ref_cnt++;
+                        onvm_flow_dir_set_chain(flow_entry, rule->entry.sc);
+                }
+                return;
+        }
+        if (ret != -ENOENT || rule == NULL)
+                return;
+
+        fk = rte_malloc("flow_key", sizeof(struct onvm_ft_ipv4_5tuple), 0);
+        if (fk == NULL)
+                return;
+        *fk = *key;
+        ret = onvm_flow_dir_add_key(fk, &flow_entry);
+        if (ret < 0) {
+                rte_free(fk);
+                return;
+        }
+        memset(flow_entry, 0, sizeof(struct onvm_flow_entry));
+        flow_entry->key = fk;
+        flow_entry->idle_timeout = rule->entry.idle_timeout ? rule->entry.idle_timeout : SDN_FC_CACHE_IDLE;
+        flow_entry->hard_timeout = rule->entry.hard_timeout;
+        flow_entry->rule_gen = sdn_ft_info->rules_gen;
+        /* The entry shares the rule's chain */
+        rule->entry.sc->ref_cnt++;
+        onvm_flow_dir_set_chain(flow_entry, rule->entry.sc);
+}
+
+/* The NIC's hash is used when there is one. Packets without it, like those
+ * NFs build, are hashed the way the NIC would. */
+static inline uint16_t
+onvm_flow_dir_pkt_shard(struct rte_mbuf *pkt){
+        struct onvm_ft_ipv4_5tuple key;
+
+        if (onvm_flow_dir_num_shards() == 1)
+                return 0;
+        if (likely(pkt->ol_flags & PKT_RX_RSS_HASH))
+                return onvm_flow_dir_rss_shard(pkt->hash.rss);
+        if (onvm_ft_fill_key(&key, pkt) < 0)
+                return 0;
+        return onvm_flow_dir_rss_shard(onvm_softrss(&key));
+}
+
+static inline struct onvm_ft *
+onvm_flow_dir_pkt_table(struct rte_mbuf *pkt){
+        return onvm_flow_dir_table(onvm_flow_dir_pkt_shard(pkt));
+}
+
+static inline struct onvm_ft *
+onvm_flow_dir_key_table(struct onvm_ft_ipv4_5tuple *key){
+        if (onvm_flow_dir_num_shards() == 1)
+                return onvm_flow_dir_table(0);
+        return onvm_flow_dir_table(onvm_flow_dir_rss_shard(onvm_softrss(key)));
+}
+
+/* A removed entry's slot may be reused right away, readers still holding it
+ * then see the new flow's chain, or none while it is installed. Only its
+ * old chain and key must stay valid, so retire them. */
+static void
+onvm_flow_dir_retire_entry(struct onvm_flow_entry *flow_entry){
+        onvm_flow_dir_retire(flow_entry->key);
+        onvm_flow_dir_retire(flow_entry->sc);
+}
+
+/* Drop one user of a chain, retiring it with the last */
+static void
+onvm_flow_dir_release_chain(struct onvm_service_chain *sc){
+        int ref_cnt;
+
+        if (sc == NULL)
+                return;
+        ref_cnt = sc->ref_cnt--;
+        if (ref_cnt <= 0)
+                onvm_flow_dir_retire(sc);
+}
+
+/* Count a new flow, or ask the manager to grow the table if it had no
+ * space for it */
+static int
+onvm_flow_dir_add_done(int ret){
+        if (ret >= 0) {
+                sdn_ft_info->flows++;
+        } else if (ret == -ENOSPC) {
+                sdn_ft_info->add_fails++;
+                sdn_ft_info->grow = 1;
         }
 
         return ret;
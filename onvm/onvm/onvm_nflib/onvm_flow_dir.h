@@ -41,37 +41,189 @@
 #ifndef _ONVM_FLOW_DIR_H_
 #define _ONVM_FLOW_DIR_H_
 
+#include <rte_spinlock.h>
 #include "onvm_common.h"
 #include "onvm_flow_table.h"
 
-extern struct onvm_ft *sdn_ft;
-extern struct onvm_ft **sdn_ft_p;
+#define SDN_FT_ENTRIES 65536              // initial size, see the manager's -f
+#define SDN_FT_MIN_ENTRIES 64
+#define SDN_FT_MAX_ENTRIES (1 << 24)      // the table doesn't grow past this
+#define SDN_FT_GROW_PCT 75                // grow once this much of the table is used
+#define SDN_FT_RETIRE_QUEUE_SIZE 4096     // chains and keys waiting for the manager to free them
+#define SDN_FT_MAX_SHARDS 16              // see the manager's -S
+#define SDN_FT_SHARD_BUCKETS 64           // RSS buckets mapped to shards, a power of 2
+#define SDN_FC_MAX_TUPLES 32              // distinct wildcard masks among the rules
+#define SDN_FC_TUPLE_RULES 1024           // rules sharing one mask
+#define SDN_FC_CACHE_IDLE 10              // idle timeout, in seconds, of flows cached from rules without one
+#define SDN_FC_CACHE_QUEUE_SIZE 4096      // flows waiting for the manager to cache them
+
+/* Wildcard rules sharing one mask, in a table keyed by the masked 5-tuple.
+ * A flow is classified by masking it with every tuple's mask in turn and
+ * looking the result up (tuple space search). */
+struct onvm_flow_tuple {
+        struct onvm_ft_ipv4_5tuple mask;
+        struct onvm_ft *ft;             /* struct onvm_flow_rule entries */
+        volatile uint32_t rules;
+        volatile uint16_t max_priority; /* of any rule it held, tuples below the best match are skipped */
+};
+
+/* Flow director state shared by the manager and NFs (MZ_FTP_INFO).
+ * With -S the directory is split in one shard per RX queue. A flow lives
+ * in the shard its RSS bucket maps to, and the manager points the NICs'
+ * redirection tables at the same queue, so each RX thread mostly looks up
+ * its own shard. */
+struct onvm_flow_dir_info {
+        struct onvm_ft *volatile ft[SDN_FT_MAX_SHARDS]; /* the shards, replaced when they grow */
+        uint16_t num_shards;            /* 1 unless sharded */
+        volatile uint32_t shard_entries; /* capacity of each shard's table */
+        uint8_t shard_of[SDN_FT_SHARD_BUCKETS];  /* RSS bucket to shard */
+        rte_spinlock_t lock;            /* see onvm_flow_dir_lock */
+        volatile uint32_t flows;        /* entries in ft */
+        volatile uint32_t resizes;      /* times ft was replaced by a larger table */
+        volatile uint64_t add_fails;    /* flows that could not be added, no space */
+        volatile uint8_t grow;          /* set when an add found no space */
+        struct onvm_flow_tuple tuples[SDN_FC_MAX_TUPLES]; /* wildcard rules, see onvm_flow_dir_add_rule */
+        volatile uint16_t num_tuples;   /* tuples are only added, never removed */
+        volatile uint32_t rules;        /* wildcard rules in all tuples */
+        volatile uint32_t rules_gen;    /* bumped when a rule changes, flows cached before are classified again */
+};
+
+extern struct onvm_flow_dir_info *sdn_ft_info;
 
 struct onvm_flow_entry {
         struct onvm_ft_ipv4_5tuple *key;
         struct onvm_service_chain *sc;
         uint64_t ref_cnt;
-        uint16_t idle_timeout;
-        uint16_t hard_timeout;
+        uint16_t idle_timeout;          /* seconds without packets before the entry expires, 0 for never */
+        uint16_t hard_timeout;          /* seconds after it is installed the entry expires, 0 for never */
+        volatile uint32_t last_seen;    /* expiry clock tick of the last packet, set by the manager */
+        uint8_t expire_armed;           /* set by the manager's expiry engine, clear it when (re)installing */
+        uint32_t rule_gen;              /* rules_gen when cached from a wildcard rule, 0 when installed directly */
         uint64_t packet_count;
         uint64_t byte_count;
 };
 
+/* A wildcard rule. Lookups of flows it matches return its entry until the
+ * manager has cached an exact entry for the flow, which gets the rule's
+ * chain and timeouts. */
+struct onvm_flow_rule {
+        struct onvm_flow_entry entry;   /* no key, the rule's is in its tuple */
+        uint16_t priority;              /* the highest priority rule matching a flow wins */
+};
+
+/* The current table of a shard. The manager replaces the tables with
+ * larger copies when they fill up, so don't keep them: entries and indexes
+ * from them are only valid until the manager grows the directory. NFs
+ * should go through the functions below, which pick the shard. */
+static inline struct onvm_ft *
+onvm_flow_dir_table(uint16_t shard) {
+        return sdn_ft_info->ft[shard];
+}
+
+static inline uint16_t
+onvm_flow_dir_num_shards(void) {
+        return sdn_ft_info->num_shards;
+}
+
+/* The shard owning the flows of an RSS hash */
+static inline uint16_t
+onvm_flow_dir_rss_shard(uint32_t rss) {
+        return sdn_ft_info->shard_of[rss & (SDN_FT_SHARD_BUCKETS - 1)];
+}
+
+/* Entries in all shards. Doesn't touch the tables, so threads that are
+ * not QSBR readers, like the stats, may call it. */
+static inline uint32_t
+onvm_flow_dir_size(void) {
+        return sdn_ft_info->shard_entries * sdn_ft_info->num_shards;
+}
+
+/* Writers of the flow table (the manager's expiry and growth, and NFs
+ * installing or deleting flows) must hold this lock around add, del and
+ * updates of an entry's key and chain, so an entry can't expire, or the
+ * table be replaced, under them.
+ *
+ * Readers never wait for the lock. They are the manager's packet threads
+ * and NFs inside onvm_nflib_run, which pass a quiescent state (onvm_qsbr.h)
+ * between batches. So writers don't free a chain or key an entry pointed
+ * to, or rewrite an entry in use, they publish a new chain with
+ * onvm_flow_dir_set_chain and leave the old one to onvm_flow_dir_retire. */
+static inline void
+onvm_flow_dir_lock(void) {
+        rte_spinlock_lock(&sdn_ft_info->lock);
+}
+
+/* For readers that must write, like a packet handler installing a flow.
+ * They must never spin on the lock: its holder may be waiting for them to
+ * pass a quiescent state. Returns 1 if the lock was taken. */
+static inline int
+onvm_flow_dir_trylock(void) {
+        return rte_spinlock_trylock(&sdn_ft_info->lock);
+}
+
+static inline void
+onvm_flow_dir_unlock(void) {
+        rte_spinlock_unlock(&sdn_ft_info->lock);
+}
+
+/* Create the directory, with entries split over shards. Manager only. */
+int onvm_flow_dir_init(uint32_t entries, uint16_t shards);
+int onvm_flow_dir_nf_init(void);
 /* Get a pointer to the flow entry entry for this packet.
  * Returns:
  *  0        on success. *flow_entry points to this packet flow's flow entry
  *  -ENOENT  if flow has not been added to table. *flow_entry points to flow entry
+ *
+ * Flows without an exact entry are classified by the wildcard rules. On a
+ * match *flow_entry is the rule's entry, and the manager is asked to cache
+ * an exact entry for the flow, so only its first packets pay for the
+ * classification.
+ *
+ * Packets are placed in a shard by their RSS hash, so NFs that rewrite a
+ * packet's addresses or ports must set pkt->hash.rss to onvm_softrss of the
+ * new flow before looking it up or adding it.
  */
-int onvm_flow_dir_init(void);
-int onvm_flow_dir_nf_init(void);
 int onvm_flow_dir_get_pkt(struct rte_mbuf* pkt, struct onvm_flow_entry **flow_entry);
+/* Get the flow entries of a burst of packets, NULL for packets without one.
+ * Only for the manager, see onvm_ft_lookup_pkt_bulk. Falls back to the
+ * wildcard rules like onvm_flow_dir_get_pkt. Returns the number found. */
+int onvm_flow_dir_get_pkt_bulk(struct rte_mbuf **pkts, uint16_t count, struct onvm_flow_entry **flow_entries);
 int onvm_flow_dir_add_pkt(struct rte_mbuf* pkt, struct onvm_flow_entry **flow_entry);
 /* delete the flow dir entry, but do not free the service chain (useful if a service chain is pointed to by several different flows */
 int onvm_flow_dir_del_pkt(struct rte_mbuf* pkt);
 /* Delete the flow dir entry and free the service chain */
 int onvm_flow_dir_del_and_free_pkt(struct rte_mbuf* pkt);
+/* The *_key functions, and adding and deleting packets, only see exact entries */
 int onvm_flow_dir_get_key(struct onvm_ft_ipv4_5tuple* key, struct onvm_flow_entry **flow_entry);
 int onvm_flow_dir_add_key(struct onvm_ft_ipv4_5tuple* key, struct onvm_flow_entry **flow_entry);
 int onvm_flow_dir_del_key(struct onvm_ft_ipv4_5tuple* key);
 int onvm_flow_dir_del_and_free_key(struct onvm_ft_ipv4_5tuple* key);
+/* Point an entry at a new chain, once the rest of the entry is set up.
+ * Readers see either the old chain or the new one. The old one is retired
+ * unless other flows still use it. Call with the lock held. */
+void onvm_flow_dir_set_chain(struct onvm_flow_entry *flow_entry, struct onvm_service_chain *sc);
+/* Free a chain or key that was reachable from the table once no reader can
+ * hold it any more. It is handed to the manager, which frees it after a
+ * grace period. If the manager is far behind, waits for the grace period
+ * here instead, which a reader can't do: packet handlers should leave
+ * deleting and rewriting flows to another thread, like the flow_table
+ * NF's SDN thread. */
+void onvm_flow_dir_retire(void *ptr);
+/* Take up to n retired chains and keys. Only for the manager, which frees
+ * them after a grace period. Returns how many were taken. */
+unsigned onvm_flow_dir_take_retired(void **ptrs, unsigned n);
+/* Install or replace the wildcard rule matching the flows equal to key in
+ * the bits set in mask, e.g. a mask with only the top 24 bits of dst_addr
+ * set matches a /24. The rule takes sc. Exact entries take precedence over
+ * rules, as in OpenFlow 1.0. Flows cached from the rules are classified
+ * again. Call with the lock held. */
+int onvm_flow_dir_add_rule(struct onvm_ft_ipv4_5tuple *key, struct onvm_ft_ipv4_5tuple *mask, uint16_t priority,
+                           uint16_t idle_timeout, uint16_t hard_timeout, struct onvm_service_chain *sc);
+/* Delete a wildcard rule, its chain is retired once no cached flow uses it.
+ * Call with the lock held. */
+int onvm_flow_dir_del_rule(struct onvm_ft_ipv4_5tuple *key, struct onvm_ft_ipv4_5tuple *mask);
+/* Cache exact entries for up to n flows lookups classified by a rule, or
+ * drop those cached from rules that no longer match. Only for the manager,
+ * with the lock held. Returns how many requests were handled. */
+unsigned onvm_flow_dir_fill_cache(unsigned n);
 #endif // _ONVM_FLOW_DIR_H_
@@ -57,30 +57,41 @@ uint8_t rss_symmetric_key[40] = { 0x6d, 0x5a, 0x6d, 0x5a,
                                      0x6d, 0x5a, 0x6d, 0x5a,
                                      0x6d, 0x5a, 0x6d, 0x5a,};
 
+/* Number of packets ahead of the one being parsed whose headers are prefetched */
+#define FT_PREFETCH_OFFSET 4
+
 /* Create a new flow table made of an rte_hash table and a fixed size
- * data array for storing values. Only supports IPv4 5-tuple lookups. */
+ * data array for storing values, on the caller's NUMA socket. Only
+ * supports IPv4 5-tuple lookups. All keys are hashed with onvm_ft_hash_key. */
 struct onvm_ft*
 onvm_ft_create(int cnt, int entry_size) {
+        return onvm_ft_create_socket(cnt, entry_size, rte_socket_id());
+}
+
+/* Same as onvm_ft_create, with the hash and data array on the given
+ * socket. Threads that are not lcores have no socket of their own. */
+struct onvm_ft*
+onvm_ft_create_socket(int cnt, int entry_size, int socket_id) {
         struct rte_hash* hash;
         struct onvm_ft* ft;
         struct rte_hash_parameters ipv4_hash_params = {
             .name = NULL,
             .entries = cnt,
             .key_len = sizeof(struct onvm_ft_ipv4_5tuple),
-            .hash_func = NULL,
+            .hash_func = DEFAULT_HASH_FUNC,
             .hash_func_init_val = 0,
         };
 
         char s[64];
         /* create ipv4 hash table. use core number and cycle counter to get a unique name. */
         ipv4_hash_params.name = s;
-        ipv4_hash_params.socket_id = rte_socket_id();
+        ipv4_hash_params.socket_id = socket_id;
         snprintf(s, sizeof(s), "onvm_ft_%d-%"PRIu64, rte_lcore_id(), rte_get_tsc_cycles());
         hash = rte_hash_create(&ipv4_hash_params);
         if (hash == NULL) {
                 return NULL;
         }
-	ft = (struct onvm_ft*)rte_calloc("table", 1, sizeof(struct onvm_ft), 0);
+	ft = (struct onvm_ft*)rte_calloc_socket("table", 1, sizeof(struct onvm_ft), 0, socket_id);
         if (ft == NULL) {
                 rte_hash_free(hash);
                 return NULL;
@@ -88,8 +99,9 @@ onvm_ft_create(int cnt, int entry_size) {
         ft->hash = hash;
         ft->cnt = cnt;
         ft->entry_size = entry_size;
+        ft->socket_id = socket_id;
         /* Create data array for storing values */
-        ft->data = rte_calloc("entry", cnt, entry_size, 0);
+        ft->data = rte_calloc_socket("entry", cnt, entry_size, 0, socket_id);
         if (ft->data == NULL) {
                 rte_hash_free(hash);
                 rte_free(ft);
@@ -98,6 +110,44 @@ onvm_ft_create(int cnt, int entry_size) {
         return ft;
 }
 
+/* Copy every entry of src, and its value, into dst, e.g. to move to a
+   larger table. dst should be empty. The caller must keep src from
+   changing meanwhile.
+   Parameters:
+     positions: if not NULL, src->cnt slots set to the index each index of
+                src moved to in dst, or -1 if it was not in use.
+   Returns:
+    the number of entries copied on success
+    -ENOSPC if dst has no space for them.
+*/
+int
+onvm_ft_copy(struct onvm_ft *dst, struct onvm_ft *src, int32_t *positions) {
+        const void *key;
+        void *data;
+        uint32_t next = 0;
+        int32_t src_index, dst_index;
+        int copied = 0;
+        int i;
+
+        if (positions != NULL) {
+                for (i = 0; i < src->cnt; i++)
+                        positions[i] = -1;
+        }
+
+        while ((src_index = rte_hash_iterate(src->hash, &key, &data, &next)) >= 0) {
+                dst_index = rte_hash_add_key_with_hash(dst->hash, key,
+                                onvm_ft_hash_key((const struct onvm_ft_ipv4_5tuple *)key));
+                if (dst_index < 0)
+                        return dst_index;
+                memcpy(onvm_ft_get_data(dst, dst_index), onvm_ft_get_data(src, src_index), src->entry_size);
+                if (positions != NULL && src_index < src->cnt)
+                        positions[src_index] = dst_index;
+                copied++;
+        }
+
+        return copied;
+}
+
 /* Add an entry in flow table and set data to point to the new value.
 Returns:
  index in the array on success
@@ -115,7 +165,7 @@ onvm_ft_add_pkt(struct onvm_ft* table, struct rte_mbuf *pkt, char** data) {
         if (err < 0) {
                 return err;
         }
-        tbl_index = rte_hash_add_key_with_hash(table->hash, (const void *)&key, pkt->hash.rss);
+        tbl_index = rte_hash_add_key_with_hash(table->hash, (const void *)&key, onvm_ft_hash_key(&key));
         if (tbl_index >= 0) {
         	*data = &table->data[tbl_index*table->entry_size];
         }
@@ -138,13 +188,74 @@ onvm_ft_lookup_pkt(struct onvm_ft* table, struct rte_mbuf *pkt, char** data) {
         if (ret < 0) {
                 return ret;
         }
-        tbl_index = rte_hash_lookup_with_hash(table->hash, (const void *)&key, pkt->hash.rss);
+        tbl_index = rte_hash_lookup_with_hash(table->hash, (const void *)&key, onvm_ft_hash_key(&key));
         if (tbl_index >= 0) {
                 *data = onvm_ft_get_data(table, tbl_index);
         }
         return tbl_index;
 }
 
+/* Lookup the entries of a burst of packets. The keys of the whole burst
+   are extracted first, prefetching the headers of the packets ahead, then
+   looked up with one rte_hash_lookup_bulk call per RTE_HASH_LOOKUP_BULK_MAX
+   packets, and the entries found are prefetched for the caller. That call
+   hashes through the table's hash function pointer, so this may only be
+   used by the process that created the table.
+   Sets data[i] to the value of pkts[i], or NULL if it has no entry or is
+   not ipv4.
+   Returns:
+    the number of packets with an entry
+    -EINVAL if the parameters are invalid.
+*/
+int
+onvm_ft_lookup_pkt_bulk(struct onvm_ft *table, struct rte_mbuf **pkts, uint16_t count, char **data) {
+        struct onvm_ft_ipv4_5tuple keys[RTE_HASH_LOOKUP_BULK_MAX];
+        const void *key_ptrs[RTE_HASH_LOOKUP_BULK_MAX];
+        int32_t positions[RTE_HASH_LOOKUP_BULK_MAX];
+        uint16_t key_pkt[RTE_HASH_LOOKUP_BULK_MAX];
+        uint16_t base, end, i, num_keys;
+        int found = 0;
+
+        if (table == NULL || pkts == NULL || data == NULL)
+                return -EINVAL;
+
+        for (i = 0; i < count && i < FT_PREFETCH_OFFSET; i++)
+                rte_prefetch0(rte_pktmbuf_mtod(pkts[i], void *));
+
+        for (base = 0; base < count; base = end) {
+                end = RTE_MIN(count, base + RTE_HASH_LOOKUP_BULK_MAX);
+                num_keys = 0;
+                for (i = base; i < end; i++) {
+                        if (i + FT_PREFETCH_OFFSET < count)
+                                rte_prefetch0(rte_pktmbuf_mtod(pkts[i + FT_PREFETCH_OFFSET], void *));
+                        data[i] = NULL;
+                        if (onvm_ft_fill_key(&keys[num_keys], pkts[i]) < 0)
+                                continue;
+                        key_ptrs[num_keys] = &keys[num_keys];
+                        key_pkt[num_keys] = i;
+                        num_keys++;
+                }
+                if (num_keys == 0)
+                        continue;
+
+                if (rte_hash_lookup_bulk(table->hash, key_ptrs, num_keys, positions) < 0) {
+                        for (i = base; i < count; i++)
+                                data[i] = NULL;
+                        return -EINVAL;
+                }
+
+                for (i = 0; i < num_keys; i++) {
+                        if (positions[i] < 0)
+                                continue;
+                        data[key_pkt[i]] = onvm_ft_get_data(table, positions[i]);
+                        rte_prefetch0(data[key_pkt[i]]);
+                        found++;
+                }
+        }
+
+        return found;
+}
+
 /* Removes an entry from the flow table
    Returns:
     A positive value that can be used by the caller as an offset into an array of user data. This value is unique for this key, and is the same value that was returned when the key was added.
@@ -161,17 +272,14 @@ onvm_ft_remove_pkt(struct onvm_ft *table, struct rte_mbuf *pkt)
         if (ret < 0) {
                 return ret;
         }
-        return rte_hash_del_key_with_hash(table->hash, (const void *)&key, pkt->hash.rss);
+        return rte_hash_del_key_with_hash(table->hash, (const void *)&key, onvm_ft_hash_key(&key));
 }
 
 int
 onvm_ft_add_key(struct onvm_ft* table, struct onvm_ft_ipv4_5tuple *key, char** data) {
         int32_t tbl_index;
-	uint32_t softrss;
-
-	softrss = onvm_softrss(key);
 
-        tbl_index = rte_hash_add_key_with_hash(table->hash, (const void *)key, softrss);
+        tbl_index = rte_hash_add_key_with_hash(table->hash, (const void *)key, onvm_ft_hash_key(key));
         if (tbl_index >= 0) {
 		*data = onvm_ft_get_data(table, tbl_index);
         }
@@ -182,11 +290,8 @@ onvm_ft_add_key(struct onvm_ft* table, struct onvm_ft_ipv4_5tuple *key, char** d
 int
 onvm_ft_lookup_key(struct onvm_ft* table, struct onvm_ft_ipv4_5tuple *key, char** data) {
         int32_t tbl_index;
-	uint32_t softrss;
-
-	softrss = onvm_softrss(key);
 
-        tbl_index = rte_hash_lookup_with_hash(table->hash, (const void *)key, softrss);
+        tbl_index = rte_hash_lookup_with_hash(table->hash, (const void *)key, onvm_ft_hash_key(key));
 	if (tbl_index >= 0) {
                 *data = onvm_ft_get_data(table, tbl_index);
         }
@@ -197,7 +302,7 @@ onvm_ft_lookup_key(struct onvm_ft* table, struct onvm_ft_ipv4_5tuple *key, char*
 int32_t
 onvm_ft_remove_key(struct onvm_ft *table, struct onvm_ft_ipv4_5tuple *key)
 {
-        return rte_hash_del_key(table->hash, (const void *)key);
+        return rte_hash_del_key_with_hash(table->hash, (const void *)key, onvm_ft_hash_key(key));
 }
 
 /* Iterate through the hash table, returning key-value pairs.
@@ -222,4 +327,6 @@ onvm_ft_free(struct onvm_ft *table)
 {
         rte_hash_reset(table->hash);
         rte_hash_free(table->hash);
+        rte_free(table->data);
+        rte_free(table);
 }
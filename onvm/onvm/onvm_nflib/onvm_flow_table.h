@@ -48,6 +48,8 @@
 #include <rte_tcp.h>
 #include <rte_udp.h>
 #include <rte_thash.h>
+#include <rte_hash.h>
+#include <rte_prefetch.h>
 #include "onvm_pkt_helper.h"
 #include "onvm_common.h"
 
@@ -66,6 +68,7 @@ struct onvm_ft {
         char* data;
         int cnt;
         int entry_size;
+        int socket_id;
 };
 
 struct onvm_ft_ipv4_5tuple {
@@ -95,12 +98,21 @@ union ipv4_5tuple_host {
 struct onvm_ft*
 onvm_ft_create(int cnt, int entry_size);
 
+struct onvm_ft*
+onvm_ft_create_socket(int cnt, int entry_size, int socket_id);
+
+int
+onvm_ft_copy(struct onvm_ft *dst, struct onvm_ft *src, int32_t *positions);
+
 int
 onvm_ft_add_pkt(struct onvm_ft *table, struct rte_mbuf *pkt, char **data);
 
 int
 onvm_ft_lookup_pkt(struct onvm_ft *table, struct rte_mbuf *pkt, char **data);
 
+int
+onvm_ft_lookup_pkt_bulk(struct onvm_ft *table, struct rte_mbuf **pkts, uint16_t count, char **data);
+
 int32_t
 onvm_ft_remove_pkt(struct onvm_ft *table, struct rte_mbuf *pkt);
 
@@ -119,10 +131,14 @@ onvm_ft_iterate(struct onvm_ft *table, const void **key, void **data, uint32_t *
 void
 onvm_ft_free(struct onvm_ft *table);
 
-/* TODO(@sdnfv): Add function to calculate hash and then make lookup/get
- * have versions with precomputed hash values */
-// hash_sig_t
-// onvm_ft_hash(struct rte_mbuf *buf);
+/* Hash a flow key. This is the hash function the table is created with,
+ * so keys hashed here are found by rte_hash_lookup_bulk. The single key
+ * functions pass it explicitly since NFs can't call through the table's
+ * hash function pointer, which belongs to the process that created it. */
+static inline hash_sig_t
+onvm_ft_hash_key(const struct onvm_ft_ipv4_5tuple *key) {
+        return DEFAULT_HASH_FUNC(key, sizeof(struct onvm_ft_ipv4_5tuple), 0);
+}
 
 static inline void
 _onvm_ft_print_key(struct onvm_ft_ipv4_5tuple *key) {
@@ -196,16 +212,23 @@ onvm_ft_ipv4_hash_crc(const void *data, __rte_unused uint32_t data_len,
         return (init_val);
 }
 
-/*software caculate RSS*/
+/*software caculate RSS, the same hash the NICs compute with rss_symmetric_key.
+ * Ports are 0 for protocols other than TCP and UDP, which gives their L3 hash. */
 static inline uint32_t
 onvm_softrss(struct onvm_ft_ipv4_5tuple *key)
 {
 	union rte_thash_tuple tuple;
-	uint8_t rss_key_be[RTE_DIM(rss_symmetric_key)];
+	static uint8_t rss_key_be[RTE_DIM(rss_symmetric_key)];
+	static volatile int rss_key_ready = 0;
 	uint32_t rss_l3l4;
 
-	rte_convert_rss_key((uint32_t *)rss_symmetric_key, (uint32_t *)rss_key_be,
-				RTE_DIM(rss_symmetric_key));
+	/* Converting it is the costly part, and it never changes */
+	if (unlikely(!rss_key_ready)) {
+		rte_convert_rss_key((uint32_t *)rss_symmetric_key, (uint32_t *)rss_key_be,
+					RTE_DIM(rss_symmetric_key));
+		rte_smp_wmb();
+		rss_key_ready = 1;
+	}
 
 	tuple.v4.src_addr = rte_be_to_cpu_32(key->src_addr);
 	tuple.v4.dst_addr = rte_be_to_cpu_32(key->dst_addr);
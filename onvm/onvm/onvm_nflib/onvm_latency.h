@@ -0,0 +1,132 @@
+/*********************************************************************
+ *                     openNetVM
+ *              https://sdnfv.github.io
+ *
+ *   BSD LICENSE
+ *
+ *   Copyright(c)
+ *            2015-2016 George Washington University
+ *            2015-2016 University of California Riverside
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * The name of the author may not be used to endorse or promote
+ *       products derived from this software without specific prior
+ *       written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * onvm_latency.h - log-bucketed latency histograms shared between
+ *                  the manager and NFs
+ ********************************************************************/
+
+#ifndef _ONVM_LATENCY_H_
+#define _ONVM_LATENCY_H_
+
+#include <rte_common.h>
+#include <rte_cycles.h>
+
+#include "onvm_common.h"
+
+/* Each power of two range of cycles is split into 1 << ONVM_HIST_SUB_BITS
+ * buckets, so a bucket is never wider than 25% of its lower bound. Values
+ * below 1 << (ONVM_HIST_SUB_BITS + 1) get a bucket each. */
+#define ONVM_HIST_SUB_BITS 2
+#define ONVM_HIST_BUCKETS (64 << ONVM_HIST_SUB_BITS)
+
+/* Latency in cycles. Every histogram has a single writer, readers sum and
+ * diff the buckets, so no atomics are needed. */
+struct onvm_hist {
+        uint64_t bucket[ONVM_HIST_BUCKETS];
+} __rte_cache_aligned;
+
+/* Histograms written by NFs, indexed by instance id. The manager keeps the
+ * end-to-end histograms of the packets it sends out in its own memory. */
+struct onvm_latency_info {
+        uint8_t enabled;                        /* set by the manager with -L */
+        struct onvm_hist hop[MAX_CLIENTS];      /* time from the previous hop until the NF was done */
+        struct onvm_hist out[MAX_CLIENTS];      /* RX to TX for packets the NF sent out itself */
+};
+
+static inline unsigned
+onvm_hist_bucket(uint64_t cycles) {
+        unsigned msb;
+
+        if (cycles < (1 << ONVM_HIST_SUB_BITS))
+                return cycles;
+
+        msb = 63 - __builtin_clzll(cycles);
+        return ((msb - ONVM_HIST_SUB_BITS + 1) << ONVM_HIST_SUB_BITS) |
+                ((cycles >> (msb - ONVM_HIST_SUB_BITS)) & ((1 << ONVM_HIST_SUB_BITS) - 1));
+}
+
+/* Smallest value falling in a bucket */
+static inline uint64_t
+onvm_hist_bucket_value(unsigned bucket) {
+        unsigned shift = bucket >> ONVM_HIST_SUB_BITS;
+        uint64_t sub = bucket & ((1 << ONVM_HIST_SUB_BITS) - 1);
+
+        if (shift == 0)
+                return sub;
+        return ((1 << ONVM_HIST_SUB_BITS) | sub) << (shift - 1);
+}
+
+static inline void
+onvm_hist_record(struct onvm_hist *hist, uint64_t cycles) {
+        hist->bucket[onvm_hist_bucket(cycles)]++;
+}
+
+static inline void
+onvm_hist_add(struct onvm_hist *dst, const struct onvm_hist *src) {
+        unsigned i;
+
+        for (i = 0; i < ONVM_HIST_BUCKETS; i++)
+                dst->bucket[i] += src->bucket[i];
+}
+
+/* Value below which a fraction p (0 < p <= 1) of the samples recorded in
+ * hist since the snapshot `since` was taken fall, in cycles. since may be
+ * NULL to use every sample. Returns 0 if there are none. */
+static inline uint64_t
+onvm_hist_percentile(const struct onvm_hist *hist, const struct onvm_hist *since, double p) {
+        uint64_t total = 0, seen = 0;
+        unsigned i;
+
+        for (i = 0; i < ONVM_HIST_BUCKETS; i++)
+                total += hist->bucket[i] - (since ? since->bucket[i] : 0);
+        if (total == 0)
+                return 0;
+
+        for (i = 0; i < ONVM_HIST_BUCKETS; i++) {
+                seen += hist->bucket[i] - (since ? since->bucket[i] : 0);
+                if (seen >= p * total)
+                        return onvm_hist_bucket_value(i);
+        }
+        return onvm_hist_bucket_value(ONVM_HIST_BUCKETS - 1);
+}
+
+static inline double
+onvm_cycles_to_us(uint64_t cycles) {
+        return cycles * 1000000.0 / rte_get_tsc_hz();
+}
+
+#endif  // _ONVM_LATENCY_H_
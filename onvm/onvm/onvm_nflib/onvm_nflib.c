@@ -64,6 +64,8 @@
 #include "onvm_nflib.h"
 #include "onvm_includes.h"
 #include "onvm_sc_common.h"
+#include "onvm_latency.h"
+#include "onvm_qsbr.h"
 
 
 /**********************************Macros*************************************/
@@ -100,6 +102,27 @@ static struct rte_mempool *nf_msg_pool;
 // Shared data for default service chain
 static struct onvm_service_chain *default_chain;
 
+// Shared service to NF map and every NF's RX ring, for direct handoff
+static const struct onvm_service_map *service_map;
+static struct rte_ring *nf_rx_rings[MAX_CLIENTS];
+
+// Stages run by onvm_nflib_run_composed
+static pkt_handler composed_handlers[ONVM_MAX_CHAIN_LENGTH];
+static int composed_count;
+
+// Set by -t: send ONVM_NF_ACTION_OUT packets on our own NIC TX queue
+static uint8_t direct_tx;
+
+// Shared port info, and which ports we may transmit on, for direct_tx
+static struct port_info *ports;
+static uint8_t port_enabled[RTE_MAX_ETHPORTS];
+
+// Shared latency histograms, NULL unless the manager was started with -L
+static struct onvm_latency_info *latency_info;
+
+// Grace periods of the manager's shared state, we are one of its readers
+static struct onvm_qsbr *nf_qsbr;
+
 // Keeping track of the inital args (but only once), so we can use them again
 static int first_init_flag = 1;
 static int first_argc;
@@ -151,6 +174,46 @@ onvm_nflib_parse_args(int argc, char *argv[]);
 static void
 onvm_nflib_handle_signal(int sig);
 
+/*
+ * Hands packets sent to a local NF (ONVM_NF_ACTION_TONF) straight to that
+ * NF's RX ring. Packets for remote services, and any the destination
+ * can't take, are left for the manager.
+ *
+ * Input  : the packets, how many there are, this NF's info
+ *          an array to append the packets left for the manager to
+ * Output : the number of packets left for the manager
+ *
+ */
+static inline int
+onvm_nflib_send_direct(void **pkts, int count, struct onvm_nf_info *info, void **to_mgr);
+
+/*
+ * Sends packets with ONVM_NF_ACTION_OUT on this NF's own TX queue of
+ * their port, one burst per port. Packets the NIC doesn't take are
+ * dropped, as the manager would.
+ *
+ * Input  : the packets, how many there are, this NF's info
+ *
+ */
+static inline void
+onvm_nflib_send_out(void **pkts, int count, struct onvm_nf_info *info);
+
+/*
+ * Records in this NF's hop histogram how long ago the previous hop was
+ * done with each packet, and restarts the clock for the next hop.
+ *
+ * Input  : the packets, how many there are, this NF's info, the time now
+ *
+ */
+static inline void
+onvm_nflib_record_hops(void **pkts, int count, struct onvm_nf_info *info, uint64_t now);
+
+/*
+ * Packet handler running every stage given to onvm_nflib_run_composed.
+ */
+static int
+onvm_nflib_composed_handler(struct rte_mbuf* pkt, struct onvm_pkt_meta* meta);
+
 /*
  * Check if there are packets in this NF's RX Queue and process them
  */
@@ -190,6 +253,7 @@ onvm_nflib_init(int argc, char *argv[], const char *nf_tag, struct onvm_nf_info
         struct onvm_nf_info *nf_info;
         int retval_eal = 0;
         int retval_parse, retval_final;
+        unsigned i;
 
         /* Only do EAL init from the master core */
         if (first_init_flag && (retval_eal = rte_eal_init(argc, argv)) < 0)
@@ -258,6 +322,35 @@ onvm_nflib_init(int argc, char *argv[], const char *nf_tag, struct onvm_nf_info
 
 	onvm_sc_print(default_chain);
 
+        /* NFs only transmit themselves if the manager left them a queue */
+        if (direct_tx) {
+                mz = rte_memzone_lookup(MZ_PORT_INFO);
+                if (mz == NULL || ((struct port_info *)mz->addr)->nf_tx_queues <= nf_info->instance_id) {
+                        RTE_LOG(INFO, APP, "No NIC TX queue for this NF, sending packets out through the manager\n");
+                        direct_tx = 0;
+                } else {
+                        ports = mz->addr;
+                        for (i = 0; i < ports->num_ports; i++)
+                                port_enabled[ports->id[i]] = 1;
+                }
+        }
+
+        mz = rte_memzone_lookup(MZ_LATENCY_INFO);
+        if (mz != NULL && ((struct onvm_latency_info *)mz->addr)->enabled)
+                latency_info = mz->addr;
+
+        /* Without the map, every packet simply goes through the manager */
+        mz = rte_memzone_lookup(MZ_SERVICE_MAP);
+        if (mz != NULL) {
+                service_map = mz->addr;
+                for (i = 0; i < MAX_CLIENTS; i++)
+                        nf_rx_rings[i] = rte_ring_lookup(get_rx_queue_name(i));
+        }
+
+        nf_qsbr = onvm_qsbr_lookup(MZ_QSBR_INFO);
+        if (nf_qsbr == NULL)
+                rte_exit(EXIT_FAILURE, "Cannot get QSBR info");
+
         mgr_msg_queue = rte_ring_lookup(_MGR_MSG_QUEUE_NAME);
         if (mgr_msg_queue == NULL)
                 rte_exit(EXIT_FAILURE, "Cannot get nf_info ring");
@@ -341,6 +434,11 @@ onvm_nflib_run(
                 info->nf_pkt_function = handler;
         }
 
+        /* Before packets arrive, the handler may look up shared state */
+        info->qsbr_id = onvm_qsbr_register(nf_qsbr);
+        if (info->qsbr_id == ONVM_QSBR_NO_READER)
+                rte_exit(EXIT_FAILURE, "No QSBR reader slot left\n");
+
         printf("Sending NF_READY message to manager...\n");
         ret = onvm_nflib_nf_ready(info);
         if (ret != 0) rte_exit(EXIT_FAILURE, "Unable to message manager\n");
@@ -348,6 +446,7 @@ onvm_nflib_run(
         printf("[Press Ctrl-C to quit ...]\n");
         for (; keep_running;) {
                 onvm_nflib_dequeue_packets(pkts, info, handler);
+                onvm_qsbr_quiescent(nf_qsbr, info->qsbr_id);
                 onvm_nflib_dequeue_messages(info);
         }
 
@@ -358,15 +457,34 @@ onvm_nflib_run(
 }
 
 
+int
+onvm_nflib_run_composed(struct onvm_nf_info* info, pkt_handler *handlers, int count) {
+        int i;
+
+        if (handlers == NULL || count <= 0 || count > ONVM_MAX_CHAIN_LENGTH)
+                return -1;
+
+        for (i = 0; i < count; i++) {
+                if (handlers[i] == NULL)
+                        return -1;
+                composed_handlers[i] = handlers[i];
+        }
+        composed_count = count;
+
+        printf("Running %d composed packet handlers\n", count);
+        return onvm_nflib_run(info, onvm_nflib_composed_handler);
+}
+
+
 int
 onvm_nflib_return_pkt(struct onvm_nf_info *info, struct rte_mbuf* pkt) {
         /* FIXME: should we get a batch of buffered packets and then enqueue? Can we keep stats? */
         if(unlikely(rte_ring_enqueue(info->tx_ring, pkt) == -ENOBUFS)) {
                 rte_pktmbuf_free(pkt);
-                info->tx_stats->tx_drop[info->instance_id]++;
+                info->tx_stats[info->instance_id].tx_drop++;
                 return -ENOBUFS;
         }
-        else info->tx_stats->tx_returned[info->instance_id]++;
+        else info->tx_stats[info->instance_id].tx_returned++;
         return 0;
 }
 
@@ -447,25 +565,129 @@ onvm_nflib_get_tx_stats(struct onvm_nf_info* info) {
                 return NULL;
         }
 
-        /* We should return the tx_stats associated with the info struct */
+        /* We should return this NF's own block of the tx_stats */
         info->nf_mode = NF_MODE_RING;
-        return info->tx_stats;
+        return &info->tx_stats[info->instance_id];
 }
 
 
 /******************************Helper functions*******************************/
 
 
+static inline int
+onvm_nflib_send_direct(void **pkts, int count, struct onvm_nf_info *info, void **to_mgr) {
+        struct onvm_pkt_meta *meta;
+        uint16_t dst[PKT_READ_SIZE];
+        int i, start, left = 0;
+        unsigned sent;
+
+        for (i = 0; i < count; i++) {
+                meta = onvm_get_pkt_meta((struct rte_mbuf*)pkts[i]);
+                meta->src = info->instance_id;
+                dst[i] = onvm_service_map_lookup(service_map, meta->destination,
+                                                 ((struct rte_mbuf*)pkts[i])->hash.rss);
+        }
+
+        /* Send each run of packets for the same NF as one burst */
+        for (start = 0; start < count; start = i) {
+                for (i = start + 1; i < count && dst[i] == dst[start]; i++)
+                        ;
+                sent = 0;
+                if (dst[start] != 0 && nf_rx_rings[dst[start]] != NULL)
+                        sent = rte_ring_enqueue_burst(nf_rx_rings[dst[start]], pkts + start, i - start);
+                info->tx_stats[info->instance_id].tx_direct += sent;
+                for (; start + (int)sent < i; sent++)
+                        to_mgr[left++] = pkts[start + sent];
+        }
+
+        return left;
+}
+
+
+static int
+onvm_nflib_composed_handler(struct rte_mbuf* pkt, struct onvm_pkt_meta* meta) {
+        int i, ret;
+
+        for (i = 0; i < composed_count; i++) {
+                ret = (*composed_handlers[i])(pkt, meta);
+                /* Buffered or dropped, the packet goes no further */
+                if (ret != 0 || meta->action == ONVM_NF_ACTION_DROP)
+                        return ret;
+                /* Any other verdict hands it to the next stage, which
+                 * overwrites it. The last stage's is the one we return. */
+        }
+
+        return 0;
+}
+
+
+static inline void
+onvm_nflib_send_out(void **pkts, int count, struct onvm_nf_info *info) {
+        struct onvm_pkt_meta *meta;
+        uint16_t port, sent;
+        int i, start;
+
+        for (start = 0; start < count; start = i) {
+                meta = onvm_get_pkt_meta((struct rte_mbuf*)pkts[start]);
+                port = meta->destination;
+                meta->src = info->instance_id;
+                for (i = start + 1; i < count; i++) {
+                        meta = onvm_get_pkt_meta((struct rte_mbuf*)pkts[i]);
+                        if (meta->destination != port)
+                                break;
+                        meta->src = info->instance_id;
+                }
+
+                if (latency_info != NULL) {
+                        /* Before the NIC may free them */
+                        uint64_t now = rte_rdtsc();
+                        int j;
+
+                        for (j = start; j < i; j++)
+                                onvm_hist_record(&latency_info->out[info->instance_id],
+                                                 now - onvm_get_pkt_priv((struct rte_mbuf*)pkts[j])->rx_tsc);
+                }
+                sent = rte_eth_tx_burst(port, info->instance_id, (struct rte_mbuf **)pkts + start, i - start);
+                info->tx_stats[info->instance_id].port_tx[port] += sent;
+                if (unlikely(sent < i - start)) {
+                        info->tx_stats[info->instance_id].port_tx_drop[port] += i - start - sent;
+                        for (; start + sent < i; sent++)
+                                rte_pktmbuf_free(pkts[start + sent]);
+                }
+        }
+}
+
+
+static inline void
+onvm_nflib_record_hops(void **pkts, int count, struct onvm_nf_info *info, uint64_t now) {
+        struct onvm_pkt_priv *priv;
+        int i;
+
+        for (i = 0; i < count; i++) {
+                priv = onvm_get_pkt_priv((struct rte_mbuf*)pkts[i]);
+                onvm_hist_record(&latency_info->hop[info->instance_id], now - priv->hop_tsc);
+                priv->hop_tsc = now;
+        }
+}
+
+
 static inline void
 onvm_nflib_dequeue_packets(void **pkts, struct onvm_nf_info *info, pkt_handler handler) {
         struct onvm_pkt_meta* meta;
         uint16_t i, j, nb_pkts;
         void *pktsTX[PKT_READ_SIZE];
+        void *pktsDirect[PKT_READ_SIZE];
+        void *pktsOut[PKT_READ_SIZE];
         int tx_batch_size = 0;
+        int direct_size = 0;
+        int out_size = 0;
         int ret_act;
 
-	/* Dequeue all packets in ring up to max possible. */
-	nb_pkts = rte_ring_dequeue_burst(info->rx_ring, pkts, PKT_READ_SIZE);
+	/* Dequeue all packets in ring up to max possible, but no more than
+	 * the manager can take back, so a full TX ring backs up into our RX
+	 * ring instead of dropping packets here. */
+	nb_pkts = rte_ring_dequeue_burst(info->rx_ring, pkts,
+	                                 RTE_MIN((unsigned)PKT_READ_SIZE, rte_ring_free_count(info->tx_ring)));
 
         if(unlikely(nb_pkts == 0)) {
                 return;
@@ -476,20 +698,40 @@ onvm_nflib_dequeue_packets(void **pkts, struct onvm_nf_info *info, pkt_handler h
                 meta = onvm_get_pkt_meta((struct rte_mbuf*)pkts[i]);
                 ret_act = (*handler)((struct rte_mbuf*)pkts[i], meta);
                 /* NF returns 0 to return packets or 1 to buffer */
-                if(likely(ret_act == 0)) {
-                        pktsTX[tx_batch_size++] = pkts[i];
+                if (likely(ret_act == 0)) {
+                        if (meta->action == ONVM_NF_ACTION_TONF && service_map != NULL)
+                                pktsDirect[direct_size++] = pkts[i];
+                        else if (meta->action == ONVM_NF_ACTION_OUT && direct_tx &&
+                                 meta->destination < RTE_MAX_ETHPORTS && port_enabled[meta->destination])
+                                pktsOut[out_size++] = pkts[i];
+                        else
+                                pktsTX[tx_batch_size++] = pkts[i];
                 } else {
-                        info->tx_stats->tx_buffer[info->instance_id]++;
+                        info->tx_stats[info->instance_id].tx_buffer++;
                 }
         }
 
+        if (latency_info != NULL) {
+                uint64_t now = rte_rdtsc();
+
+                onvm_nflib_record_hops(pktsTX, tx_batch_size, info, now);
+                onvm_nflib_record_hops(pktsDirect, direct_size, info, now);
+                onvm_nflib_record_hops(pktsOut, out_size, info, now);
+        }
+
+        if (direct_size > 0)
+                tx_batch_size += onvm_nflib_send_direct(pktsDirect, direct_size, info, pktsTX + tx_batch_size);
+
+        if (out_size > 0)
+                onvm_nflib_send_out(pktsOut, out_size, info);
+
         if (unlikely(tx_batch_size > 0 && rte_ring_enqueue_bulk(info->tx_ring, pktsTX, tx_batch_size) == -ENOBUFS)) {
-                info->tx_stats->tx_drop[info->instance_id] += tx_batch_size;
+                info->tx_stats[info->instance_id].tx_drop += tx_batch_size;
                 for (j = 0; j < tx_batch_size; j++) {
                         rte_pktmbuf_free(pktsTX[j]);
                 }
         } else {
-                info->tx_stats->tx[info->instance_id] += tx_batch_size;
+                info->tx_stats[info->instance_id].tx += tx_batch_size;
         }
 }
 
@@ -587,6 +829,9 @@ onvm_nflib_info_init(const char *tag)
         info->service_id = service_id;
         info->status = NF_WAITING_FOR_ID;
         info->tag = tag;
+        info->qsbr_id = ONVM_QSBR_NO_READER;
+        info->pid = getpid();
+        info->pid_ns = onvm_pid_ns();
 
         // Set core headroom. This is the number of excess cores we have
         // or 0, if this is not the master core
@@ -602,7 +847,8 @@ static void
 onvm_nflib_usage(const char *progname) {
         printf("Usage: %s [EAL args] -- "
                "[-n <instance_id>]"
-               "[-r <service_id>]\n\n", progname);
+               "[-r <service_id>]"
+               "[-t (send packets out on the NIC directly)]\n\n", progname);
 }
 
 
@@ -612,7 +858,7 @@ onvm_nflib_parse_args(int argc, char *argv[]) {
         int c;
 
         opterr = 0;
-        while ((c = getopt (argc, argv, "n:r:")) != -1)
+        while ((c = getopt (argc, argv, "n:r:t")) != -1)
                 switch (c) {
                 case 'n':
                         initial_instance_id = (uint16_t) strtoul(optarg, NULL, 10);
@@ -622,6 +868,9 @@ onvm_nflib_parse_args(int argc, char *argv[]) {
                         // Service id 0 is reserved
                         if (service_id == 0) service_id = -1;
                         break;
+                case 't':
+                        direct_tx = 1;
+                        break;
                 case '?':
                         onvm_nflib_usage(progname);
                         if (optopt == 'n')
@@ -657,6 +906,12 @@ onvm_nflib_cleanup(struct onvm_nf_info *nf_info)
         struct onvm_nf_msg *shutdown_msg;
         nf_info->status = NF_STOPPED;
 
+        /* Don't hold up the manager's writers once we are gone */
+        if (nf_info->qsbr_id != ONVM_QSBR_NO_READER) {
+                onvm_qsbr_unregister(nf_qsbr, nf_info->qsbr_id);
+                nf_info->qsbr_id = ONVM_QSBR_NO_READER;
+        }
+
         /* Put this NF's info struct back into queue for manager to ack shutdown */
         RTE_LOG(INFO, APP, "Shutting down NF %u\n", nf_info->instance_id);
         if (mgr_msg_queue == NULL) {
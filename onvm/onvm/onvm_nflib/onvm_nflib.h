@@ -83,7 +83,10 @@ onvm_nflib_init(int argc, char *argv[], const char *nf_tag, struct onvm_nf_info
 /**
  * Run the OpenNetVM container Library.
  * This will register the callback used for each new packet. It will then
- * loop forever waiting for packets.
+ * loop forever waiting for packets. The NF is a reader of the manager's
+ * shared state (onvm_qsbr.h) while it runs, passing a quiescent state
+ * after each batch, so the handler may use flow director entries and
+ * chains until it returns, but must not keep them across calls.
  *
  * @param info
  *   an info struct describing this NF app. Must be from a huge page memzone.
@@ -96,6 +99,28 @@ int
 onvm_nflib_run(struct onvm_nf_info* info, int(*handler)(struct rte_mbuf* pkt, struct onvm_pkt_meta* action));
 
 
+/**
+ * Run several packet handlers back to back in this one NF, which the
+ * manager sees as a single NF of info's service. Each packet goes through
+ * all the stages in order, and leaves with the last stage's action and
+ * destination, as if the stages were standalone NFs chained one after the
+ * other. The forwarding verdicts of the earlier stages (NEXT, TONF or OUT)
+ * only pass the packet on. A stage that drops or buffers the packet ends
+ * the chain there. Otherwise behaves like onvm_nflib_run.
+ *
+ * @param info
+ *   an info struct describing this NF app. Must be from a huge page memzone.
+ * @param handlers
+ *   the packet handlers of the stages, in order.
+ * @param count
+ *   the number of stages, at most ONVM_MAX_CHAIN_LENGTH.
+ * @return
+ *   0 on success, or a negative value on error.
+ */
+int
+onvm_nflib_run_composed(struct onvm_nf_info* info, pkt_handler *handlers, int count);
+
+
 /**
  * Return a packet that has previously had the ONVM_NF_ACTION_BUFFER action
  * called on it.
@@ -164,7 +189,8 @@ onvm_nflib_get_rx_ring(struct onvm_nf_info* info);
 
 
 /**
- * Return the tx_stats associated with this NF.
+ * Return the tx_stats associated with this NF. The structure is this NF's
+ * alone, on its own cache lines, so it can be updated without atomics.
  *
  * @param info
  *   an info struct describing this NF app.
@@ -0,0 +1,185 @@
+/*********************************************************************
+ *                     openNetVM
+ *              https://sdnfv.github.io
+ *
+ *   BSD LICENSE
+ *
+ *   Copyright(c)
+ *            2015-2016 George Washington University
+ *            2015-2016 University of California Riverside
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * The name of the author may not be used to endorse or promote
+ *       products derived from this software without specific prior
+ *       written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * onvm_qsbr.c - quiescent state based reclamation shared between
+ *               the manager and NFs
+ ********************************************************************/
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <rte_memzone.h>
+#include <rte_lcore.h>
+#include <rte_cycles.h>
+#include <rte_log.h>
+
+#include "onvm_common.h"
+#include "onvm_qsbr.h"
+
+#define NO_FLAGS 0
+#define QSBR_SYNC_SLEEP_US 10
+#define QSBR_SYNC_WARN_US 1000000       // how often a late reader is reported
+
+static void onvm_qsbr_check_late(struct onvm_qsbr *qs, uint64_t token);
+
+struct onvm_qsbr *
+onvm_qsbr_create(const char *name) {
+        const struct rte_memzone *mz;
+
+        mz = rte_memzone_reserve(name, sizeof(struct onvm_qsbr),
+                                 rte_socket_id(), NO_FLAGS);
+        if (mz == NULL)
+                return NULL;
+
+        memset(mz->addr, 0, sizeof(struct onvm_qsbr));
+        return mz->addr;
+}
+
+struct onvm_qsbr *
+onvm_qsbr_lookup(const char *name) {
+        const struct rte_memzone *mz;
+
+        mz = rte_memzone_lookup(name);
+        if (mz == NULL)
+                return NULL;
+
+        return mz->addr;
+}
+
+int
+onvm_qsbr_register(struct onvm_qsbr *qs) {
+        int i;
+
+        if (qs == NULL)
+                return ONVM_QSBR_NO_READER;
+
+        for (i = 0; i < ONVM_QSBR_MAX_READERS; i++) {
+                if (!rte_atomic16_test_and_set(&qs->reader[i].in_use))
+                        continue;
+                qs->reader[i].pid = getpid();
+                qs->reader[i].pid_ns = onvm_pid_ns();
+                onvm_qsbr_online(qs, i);
+                return i;
+        }
+
+        return ONVM_QSBR_NO_READER;
+}
+
+void
+onvm_qsbr_unregister(struct onvm_qsbr *qs, int id) {
+        if (qs == NULL || id < 0 || id >= ONVM_QSBR_MAX_READERS)
+                return;
+
+        onvm_qsbr_offline(qs, id);
+        rte_atomic16_clear(&qs->reader[id].in_use);
+}
+
+void
+onvm_qsbr_offline(struct onvm_qsbr *qs, int id) {
+        rte_smp_mb();
+        qs->reader[id].online = 0;
+}
+
+void
+onvm_qsbr_online(struct onvm_qsbr *qs, int id) {
+        qs->reader[id].seen = qs->token;
+        qs->reader[id].online = 1;
+        /* Make sure writers see us online before we read anything shared */
+        rte_smp_mb();
+}
+
+uint64_t
+onvm_qsbr_start(struct onvm_qsbr *qs) {
+        /* Writers may live in different processes, so bump atomically */
+        return __sync_add_and_fetch(&qs->token, 1);
+}
+
+int
+onvm_qsbr_check(struct onvm_qsbr *qs, uint64_t token) {
+        int i;
+
+        rte_smp_mb();
+        for (i = 0; i < ONVM_QSBR_MAX_READERS; i++) {
+                if (!rte_atomic16_read(&qs->reader[i].in_use) || !qs->reader[i].online)
+                        continue;
+                if (qs->reader[i].seen < token)
+                        return 0;
+        }
+
+        return 1;
+}
+
+void
+onvm_qsbr_synchronize(struct onvm_qsbr *qs) {
+        uint64_t token, warn_cycles, next_warn;
+
+        token = onvm_qsbr_start(qs);
+        warn_cycles = rte_get_tsc_hz() / 1000000 * QSBR_SYNC_WARN_US;
+        next_warn = rte_rdtsc() + warn_cycles;
+        while (!onvm_qsbr_check(qs, token)) {
+                if (rte_rdtsc() > next_warn) {
+                        onvm_qsbr_check_late(qs, token);
+                        next_warn = rte_rdtsc() + warn_cycles;
+                }
+                usleep(QSBR_SYNC_SLEEP_US);
+        }
+}
+
+/* A late reader is only given up on once its process has exited, which
+ * we can tell only when it shares our pid namespace. The caller may be
+ * the thread that would otherwise notice the exit, so it is put offline
+ * here; the slot itself stays in use until its owner is cleaned up. */
+static void
+onvm_qsbr_check_late(struct onvm_qsbr *qs, uint64_t token) {
+        struct onvm_qsbr_reader *r;
+        int i;
+
+        for (i = 0; i < ONVM_QSBR_MAX_READERS; i++) {
+                r = &qs->reader[i];
+                if (!rte_atomic16_read(&r->in_use) || !r->online || r->seen >= token)
+                        continue;
+                if (r->pid != getpid() && r->pid_ns == onvm_pid_ns() &&
+                    kill(r->pid, 0) < 0 && errno == ESRCH) {
+                        RTE_LOG(WARNING, APP, "QSBR reader %d (pid %d) exited, putting it offline\n",
+                                i, (int)r->pid);
+                        r->online = 0;
+                        continue;
+                }
+                RTE_LOG(WARNING, APP, "Still waiting for QSBR reader %d (pid %d)\n", i, (int)r->pid);
+        }
+}
@@ -0,0 +1,125 @@
+/*********************************************************************
+ *                     openNetVM
+ *              https://sdnfv.github.io
+ *
+ *   BSD LICENSE
+ *
+ *   Copyright(c)
+ *            2015-2016 George Washington University
+ *            2015-2016 University of California Riverside
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * The name of the author may not be used to endorse or promote
+ *       products derived from this software without specific prior
+ *       written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * onvm_qsbr.h - quiescent state based reclamation shared between
+ *               the manager and NFs
+ ********************************************************************/
+
+#ifndef _ONVM_QSBR_H_
+#define _ONVM_QSBR_H_
+
+#include <sys/types.h>
+
+#include <rte_common.h>
+#include <rte_atomic.h>
+
+#define ONVM_QSBR_MAX_READERS 64
+#define ONVM_QSBR_NO_READER -1
+
+/* One slot per reader thread. Each slot lives on its own cache line so
+ * readers never write to a line another reader is writing to. */
+struct onvm_qsbr_reader {
+        volatile uint64_t seen;         /* last token this reader acknowledged */
+        volatile uint8_t online;        /* reader may currently hold references */
+        rte_atomic16_t in_use;          /* slot is registered */
+        pid_t pid;                      /* process that registered it */
+        uint64_t pid_ns;                /* and its pid namespace, see onvm_pid_ns */
+} __rte_cache_aligned;
+
+/* Writers advance the token, readers copy it into their slot whenever they
+ * are between packet batches (a quiescent state). Once every online reader
+ * has copied a token >= the one a writer started with, no reader can still
+ * hold a pointer that was unpublished before that token was handed out. */
+struct onvm_qsbr {
+        volatile uint64_t token __rte_cache_aligned;
+        struct onvm_qsbr_reader reader[ONVM_QSBR_MAX_READERS];
+};
+
+/* Reserve a memzone for a QSBR instance. Called once by the manager.
+ * Returns NULL if the memzone could not be reserved. */
+struct onvm_qsbr *
+onvm_qsbr_create(const char *name);
+
+/* Find a QSBR instance created by the manager. Returns NULL if missing. */
+struct onvm_qsbr *
+onvm_qsbr_lookup(const char *name);
+
+/* Take a reader slot. The reader starts online.
+ * Returns the slot id, or ONVM_QSBR_NO_READER if all slots are taken. */
+int
+onvm_qsbr_register(struct onvm_qsbr *qs);
+
+/* Give a reader slot back. The reader must not hold any references. */
+void
+onvm_qsbr_unregister(struct onvm_qsbr *qs, int id);
+
+/* Mark a reader as not holding references until the next onvm_qsbr_online,
+ * e.g. while a thread sleeps. Writers do not wait for offline readers. */
+void
+onvm_qsbr_offline(struct onvm_qsbr *qs, int id);
+
+void
+onvm_qsbr_online(struct onvm_qsbr *qs, int id);
+
+/* Start a grace period. Returns the token to pass to onvm_qsbr_check. */
+uint64_t
+onvm_qsbr_start(struct onvm_qsbr *qs);
+
+/* Returns 1 once every online reader has passed through a quiescent state
+ * since `token` was handed out by onvm_qsbr_start, 0 otherwise. */
+int
+onvm_qsbr_check(struct onvm_qsbr *qs, uint64_t token);
+
+/* Start a grace period and wait for it to end. Must not be called by a
+ * registered, online reader.
+ *
+ * A reader that stays behind is waited for as long as it lives, with a
+ * warning every QSBR_SYNC_WARN_US. One whose process is gone is put
+ * offline; its slot is released by whoever notices the exit. */
+void
+onvm_qsbr_synchronize(struct onvm_qsbr *qs);
+
+/* Called by a reader between batches, when it holds no references to
+ * shared data. This is on the fast path so it is kept inline. */
+static inline void
+onvm_qsbr_quiescent(struct onvm_qsbr *qs, int id) {
+        /* All loads of shared pointers must be done before we publish */
+        rte_smp_mb();
+        qs->reader[id].seen = qs->token;
+}
+
+#endif  // _ONVM_QSBR_H_